@@ -38,7 +38,7 @@ Cond Cond::Not() {
 
 // Shift
 std::string Shift ::str() const {
-    static std::string m[]{"LSL"};
+    static std::string m[]{"LSL", "LSR", "ASR"};
     return m[type] + " #" + std::to_string(imm);
 }
 
@@ -89,51 +89,35 @@ std::vector<Reg *> Address::RRegs() {
 
 // Define
 
-std::string getvalString(std::shared_ptr<ir::InitVal> init) {
-    std::string s = "";
-    switch (init->kind) {
-    case ir::InitVal::kZero: {
-        auto p0 = std::dynamic_pointer_cast<ir::Zeroinitializer>(init);
-        auto ty = p0->ty;
-        int count = 1;
-        if (ty->kind == ir::Type::kArray) {
-            auto karray = std::dynamic_pointer_cast<ir::ArrayT>(ty);
-            count = karray->count;
-        }
-        for (int i = 0; i < count; i++) {
-            s = s + ".word 0";
-            if (i < count - 1)
-                s = s + "\n";
-        }
-        break;
-    }
-
-    case ir::InitVal::kBasic: {
-        auto p1 = std::dynamic_pointer_cast<ir::BasicInit>(init);
-        s = s + ".word " + p1->val->str();
-        break;
+// 按内存布局展开初始值, 数组中缺省的元素为 0
+static void CollectWords(ir::InitVal *init, std::shared_ptr<ir::Type> ty,
+                         std::vector<Word> &words) {
+    if (!init || (init->kind != ir::InitVal::kBasic &&
+                  init->kind != ir::InitVal::kArray)) {
+        words.insert(words.end(), ty->size() / 4, 0);
+        return;
     }
-    case ir::InitVal::kArray: {
-        auto p2 = std::dynamic_pointer_cast<ir::ArrayInit>(init);
-        if (p2->vals.size() > 0) {
-            for (int i = 0; i < p2->vals.size(); i++) {
-                std::shared_ptr<ir::InitVal> k(p2->vals[i].get());
-                s += getvalString(k) + "\n";
-                if (i < p2->vals.size() - 1)
-                    s = s + "\n";
-            }
-        }
+    if (init->kind == ir::InitVal::kBasic) {
+        auto val = dynamic_cast<ir::BasicInit *>(init)->val;
+        words.push_back(std::dynamic_pointer_cast<ir::ImmValue>(val)->imm);
+        return;
     }
-    default:
-        break;
-    }
-    return s;
+    auto array = dynamic_cast<ir::ArrayInit *>(init);
+    for (int i = 0; i < array->ty->count; i++)
+        CollectWords(i < array->vals.size() ? array->vals[i].get() : nullptr,
+                     array->ty->element, words);
 }
 
-std::string Define::str() {
+std::vector<Word> Define::Words() {
+    std::vector<Word> words;
+    CollectWords(init.get(), init->type(), words);
+    return words;
+}
 
-    std::string s = name + ":\n";
-    s += getvalString(init);
+std::string Define::str() {
+    std::string s = name + ":";
+    for (auto w : Words())
+        s += "\n.word " + std::to_string((int)w);
     return s;
 }
 }; // namespace backend
@@ -1,4 +1,5 @@
 #include "backend.h"
+#include "opt/opt.h"
 #include <stdarg.h>
 
 namespace backend {
@@ -22,16 +23,15 @@ void BB::SetBranch(Cond cond, std::string label) {
 /************   StackFrame   ***************/
 void StackFrame ::Dump(std::ostream &os) {
     os << "[sp, 0] -------------------------------\n"
-       << "\t" << max_call_arg_count * 4 << " (call arguments reserve area)\n"
+       << "\t" << CallArgSize() << " (call arguments reserve area)\n"
        << "--------------------------------------\n"
-       << "\t"
-       << "16 (r0-r4)\n"
+       << "\t" << BackupSize() << " (r0-r3, r12)\n"
        << "[" << Reg2Str(local_var_base)
        << ", 0] -------------------------------\n"
        << "\t" << local_var_size << " (local variable area)\n"
        << "[" << Reg2Str(local_var_base) << ", " << local_var_size
        << "] -------------------------------\n"
-       << "\t" << 9 * 4 << " (r0-r7, lr)\n"
+       << "\t" << SaveRegSize() << " (saved regs)\n"
        << "--------------------------------------\n"
        << spilled_arg_count * 4 << " (spilled arguments)\n"
        << "--------------------------------------\n";
@@ -59,11 +59,12 @@ Address StackFrame ::CallArgAddr(int idx) {
 }
 
 Address StackFrame ::BackupAddress(Reg r) {
-    assert((int)r < max_reg_arg_count);
+    assert(need_backup && ((int)r < max_reg_arg_count || r == Reg::R12));
+    int idx = r == Reg::R12 ? max_reg_arg_count : (int)r;
     Address addr;
     addr.mode = Address::kMBaseImm;
     addr.base = Reg::SP;
-    addr.offset.imm = (max_call_arg_count + (int)r) * 4;
+    addr.offset.imm = CallArgSize() + idx * 4;
     return addr;
 }
 
@@ -82,10 +83,8 @@ inline int StackFrame ::SpilledArgOffset() {
 
 // r7 +
 int StackFrame ::ArgOffset(int idx) {
-    if (idx < max_reg_arg_count)
-        return local_var_size + idx * 4;
-    else
-        return SpilledArgOffset() + (idx - max_reg_arg_count) * 4;
+    assert(idx >= max_reg_arg_count);
+    return SpilledArgOffset() + (idx - max_reg_arg_count) * 4;
 }
 
 Address StackFrame ::ArgAddr(int idx) {
@@ -111,23 +110,6 @@ void Func ::dump(std::ostream &os) {
         bb->dump(os);
     }
     end.dump(os);
-    for (auto &i : imms) {
-        os << i.first << ":\n" << i.second->str() << "\n";
-    }
-}
-
-std::string Func ::CreateIntImm(Word v) {
-    auto it = imms.find(v);
-    if (it != imms.end())
-        return it->second->label;
-    std::string label;
-    auto imm = std::make_unique<Imm>();
-    imm->v = v;
-    imm->ty = ".int";
-    label = "__const_" + name + "_" + std::to_string(v);
-    imm->label = label;
-    imms.insert({v, std::move(imm)});
-    return label;
 }
 
 Reg Func ::AllocaVReg() { return (Reg)vreg++; }
@@ -138,6 +120,77 @@ void Func ::ResetBBID() {
         bb->id = i++;
 }
 
+// 由回边 (指向 DFS 栈上结点的边) 求自然循环, 块的循环深度为包含它的循环数
+void Func ::ComputeLoopDepth() {
+    ResetBBID();
+    int n = bbs.size();
+    for (auto &bb : bbs)
+        bb->loop_depth = 0;
+    if (n == 0)
+        return;
+
+    // 中端已在 IR 上求出循环信息时直接使用, 拆分关键边新建的块不在 IR 中,
+    // 取两端深度的较小值
+    if (bbs[0]->ir_bb && opt::loop::HasLoopInfo(bbs[0]->ir_bb)) {
+        for (auto &bb : bbs)
+            if (bb->ir_bb)
+                bb->loop_depth = opt::loop::Depth(bb->ir_bb);
+        for (auto &bb : bbs)
+            if (!bb->ir_bb && !bb->preds.empty() && !bb->succs.empty())
+                bb->loop_depth = std::min(bb->preds[0]->loop_depth,
+                                          bb->succs[0]->loop_depth);
+        return;
+    }
+
+    auto valid = [&](BB *bb) { return bb != &end && bb != &entry; };
+    std::vector<int> vis(n, 0); // 0: 未访问, 1: 在栈上, 2: 已完成
+    std::vector<std::pair<BB *, std::vector<BB *>>> loops; // 循环头, 回边起点
+    std::vector<std::pair<BB *, int>> stack{{bbs[0].get(), 0}};
+    vis[0] = 1;
+    while (!stack.empty()) {
+        auto &top = stack.back();
+        BB *bb = top.first;
+        if (top.second < bb->succs.size()) {
+            BB *succ = bb->succs[top.second++];
+            if (!valid(succ))
+                continue;
+            if (vis[succ->id] == 1) {
+                auto it = std::find_if(loops.begin(), loops.end(),
+                                       [&](auto &l) { return l.first == succ; });
+                if (it == loops.end())
+                    loops.push_back({succ, {bb}});
+                else
+                    it->second.push_back(bb);
+            } else if (vis[succ->id] == 0) {
+                vis[succ->id] = 1;
+                stack.push_back({succ, 0});
+            }
+        } else {
+            vis[bb->id] = 2;
+            stack.pop_back();
+        }
+    }
+
+    // 从回边起点沿前驱反向搜索, 直到循环头
+    for (auto &[header, tails] : loops) {
+        std::vector<bool> body(n, false);
+        body[header->id] = true;
+        std::vector<BB *> work(tails.begin(), tails.end());
+        while (!work.empty()) {
+            BB *bb = work.back();
+            work.pop_back();
+            if (body[bb->id])
+                continue;
+            body[bb->id] = true;
+            for (auto pred : bb->preds)
+                if (valid(pred))
+                    work.push_back(pred);
+        }
+        for (auto &bb : bbs)
+            bb->loop_depth += body[bb->id];
+    }
+}
+
 /************   func   ***************/
 
 }; // namespace backend
\ No newline at end of file
@@ -0,0 +1,356 @@
+#include "backend.h"
+#include <cstring>
+
+namespace backend {
+
+// 预先生成的名字表, 与 Reg2Str / Cond::str 等一致
+static const char *reg_names[]{
+    "R0", "R1",  "R2", "R3",  "R4",  "R5", "R6", "R7", "R8",
+    "R9", "R10", "FP", "R12", "R13", "SP", "LR", "PC",
+};
+static const char *cond_names[]{"EQ", "NE", "HI", "HS", "LS", "LO",
+                                "GT", "GE", "LT", "LE", ""};
+static const char *shift_names[]{"LSL", "LSR", "ASR"};
+static const char *alu_names[]{"ADD", "SUB", "RSB", "MUL", "SMMUL",
+                               "SDIV", "UDIV", "AND", "OR", "ADC",
+                               "LSL", "LSR", "ASR"};
+
+void AsmWriter::Flush() {
+    if (len > 0)
+        fwrite(buf, 1, len, fp);
+    len = 0;
+}
+
+void AsmWriter::Put(char c) {
+    if (len == kBufSize)
+        Flush();
+    buf[len++] = c;
+}
+
+void AsmWriter::Put(const char *s, int n) {
+    if (len + n > kBufSize) {
+        Flush();
+        if (n > kBufSize) { // 超长的直接写出
+            fwrite(s, 1, n, fp);
+            return;
+        }
+    }
+    memcpy(buf + len, s, n);
+    len += n;
+}
+
+void AsmWriter::Put(const char *s) { Put(s, strlen(s)); }
+
+void AsmWriter::PutNum(long long x) {
+    char tmp[24];
+    int n = sizeof(tmp);
+    bool neg = x < 0;
+    unsigned long long u = neg ? -(unsigned long long)x : x;
+    do {
+        tmp[--n] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (neg)
+        tmp[--n] = '-';
+    Put(tmp + n, sizeof(tmp) - n);
+}
+
+void AsmWriter::PutReg(Reg r) {
+    if (r == Reg::INVALID)
+        Put("INVALID");
+    else if ((unsigned)r < (unsigned)Reg::VREG)
+        Put(reg_names[(unsigned)r]);
+    else {
+        Put('V');
+        PutNum((unsigned)r - (unsigned)Reg::VREG);
+    }
+}
+
+void AsmWriter::PutRegImm(RegImmU x, int flags) {
+    if (flags & Instr::kFlagBIsImm) {
+        Put('#');
+        PutNum(x.imm);
+    } else {
+        PutReg(x.r);
+    }
+}
+
+void AsmWriter::PutShift(const Shift &shift) {
+    Put(shift_names[shift.type]);
+    Put(" #");
+    PutNum(shift.imm);
+}
+
+void AsmWriter::PutAddr(const Address &addr) {
+    int m = addr.mode & Address::mode_m_mask;
+    if (m == Address::KMLabel) {
+        Put(addr.label);
+        return;
+    }
+    int index = addr.mode & Address::mode_index_mask;
+    Put('[');
+    PutReg(addr.base);
+    if (m == Address::kMBase) {
+        Put(']');
+        return;
+    }
+    Put(index == Address::PostIndex ? "], " : ", ");
+    switch (m) {
+    case Address::kMBaseImm:
+        Put('#');
+        PutNum(addr.offset.imm);
+        break;
+    case Address::kMBaseReg:
+        PutReg(addr.offset.reg);
+        break;
+    case Address::kMBaseRegShift:
+        PutReg(addr.offset.reg);
+        Put(", ");
+        PutShift(addr.offset.shift);
+        break;
+    }
+    if (index == Address::PreIndex)
+        Put("]!");
+    else if (index != Address::PostIndex)
+        Put(']');
+}
+
+void AsmWriter::PutRegList(const std::pair<Reg, Reg> &range,
+                           const std::vector<Reg> &regs) {
+    Put('{');
+    if (range.first != range.second) {
+        PutReg(range.first);
+        Put('-');
+        PutReg(range.second);
+        if (regs.size() > 0)
+            Put(", ");
+    }
+    for (int i = 0; i < regs.size(); i++) {
+        if (i > 0)
+            Put(',');
+        PutReg(regs[i]);
+    }
+    Put('}');
+}
+
+void AsmWriter::Write(Instr *inst) {
+    switch (inst->op) {
+    case Instr::kLDR: {
+        auto ldr = dynamic_cast<LDR *>(inst);
+        Put("LDR ");
+        PutReg(ldr->rd);
+        Put(ldr->eq_addr ? ", =" : ", ");
+        PutAddr(ldr->addr);
+    } break;
+    case Instr::kSTR: {
+        auto str = dynamic_cast<STR *>(inst);
+        Put("STR ");
+        PutReg(str->rd);
+        Put(", ");
+        PutAddr(str->addr);
+    } break;
+    case Instr::kLDRD:
+    case Instr::kSTRD: {
+        Reg rd, rd2;
+        const Address *addr;
+        if (auto ldrd = dynamic_cast<LDRD *>(inst)) {
+            rd = ldrd->rd, rd2 = ldrd->rd2, addr = &ldrd->addr;
+        } else {
+            auto strd = dynamic_cast<STRD *>(inst);
+            rd = strd->rd, rd2 = strd->rd2, addr = &strd->addr;
+        }
+        Put(inst->op == Instr::kLDRD ? "LDRD " : "STRD ");
+        PutReg(rd);
+        Put(", ");
+        PutReg(rd2);
+        Put(", ");
+        PutAddr(*addr);
+    } break;
+    case Instr::kPUSH: {
+        auto push = dynamic_cast<PUSH *>(inst);
+        Put("PUSH ");
+        PutRegList(push->range, push->regs);
+    } break;
+    case Instr::kPOP: {
+        auto pop = dynamic_cast<POP *>(inst);
+        Put("POP ");
+        PutRegList(pop->range, pop->regs);
+    } break;
+    case Instr::kADR: {
+        auto adr = dynamic_cast<ADR *>(inst);
+        Put("ADR ");
+        PutReg(adr->rd);
+        Put(", ");
+        Put(adr->label);
+    } break;
+    case Instr::kB: {
+        auto b = dynamic_cast<Branch *>(inst);
+        Put('B');
+        Put(cond_names[b->cond.type]);
+        Put(' ');
+        Put(b->label);
+    } break;
+    case Instr::kBL:
+        Put("BL ");
+        Put(dynamic_cast<BranchLink *>(inst)->label);
+        break;
+    case Instr::kCall: {
+        auto call = dynamic_cast<Call *>(inst);
+        Put("BL ");
+        Put(call->func);
+        Put(" // call ");
+        for (auto r : call->args) {
+            PutReg(r);
+            Put(' ');
+        }
+        if (call->ret != Reg::INVALID) {
+            Put("-> ");
+            PutReg(call->ret);
+        }
+    } break;
+    case Instr::kBX:
+        Put("BX ");
+        PutReg(dynamic_cast<BranchExchange *>(inst)->r);
+        break;
+    case Instr::kMOV:
+    case Instr::kMVN: {
+        auto mov = dynamic_cast<MOV *>(inst);
+        Put(inst->op == Instr::kMVN ? "MVN" : "MOV");
+        Put(cond_names[inst->cond.type]);
+        Put(' ');
+        PutReg(mov->rd);
+        Put(", ");
+        PutRegImm(mov->src, inst->flags);
+    } break;
+    case Instr::kMOVW:
+    case Instr::kMOVT: {
+        auto mw = dynamic_cast<MoveWide *>(inst);
+        bool movw = inst->op == Instr::kMOVW;
+        Put(movw ? "MOVW" : "MOVT");
+        Put(cond_names[inst->cond.type]);
+        Put(' ');
+        PutReg(mw->rd);
+        Put(", #");
+        if (mw->label.empty()) {
+            PutNum(mw->imm);
+        } else {
+            Put(movw ? ":lower16:" : ":upper16:");
+            Put(mw->label);
+        }
+    } break;
+    case Instr::kNEG: {
+        auto neg = dynamic_cast<NEG *>(inst);
+        Put("NEG ");
+        PutReg(neg->rd);
+        Put(", ");
+        PutReg(neg->rs);
+    } break;
+    case Instr::kCMP: {
+        auto cmp = dynamic_cast<CMP *>(inst);
+        Put("CMP ");
+        PutReg(cmp->a);
+        Put(", ");
+        PutRegImm(cmp->b, inst->flags);
+    } break;
+    case Instr::kLabel:
+        Put(dynamic_cast<LabelInstr *>(inst)->label);
+        Put(':');
+        break;
+    case Instr::kIT: {
+        auto it = dynamic_cast<IT *>(inst);
+        Put("IT");
+        Put(it->mask);
+        Put(' ');
+        Put(cond_names[it->first.type]);
+    } break;
+    default: { // 运算指令
+        auto alu = dynamic_cast<BinaryAlu *>(inst);
+        Put(alu_names[inst->op - Instr::kADD]);
+        Put(cond_names[inst->cond.type]);
+        Put(' ');
+        PutReg(alu->rd);
+        Put(", ");
+        PutReg(alu->a);
+        Put(", ");
+        PutRegImm(alu->b, inst->flags);
+        if (inst->flags & Instr::kFlagHasShift) {
+            Put(", ");
+            PutShift(alu->shift);
+        }
+    } break;
+    }
+}
+
+void AsmWriter::Write(BB &bb) {
+    if (bb.label.length() > 0) {
+        Put(bb.label);
+        Put(":\n");
+    }
+    for (auto &inst : bb.insts) {
+        Put("    ");
+        Write(inst.get());
+        Put('\n');
+    }
+    if (bb.branch) {
+        Put("    ");
+        Write(bb.branch.get());
+        Put('\n');
+    }
+}
+
+void AsmWriter::Write(Func &f) {
+    Put("@ function: ");
+    Put(f.name);
+    Put(", argc: ");
+    PutNum(f.args.size());
+    Put(", ret: ");
+    PutNum(f.has_ret);
+    Put('\n');
+    if (f.cmt) {
+        Put(f.cmt.data);
+        Put('\n');
+    }
+    Put(f.name);
+    Put(":\n");
+    Write(f.entry);
+    for (auto &bb : f.bbs)
+        Write(*bb);
+    Write(f.end);
+}
+
+void AsmWriter::PutDefs(Asm &_asm, bool is_const) {
+    for (auto &def : _asm.defs) {
+        if (def->is_const != is_const)
+            continue;
+        Put(def->name);
+        Put(':');
+        for (auto w : def->Words()) {
+            Put("\n.word ");
+            PutNum((int)w);
+        }
+        Put('\n');
+    }
+}
+
+void AsmWriter::Write(Asm &_asm) {
+    Put(".data\n");
+    PutDefs(_asm, false);
+    Put("\n");
+
+    Put(".text\n"
+        ".global\tmain\n"
+        ".syntax unified\n"
+        ".code\t16\n"
+        ".thumb_func\n"
+        ".fpu softvfp\n"
+        ".type\tmain, %function\n");
+    for (auto &f : _asm.funcs) {
+        Write(*f);
+        Put('\n');
+    }
+    Put('\n');
+
+    PutDefs(_asm, true);
+}
+
+} // namespace backend
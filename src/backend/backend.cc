@@ -2,11 +2,47 @@
 
 #include <stdarg.h>
 #include "dbg.hpp"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
 
 namespace backend {
 
 bool NotAllowTy;
 
+const std::vector<TargetProfile> target_profiles{
+    // Thumb-2: 高位寄存器同样可以参与分配, r11 与 lr 用于中转溢出变量
+    {"thumb2",
+     {Reg::R0, Reg::R1, Reg::R2, Reg::R3, Reg::R4, Reg::R5, Reg::R6, Reg::R8,
+      Reg::R9, Reg::R10, Reg::R12},
+     {Reg::R11, Reg::LR}},
+    // 仅使用低位寄存器
+    {"thumb",
+     {Reg::R0, Reg::R1, Reg::R2, Reg::R3, Reg::R4, Reg::R5, Reg::R6},
+     {Reg::R12, Reg::LR}},
+};
+
+const TargetProfile *GetTargetProfile(std::string name) {
+    for (auto &profile : target_profiles)
+        if (profile.name == name)
+            return &profile;
+    return nullptr;
+}
+
+const std::vector<PipelineModel> pipeline_models{
+    // name, alu, alu_shift, mul, mul_high, div, load
+    {"cortex-a7", 1, 1, 3, 4, 12, 3},
+    {"cortex-a53", 1, 2, 3, 4, 12, 3},
+};
+
+const PipelineModel *GetPipelineModel(std::string name) {
+    for (auto &model : pipeline_models)
+        if (model.name == name)
+            return &model;
+    return nullptr;
+}
+
 void Asm::dump(std::ostream &os) {
     os << ".data\n";
 
@@ -36,11 +72,61 @@ void Asm::dump(std::ostream &os) {
     }
 }
 
-void IrToAsm(ir::Module &m, Asm &_asm, bool disable_ra, bool emit_asm) {
+// 在 jobs 个线程上对 order 中的下标执行 fn, 线程按原子计数依次领取
+static void ParallelFor(const std::vector<int> &order, int jobs,
+                        const std::function<void(int)> &fn) {
+    std::atomic<int> next{0};
+    auto worker = [&] {
+        for (int i; (i = next++) < (int)order.size();)
+            fn(order[i]);
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < std::min(jobs, (int)order.size()); i++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads)
+        t.join();
+}
+
+void IrToAsm(ir::Module &m, Asm &_asm, bool disable_ra, bool emit_asm,
+             int ra_algo, const TargetProfile &profile,
+             const PipelineModel *pipeline, int jobs) {
     NotAllowTy = emit_asm;
-    InstrSelect(m, _asm);
-    if (!disable_ra)
-        RegAlloca(_asm);
+    InstrSelectDefs(m, _asm);
+    // 各函数的代码生成互不依赖, 结果按模块中的顺序存放
+    for (auto &f : m.funcs)
+        _asm.funcs.push_back(std::make_unique<Func>(f->name));
+
+    // 大函数先处理, 减少最后只剩一个线程工作的时间
+    std::vector<int> order, size;
+    for (int i = 0; i < m.funcs.size(); i++) {
+        int n = 0;
+        for (auto &bb : m.funcs[i]->bblocks)
+            n += bb->insts.size();
+        order.push_back(i);
+        size.push_back(n);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](int a, int b) { return size[a] > size[b]; });
+    // 调试输出须按函数顺序, 此时串行
+    if (DbgAnyEnabled()) {
+        jobs = 1;
+        std::sort(order.begin(), order.end());
+    }
+
+    ParallelFor(order, jobs, [&](int i) {
+        auto &f = *_asm.funcs[i];
+        InstrSelect(*m.funcs[i], f);
+        if (!disable_ra) {
+            if (pipeline)
+                f.Schedule(*pipeline, profile.alloc_regs.size());
+            RegAlloca(f, ra_algo, profile);
+            f.Peephole();
+            if (pipeline)
+                f.Schedule(*pipeline);
+        }
+        f.InsertITBlocks();
+    });
 }
 
 }; // namespace backend
@@ -1,10 +1,37 @@
 
 #include "error.h"
 #include "backend.h"
+#include "frontend.h"
+#include "opt/opt.h"
 #include <gtest/gtest.h>
+#include <sstream>
 
 using namespace backend;
 
+// 由 SysY 源码生成汇编, opt_level 为 1 时先执行 -O1 的优化
+static std::unique_ptr<Asm> CompileAsm(const char *src, int opt_level = 0,
+                                       int ra_algo = kLinearScan,
+                                       int jobs = 1) {
+    auto comp_unit = Parse(src, strlen(src));
+    comp_unit = SemanticCheck(comp_unit);
+    auto m = AstToIr(comp_unit);
+    if (opt_level > 0) {
+        opt::InitBBPtr(*m);
+        opt::BuildDTree(*m);
+        opt::Mem2Reg(*m);
+        opt::SCCP(*m);
+        opt::GVN(*m);
+        opt::LICM(*m);
+        opt::StrengthReduce(*m);
+        opt::DeadCodeElim(*m);
+        opt::BuildLoopInfo(*m);
+    }
+    auto _asm = std::make_unique<Asm>();
+    IrToAsm(*m, *_asm, false, true, ra_algo, target_profiles[0],
+            &pipeline_models[0], jobs);
+    return _asm;
+}
+
 TEST(Backend, Addr) {
     ASSERT_EQ(Address(Reg::SP).str(), "[SP]");
     ASSERT_EQ(Address("label").str(), "label");
@@ -45,13 +72,23 @@ TEST(Backend, Builder) {
     builder::Store(it, Reg::R0, Address(Reg::R7));
     test_inst("STR R0, [R7]");
     builder::Push(it, Reg::R0);
-    test_inst("PUSH R0");
+    test_inst("PUSH {R0}");
     builder::Push(it, Reg::R0, Reg::R7, Reg::LR);
     test_inst("PUSH {R0-R7, LR}");
     builder::Pop(it, Reg::R0);
-    test_inst("POP R0");
+    test_inst("POP {R0}");
     builder::Pop(it, Reg::R0, Reg::R7, Reg::PC);
     test_inst("POP {R0-R7, PC}");
+    builder::Push(it, Reg::R4, Reg::R7, {Reg::R8, Reg::R12, Reg::LR});
+    test_inst("PUSH {R4-R7, R8,R12,LR}");
+    builder::Pop(it, Reg::R4, Reg::R7, {Reg::R8, Reg::R12, Reg::PC});
+    test_inst("POP {R4-R7, R8,R12,PC}");
+    builder::Push(it, {Reg::R4, Reg::LR});
+    test_inst("PUSH {R4,LR}");
+    builder::Pop(it, {Reg::PC});
+    test_inst("POP {PC}");
+    builder::BranchExchange(it, Reg::LR);
+    test_inst("BX LR");
     builder::Branch(it, "bb");
     test_inst("B bb");
     builder::Branch(it, Cond(Cond::LE), "bb");
@@ -191,3 +228,642 @@ TEST(Backend, TraversalRegister) {
         ASSERT_EQ(reg_set.count(*r), 1);
     }
 }
+
+TEST(Backend, LiveAnalysis) {
+    auto vreg = [](int x) { return (Reg)(x + (int)Reg::VREG); };
+
+    // bb0: v0 = 1, v1 = 2
+    // bb1: v0 = v0 + v1, 循环回到 bb1 或进入 bb2
+    // bb2: r0 = v0
+    Func f("func");
+    f.vreg += 2;
+    for (int i = 0; i < 3; i++)
+        f.bbs.push_back(std::make_unique<BB>());
+    BB *bb0 = f.bbs[0].get(), *bb1 = f.bbs[1].get(), *bb2 = f.bbs[2].get();
+    bb0->succs = {bb1};
+    bb1->succs = {bb1, bb2};
+    bb2->succs = {&f.end};
+
+    builder::Move(bb0->insts, bb0->insts.end(), vreg(0), 1);
+    builder::Move(bb0->insts, bb0->insts.end(), vreg(1), 2);
+    builder::BinaryAlu(bb1->insts, bb1->insts.end(), Instr::kADD, vreg(0),
+                       vreg(0), vreg(1));
+    builder::Move(bb2->insts, bb2->insts.end(), Reg::R0, vreg(0));
+
+    LiveAnalysis live(f);
+    live.Run();
+    ASSERT_EQ(live.order.size(), 3);
+    ASSERT_EQ(live.order[0], bb0);
+
+    ASSERT_FALSE(live.livein[0].Test(0));
+    ASSERT_TRUE(live.liveout[0].Test(0));
+    ASSERT_TRUE(live.liveout[0].Test(1));
+    ASSERT_TRUE(live.livein[1].Test(0));
+    ASSERT_TRUE(live.livein[1].Test(1));
+    ASSERT_TRUE(live.liveout[1].Test(1));
+    ASSERT_TRUE(live.livein[2].Test(0));
+    ASSERT_FALSE(live.livein[2].Test(1));
+    ASSERT_FALSE(live.liveout[2].Test(0));
+}
+
+TEST(Backend, GraphColoring) {
+    auto vreg = [](int x) { return (Reg)(x + (int)Reg::VREG); };
+
+    // v0 = 1; v1 = v0; v2 = 2; v3 = v1 + v2; r0 = v3
+    Func f("func");
+    f.vreg += 4;
+    f.bbs.push_back(std::make_unique<BB>());
+    auto &insts = f.bbs[0]->insts;
+    f.bbs[0]->succs = {&f.end};
+    builder::Move(insts, insts.end(), vreg(0), 1);
+    builder::Move(insts, insts.end(), vreg(1), vreg(0));
+    builder::Move(insts, insts.end(), vreg(2), 2);
+    builder::BinaryAlu(insts, insts.end(), Instr::kADD, vreg(3), vreg(1),
+                       vreg(2));
+    builder::Move(insts, insts.end(), Reg::R0, vreg(3));
+
+    LiveAnalysis live(f);
+    live.Run();
+    GraphColoring graph(f, live, 2);
+    graph.Run();
+    // 拷贝两端不冲突, 合并为同一结点; v1 与 v2 同时活跃
+    ASSERT_EQ(graph.GetAlias(vreg(0)), graph.GetAlias(vreg(1)));
+    ASSERT_GE(graph.GetColor(vreg(1)), 0);
+    ASSERT_GE(graph.GetColor(vreg(2)), 0);
+    ASSERT_NE(graph.GetColor(vreg(1)), graph.GetColor(vreg(2)));
+}
+
+TEST(Backend, GraphColoringCallerSaved) {
+    auto vreg = [](int x) { return (Reg)(x + (int)Reg::VREG); };
+
+    // v0 = 1; v1 = 2; call f(); r0 = v0 + v1 (v0, v1 跨越调用); v2 = 3
+    Func f("func");
+    f.vreg += 4;
+    f.bbs.push_back(std::make_unique<BB>());
+    auto &insts = f.bbs[0]->insts;
+    f.bbs[0]->succs = {&f.end};
+    builder::Move(insts, insts.end(), vreg(0), 1);
+    builder::Move(insts, insts.end(), vreg(1), 2);
+    builder::Call(insts, insts.end(), "f", {});
+    builder::BinaryAlu(insts, insts.end(), Instr::kADD, vreg(3), vreg(0),
+                       vreg(1));
+    builder::Move(insts, insts.end(), vreg(2), 3);
+    builder::Move(insts, insts.end(), Reg::R0, vreg(3));
+
+    LiveAnalysis live(f);
+    live.Run();
+    GraphColoring graph(f, live, 4);
+    graph.caller_saved = {true, true, false, false};
+    graph.Run();
+    // 跨越调用的结点使用被调用方保存的颜色, 其余使用调用方保存的颜色
+    ASSERT_GE(graph.GetColor(vreg(0)), 2);
+    ASSERT_GE(graph.GetColor(vreg(1)), 2);
+    ASSERT_LT(graph.GetColor(vreg(2)), 2);
+    ASSERT_LT(graph.GetColor(vreg(3)), 2);
+}
+
+TEST(Backend, GraphColoringRemat) {
+    auto vreg = [](int x) { return (Reg)(x + (int)Reg::VREG); };
+
+    // v0 = &g; v1 = 1; [v0] = v1; r0 = v1; 只有一个颜色
+    Func f("func");
+    f.vreg += 2;
+    f.bbs.push_back(std::make_unique<BB>());
+    auto &insts = f.bbs[0]->insts;
+    f.bbs[0]->succs = {&f.end};
+    builder::LoadAddr(insts, insts.end(), vreg(0), "g");
+    builder::Move(insts, insts.end(), vreg(1), 1);
+    builder::Store(insts, insts.end(), vreg(1), Address(vreg(0)));
+    builder::Move(insts, insts.end(), Reg::R0, vreg(1));
+
+    LiveAnalysis live(f);
+    live.Run();
+    GraphColoring graph(f, live, 1);
+    graph.remat = {vreg(0)};
+    graph.Run();
+    // 地址的使用与定值更多, 但可重新计算, 优先溢出
+    ASSERT_EQ(graph.GetColor(vreg(0)), -1);
+    ASSERT_EQ(graph.GetColor(vreg(1)), 0);
+}
+
+TEST(Backend, RegAllocaRemat) {
+    auto vreg = [](int x) { return (Reg)(x + (int)Reg::VREG); };
+    TargetProfile profile{"tiny", {Reg::R4, Reg::R5}, {Reg::R11, Reg::LR}};
+
+    // v0 = 1000; v1 = [r1]; v2 = [r2]; r0 = v1 + v2 + v0, 只有两个寄存器
+    for (int algo : {kLinearScan, kGraphColoring}) {
+        Asm _asm;
+        _asm.funcs.push_back(std::make_unique<Func>("func"));
+        Func &f = *_asm.funcs.back();
+        f.vreg += 5;
+        f.bbs.push_back(std::make_unique<BB>());
+        auto &insts = f.bbs[0]->insts;
+        f.bbs[0]->succs = {&f.end};
+        builder::Move(insts, insts.end(), vreg(0), 1000);
+        builder::Load(insts, insts.end(), vreg(1), Address(Reg::R1));
+        builder::Load(insts, insts.end(), vreg(2), Address(Reg::R2));
+        builder::BinaryAlu(insts, insts.end(), Instr::kADD, vreg(3), vreg(1),
+                           vreg(2));
+        builder::BinaryAlu(insts, insts.end(), Instr::kADD, vreg(4), vreg(3),
+                           vreg(0));
+        builder::Move(insts, insts.end(), Reg::R0, vreg(4));
+
+        RegAlloca(_asm, algo, profile);
+        // 溢出的立即数在使用处重新生成, 不经过栈
+        std::stringstream ss;
+        f.dump(ss);
+        ASSERT_EQ(ss.str().find("STR"), std::string::npos) << ss.str();
+        ASSERT_NE(ss.str().find("MOV FP, #1000"), std::string::npos) << ss.str();
+    }
+}
+
+TEST(Backend, RegAllocaSplitStoreAddr) {
+    auto vreg = [](int x) { return (Reg)(x + (int)Reg::VREG); };
+
+    // v4-v6 为栈上传递的参数: [v5, v6, LSL #2] = v4
+    Asm _asm;
+    _asm.funcs.push_back(std::make_unique<Func>("func"));
+    Func &f = *_asm.funcs.back();
+    f.vreg += 7;
+    for (int i = 0; i < 7; i++)
+        f.args.push_back(vreg(i));
+    f.frame.spilled_arg_count = 3;
+    f.bbs.push_back(std::make_unique<BB>());
+    auto &insts = f.bbs[0]->insts;
+    f.bbs[0]->succs = {&f.end};
+    builder::Store(insts, insts.end(), vreg(4), Address(vreg(5), vreg(6), 2));
+
+    RegAlloca(_asm);
+    std::stringstream ss;
+    f.bbs[0]->dump(ss);
+    // 三个操作数都在栈上, 地址先算入 lr
+    ASSERT_EQ(ss.str(), "    LDR FP, [R7, #16]\n"
+                        "    LDR LR, [R7, #20]\n"
+                        "    ADD LR, FP, LR, LSL #2\n"
+                        "    LDR FP, [R7, #12]\n"
+                        "    STR FP, [LR]\n");
+}
+
+TEST(Backend, LoopDepth) {
+    // bb0 -> bb1 -> bb2 -> bb1, bb2 -> bb2, bb1 -> bb3
+    Func f("func");
+    for (int i = 0; i < 4; i++)
+        f.bbs.push_back(std::make_unique<BB>());
+    BB *bb[4];
+    for (int i = 0; i < 4; i++)
+        bb[i] = f.bbs[i].get();
+    auto link = [](BB *a, BB *b) {
+        a->succs.push_back(b);
+        b->preds.push_back(a);
+    };
+    link(bb[0], bb[1]);
+    link(bb[1], bb[2]);
+    link(bb[2], bb[2]);
+    link(bb[2], bb[1]);
+    link(bb[1], bb[3]);
+
+    f.ComputeLoopDepth();
+    ASSERT_EQ(bb[0]->loop_depth, 0);
+    ASSERT_EQ(bb[1]->loop_depth, 1);
+    ASSERT_EQ(bb[2]->loop_depth, 2);
+    ASSERT_EQ(bb[3]->loop_depth, 0);
+}
+
+TEST(Backend, TargetProfile) {
+    auto thumb2 = GetTargetProfile("thumb2");
+    ASSERT_EQ(thumb2, &target_profiles[0]);
+    ASSERT_EQ(GetTargetProfile("none"), nullptr);
+    // 溢出用的临时寄存器不参与分配
+    for (auto &p : target_profiles)
+        for (Reg r : p.scratch_regs)
+            ASSERT_EQ(std::count(p.alloc_regs.begin(), p.alloc_regs.end(), r),
+                      0);
+}
+
+TEST(Backend, IfConvert) {
+    auto vreg = [](int x) { return (Reg)(x + (int)Reg::VREG); };
+
+    // bb0: cmp v1, #0; ble else    bb1: v0 = 1; b join
+    // bb2 (else): v0 = 2           bb3 (join): r0 = v0
+    Func f("func");
+    f.vreg += 2;
+    for (int i = 0; i < 4; i++)
+        f.bbs.push_back(std::make_unique<BB>());
+    BB *bb[4];
+    for (int i = 0; i < 4; i++) {
+        bb[i] = f.bbs[i].get();
+        bb[i]->label = "bb" + std::to_string(i);
+    }
+    auto link = [](BB *a, BB *b) {
+        a->succs.push_back(b);
+        b->preds.push_back(a);
+    };
+    builder::Cmp(bb[0]->insts, bb[0]->insts.end(), vreg(1), 0);
+    bb[0]->SetBranch(Cond(Cond::LE), "bb2");
+    builder::Move(bb[1]->insts, bb[1]->insts.end(), vreg(0), 1);
+    bb[1]->SetBranch(Cond(), "bb3");
+    builder::Move(bb[2]->insts, bb[2]->insts.end(), vreg(0), 2);
+    builder::Move(bb[3]->insts, bb[3]->insts.end(), Reg::R0, vreg(0));
+    link(bb[0], bb[2]);
+    link(bb[0], bb[1]);
+    link(bb[1], bb[3]);
+    link(bb[2], bb[3]);
+
+    f.IfConvert();
+    ASSERT_EQ(f.bbs.size(), 2);
+    ASSERT_EQ(bb[0]->branch, nullptr);
+    ASSERT_EQ(bb[0]->succs, std::vector<BB *>{bb[3]});
+    ASSERT_EQ(bb[3]->preds, std::vector<BB *>{bb[0]});
+
+    f.InsertITBlocks();
+    std::vector<std::string> expect{"CMP V1, #0", "MOV V0, #1", "IT LE",
+                                    "MOVLE V0, #2"};
+    std::vector<std::string> insts;
+    for (auto &inst : bb[0]->insts)
+        insts.push_back(inst->str());
+    ASSERT_EQ(insts, expect);
+}
+
+TEST(Backend, Peephole) {
+    Func f("func");
+    f.has_ret = false;
+    for (int i = 0; i < 3; i++) {
+        f.bbs.push_back(std::make_unique<BB>());
+        f.bbs[i]->label = "bb" + std::to_string(i);
+    }
+    auto &insts = f.bbs[0]->insts;
+    Address slot(Reg::R7);
+    slot.mode = Address::kMBaseImm;
+    slot.offset.imm = 4;
+    builder::Store(insts, insts.end(), Reg::R1, slot);
+    builder::Load(insts, insts.end(), Reg::R2, slot); // mov r2, r1
+    builder::Load(insts, insts.end(), Reg::R1, slot); // 删除
+    builder::Store(insts, insts.end(), Reg::R3, Address(Reg::R4));
+    builder::Load(insts, insts.end(), Reg::R5, slot); // 可能被改写, 保留
+    builder::BinaryAlu(insts, insts.end(), Instr::kADD, Reg::R6, Reg::R6, 0);
+    f.bbs[0]->SetBranch(Cond(), "bb2"); // bb1 为空块
+    f.bbs[2]->SetBranch(Cond(Cond::NE), "bb0");
+
+    f.Peephole();
+    std::stringstream ss;
+    f.dump(ss);
+    ASSERT_EQ(ss.str(), "@ function: func, argc: 0, ret: 0\n"
+                        "func:\n"
+                        "bb0:\n"
+                        "    STR R1, [R7, #4]\n"
+                        "    MOV R2, R1\n"
+                        "    STR R3, [R4]\n"
+                        "    LDR R5, [R7, #4]\n"
+                        "bb1:\n"
+                        "bb2:\n"
+                        "    BNE bb0\n"
+                        "__fend__func:\n");
+}
+
+TEST(Backend, Schedule) {
+    Func f("func");
+    f.has_ret = false;
+    f.bbs.push_back(std::make_unique<BB>());
+    auto &insts = f.bbs[0]->insts;
+    builder::Load(insts, insts.end(), Reg::R1, Address(Reg::R0));
+    builder::BinaryAlu(insts, insts.end(), Instr::kADD, Reg::R2, Reg::R1, 1);
+    builder::Store(insts, insts.end(), Reg::R2, Address(Reg::R0, 4));
+    builder::Load(insts, insts.end(), Reg::R3, Address(Reg::R0, 8)); // 不同地址
+    builder::Load(insts, insts.end(), Reg::R4, Address(Reg::R0, 4)); // 同一地址
+    builder::Cmp(insts, insts.end(), Reg::R3, 0);
+    builder::Move(insts, insts.end(), Reg::R5, 1);
+    insts.back()->cond = Cond::EQ;
+    builder::Move(insts, insts.end(), Reg::R6, 2);
+
+    f.Schedule(pipeline_models[0]);
+    std::string s;
+    for (auto &inst : insts)
+        s += inst->str() + ";";
+    ASSERT_EQ(s, "LDR R1, [R0];LDR R3, [R0, #8];MOV R6, #2;ADD R2, R1, #1;"
+                 "STR R2, [R0, #4];LDR R4, [R0, #4];CMP R3, #0;MOVEQ R5, #1;");
+}
+
+TEST(Backend, SchedulePhyReg) {
+    auto vreg = [](int x) { return (Reg)(x + (int)Reg::VREG); };
+
+    // v0 = [r7]; v1 = [r7, #4]; [r7, #8] = v0 + v1; r0 = 7, 寄存器压力很高
+    Func f("func");
+    f.vreg += 3;
+    f.bbs.push_back(std::make_unique<BB>());
+    f.bbs[0]->succs = {&f.end};
+    auto &insts = f.bbs[0]->insts;
+    builder::Load(insts, insts.end(), vreg(0), Address(Reg::R7));
+    builder::Load(insts, insts.end(), vreg(1), Address(Reg::R7, 4));
+    builder::BinaryAlu(insts, insts.end(), Instr::kADD, vreg(2), vreg(0),
+                       vreg(1));
+    builder::Store(insts, insts.end(), vreg(2), Address(Reg::R7, 8));
+    builder::Move(insts, insts.end(), Reg::R0, 7);
+
+    f.Schedule(pipeline_models[0], 1);
+    // 返回值的定值不能提前到虚拟寄存器的活跃区间内
+    ASSERT_EQ(insts.back()->str(), "MOV R0, #7");
+}
+
+TEST(Backend, PairMemory) {
+    Func f("func");
+    f.has_ret = false;
+    f.bbs.push_back(std::make_unique<BB>());
+    auto &insts = f.bbs[0]->insts;
+    auto at = [](Reg base, int offset) {
+        Address addr(base);
+        addr.mode = Address::kMBaseImm;
+        addr.offset.imm = offset;
+        return addr;
+    };
+    builder::Store(insts, insts.end(), Reg::R1, at(Reg::SP, 8));
+    builder::Store(insts, insts.end(), Reg::R0, at(Reg::SP, 4));
+    builder::Load(insts, insts.end(), Reg::R2, at(Reg::R7, 0));
+    builder::Load(insts, insts.end(), Reg::R3, at(Reg::R7, 4));
+    builder::Load(insts, insts.end(), Reg::R4, at(Reg::R4, 8)); // 改写基址
+    builder::Load(insts, insts.end(), Reg::R5, at(Reg::R4, 12));
+
+    f.Peephole();
+    std::stringstream ss;
+    f.bbs[0]->dump(ss);
+    ASSERT_EQ(ss.str(), "    STRD R0, R1, [SP, #4]\n"
+                        "    LDRD R2, R3, [R7]\n"
+                        "    LDR R4, [R4, #8]\n"
+                        "    LDR R5, [R4, #12]\n");
+}
+
+TEST(Backend, LoadImm) {
+    builder::instr_list insts;
+    auto load = [&](Word imm) {
+        insts.clear();
+        builder::LoadImm(insts, insts.end(), Reg::R0, imm);
+        std::string s;
+        for (auto &inst : insts)
+            s += inst->str() + ";";
+        return s;
+    };
+    ASSERT_EQ(load(65535), "MOV R0, #65535;");
+    ASSERT_EQ(load(0xff000000), "MOV R0, #4278190080;");
+    ASSERT_EQ(load(0x00ab00ab), "MOV R0, #11206827;");
+    ASSERT_EQ(load(-257), "MVN R0, #256;");
+    ASSERT_EQ(load(-256), "MVN R0, #255;");
+    ASSERT_EQ(load(123456789), "MOVW R0, #52501;MOVT R0, #1883;");
+    ASSERT_FALSE(builder::IsModImm(0x101));
+    ASSERT_TRUE(builder::IsModImm(0x3fc));
+
+    insts.clear();
+    builder::LoadAddr(insts, insts.end(), Reg::R1, "g");
+    ASSERT_EQ(insts.front()->str(), "MOVW R1, #:lower16:g");
+    ASSERT_EQ(insts.back()->str(), "MOVT R1, #:upper16:g");
+}
+
+TEST(Backend, ShiftedOperand) {
+    Func f("func");
+    builder::instr_list insts;
+    auto emit = [&](int op, builder::adv::Operand b, int shift_type = 0,
+                    int shift = 0) {
+        insts.clear();
+        builder::adv::BinaryAlu(f, insts, insts.end(), op, Reg::R0, Reg::R1, b,
+                                shift > 0, Shift{shift_type, shift});
+        std::string s;
+        for (auto &inst : insts)
+            s += inst->str() + ";";
+        return s;
+    };
+    ASSERT_EQ(emit(Instr::kADD, Reg::R1, Shift::kLSR, 31),
+              "ADD R0, R1, R1, LSR #31;");
+    ASSERT_EQ(emit(Instr::kRSB, Reg::R1, Shift::kLSL, 3),
+              "RSB R0, R1, R1, LSL #3;");
+    ASSERT_EQ(emit(Instr::kASR, (Word)31), "ASR R0, R1, #31;");
+    ASSERT_EQ(emit(Instr::kRSB, (Word)0), "RSB R0, R1, #0;");
+    ASSERT_EQ(emit(Instr::kSMMUL, (Word)0x55555556),
+              "MOVW V0, #21846;MOVT V0, #21845;SMMUL R0, R1, V0;");
+}
+
+TEST(Backend, LayoutBlocks) {
+    // bb0: b bb1    bb1: cmp; bge bb2 (否则进入 bb3)
+    // bb2 (出口): r0 = 0    bb3 (循环体): r1 += 1; b bb1
+    Func f("func");
+    f.has_ret = false;
+    for (int i = 0; i < 4; i++) {
+        f.bbs.push_back(std::make_unique<BB>());
+        f.bbs[i]->label = "bb" + std::to_string(i);
+    }
+    BB *bb[4];
+    for (int i = 0; i < 4; i++)
+        bb[i] = f.bbs[i].get();
+    auto link = [](BB *a, BB *b) {
+        a->succs.push_back(b);
+        b->preds.push_back(a);
+    };
+    bb[0]->SetBranch(Cond(), "bb1");
+    builder::Cmp(bb[1]->insts, bb[1]->insts.end(), Reg::R1, 10);
+    bb[1]->SetBranch(Cond(Cond::GE), "bb2");
+    builder::Move(bb[2]->insts, bb[2]->insts.end(), Reg::R0, 0);
+    builder::BinaryAlu(bb[3]->insts, bb[3]->insts.end(), Instr::kADD, Reg::R1,
+                       Reg::R1, 1);
+    bb[3]->SetBranch(Cond(), "bb1");
+    link(bb[0], bb[1]);
+    link(bb[1], bb[2]);
+    link(bb[1], bb[3]);
+    link(bb[3], bb[1]);
+    f.ComputeLoopDepth();
+
+    // 循环体紧随循环头, 回边是唯一的跳转
+    f.LayoutBlocks();
+    std::stringstream ss;
+    f.dump(ss);
+    ASSERT_EQ(ss.str(), "@ function: func, argc: 0, ret: 0\n"
+                        "func:\n"
+                        "bb0:\n"
+                        "bb1:\n"
+                        "    CMP R1, #10\n"
+                        "    BGE bb2\n"
+                        "bb3:\n"
+                        "    ADD R1, R1, #1\n"
+                        "    B bb1\n"
+                        "bb2:\n"
+                        "    MOV R0, #0\n"
+                        "__fend__func:\n");
+
+    // 跳转目标紧随其后时取反条件
+    bb[1]->branch->label = "bb3";
+    f.LayoutBlocks();
+    ASSERT_EQ(bb[1]->branch->str(), "BLT bb2");
+    ASSERT_EQ(f.bbs[2].get(), bb[3]);
+}
+
+TEST(Backend, ThumbEncoder) {
+    Func f("func");
+    builder::instr_list insts;
+    auto end = insts.end();
+    builder::adv::BinaryAlu(f, insts, end, Instr::kADD, Reg::R0, Reg::R1,
+                            Reg::R2, true, Shift{Shift::kLSL, 3});
+    builder::BinaryAlu(insts, end, Instr::kSUB, Reg::SP, Reg::SP, 28);
+    builder::BinaryAlu(insts, end, Instr::kADD, Reg::R0, Reg::R1, 0xfff);
+    builder::Move(insts, end, Reg::R0, 1001);
+    builder::LoadImm(insts, end, Reg::R3, 0xffffffff);
+    builder::StorePair(insts, end, Reg::R0, Reg::R1, Address(Reg::SP, 8));
+    builder::BinaryAlu(insts, end, Instr::kSMMUL, Reg::R0, Reg::R1, Reg::R2);
+    builder::BinaryAlu(insts, end, Instr::kSDIV, Reg::R0, Reg::R1, Reg::R2);
+    builder::Cmp(insts, end, Reg::R0, 10);
+    builder::Push(insts, end, {Reg::R4, Reg::LR});
+    builder::Pop(insts, end, Reg::R7);
+    builder::Label(insts, end, "l");
+    builder::Branch(insts, end, "l");
+    builder::Branch(insts, end, Cond(Cond::NE), "l");
+    builder::BranchLink(insts, end, "putint");
+
+    ThumbEncoder enc;
+    for (auto &inst : insts)
+        enc.Emit(inst.get());
+    auto relocs = enc.Resolve();
+    // 与 llvm-mc -show-encoding 的结果一致
+    std::vector<uint8_t> expect{
+        0x01, 0xeb, 0xc2, 0x00, // add.w r0, r1, r2, lsl #3
+        0xad, 0xf1, 0x1c, 0x0d, // sub.w sp, sp, #28
+        0x01, 0xf6, 0xff, 0x70, // addw r0, r1, #4095
+        0x40, 0xf2, 0xe9, 0x30, // movw r0, #1001
+        0x4f, 0xf0, 0xff, 0x33, // mov.w r3, #0xffffffff
+        0xcd, 0xe9, 0x02, 0x01, // strd r0, r1, [sp, #8]
+        0x51, 0xfb, 0x02, 0xf0, // smmul r0, r1, r2
+        0x91, 0xfb, 0xf2, 0xf0, // sdiv r0, r1, r2
+        0xb0, 0xf1, 0x0a, 0x0f, // cmp.w r0, #10
+        0x2d, 0xe9, 0x10, 0x40, // push.w {r4, lr}
+        0x5d, 0xf8, 0x04, 0x7b, // ldr r7, [sp], #4
+        0xff, 0xf7, 0xfe, 0xbf, // l: b.w l
+        0x7f, 0xf4, 0xfc, 0xaf, // bne.w l
+        0xff, 0xf7, 0xfe, 0xff, // bl putint, 待重定位
+    };
+    ASSERT_EQ(enc.text, expect);
+    ASSERT_EQ(relocs.size(), 1);
+    ASSERT_EQ(relocs[0].label, "putint");
+    ASSERT_EQ(relocs[0].offset, 52);
+
+    // ite gt; movgt r0, r1; asrle.w r0, r1, #31
+    enc = ThumbEncoder();
+    IT ite(Cond(Cond::GT), "E");
+    enc.Emit(&ite);
+    insts.clear();
+    builder::Move(insts, insts.end(), Reg::R0, Reg::R1);
+    builder::BinaryAlu(insts, insts.end(), Instr::kASR, Reg::R0, Reg::R1, 31);
+    for (auto &inst : insts)
+        enc.Emit(inst.get());
+    expect = {0xcc, 0xbf, 0x08, 0x46, 0x4f, 0xea, 0xe1, 0x70};
+    ASSERT_EQ(enc.text, expect);
+}
+
+TEST(Backend, AsmWriter) {
+    auto asm_ = std::make_unique<Asm>();
+    asm_->funcs.push_back(std::make_unique<Func>("func"));
+    Func &f = *asm_->funcs[0];
+    f.has_ret = true;
+    f.args = {f.AllocaVReg(), f.AllocaVReg()};
+    f.cmt.data = "@ comment";
+    f.bbs.push_back(std::make_unique<BB>());
+    BB *bb = f.bbs[0].get();
+    bb->label = "bb0";
+    auto &insts = bb->insts;
+    auto end = insts.end();
+    Address addr(Reg::R7, Reg::R0, 2);
+    builder::BinaryAlu(insts, end, Instr::kADD, Reg::R0, Reg::R1, 0xfff);
+    builder::BinaryAlu(insts, end, Instr::kSMMUL, f.args[0], Reg::R1, Reg::R2);
+    builder::adv::BinaryAlu(f, insts, end, Instr::kSUB, Reg::R0, Reg::R1,
+                            Reg::R2, true, Shift{Shift::kASR, 3});
+    builder::Move(insts, end, Reg::R0, 0xffffffff);
+    insts.back()->op = Instr::kMVN;
+    insts.back()->cond = Cond(Cond::LE);
+    builder::LoadAddr(insts, end, Reg::R3, "g");
+    builder::Load(insts, end, Reg::R2, Address("g"), true);
+    builder::Load(insts, end, Reg::R0, addr);
+    builder::Store(insts, end, Reg::R0, Address(Reg::SP, 8));
+    addr.mode |= Address::PostIndex;
+    builder::Load(insts, end, Reg::R0, addr);
+    builder::LoadPair(insts, end, Reg::R0, Reg::R1, Address(Reg::SP));
+    builder::Cmp(insts, end, Reg::R0, 10);
+    builder::Push(insts, end, Reg::R4, Reg::R6, Reg::LR);
+    builder::Pop(insts, end, {Reg::R7, Reg::PC});
+    builder::Label(insts, end, "l");
+    builder::BranchLink(insts, end, "putint");
+    auto call = std::make_unique<Call>();
+    call->func = "getint";
+    call->args = f.args;
+    call->ret = Reg::R0;
+    insts.push_back(std::move(call));
+    insts.push_back(std::make_unique<IT>(Cond(Cond::GT), "E"));
+    bb->SetBranch(Cond(Cond::NE), "l");
+
+    std::ostringstream expect;
+    asm_->dump(expect);
+
+    char *data = nullptr;
+    size_t size = 0;
+    FILE *fp = open_memstream(&data, &size);
+    AsmWriter(fp).Write(*asm_);
+    fclose(fp);
+    std::string out(data, size);
+    free(data);
+    ASSERT_EQ(out, expect.str());
+}
+
+TEST(Backend, BranchFlags) {
+    // gvn 合并两次 a < b, 第二个分支前有函数调用
+    auto _asm = CompileAsm("int main() {\n"
+                           "    int a = getint(), b = getint();\n"
+                           "    if (a < b) putint(1);\n"
+                           "    putint(a);\n"
+                           "    if (a < b) putint(2);\n"
+                           "    return 0;\n"
+                           "}\n",
+                           1);
+    // 每个条件跳转之前, 本块内调用之后都有比较
+    int branches = 0;
+    for (auto &bb : _asm->funcs[0]->bbs) {
+        if (!bb->branch || bb->branch->cond.type == Cond::AL)
+            continue;
+        branches++;
+        bool cmp = false;
+        for (auto &inst : bb->insts) {
+            if (inst->op == Instr::kCMP)
+                cmp = true;
+            if (inst->op == Instr::kBL || inst->op == Instr::kCall)
+                cmp = false;
+        }
+        ASSERT_TRUE(cmp) << bb->label;
+    }
+    ASSERT_EQ(branches, 2);
+}
+
+TEST(Backend, LeafFrame) {
+    auto _asm = CompileAsm("int add(int a, int b) { return a * b + a; }\n"
+                           "int main() { return add(getint(), 2); }\n",
+                           1);
+    std::stringstream leaf, caller;
+    _asm->funcs[0]->dump(leaf);
+    _asm->funcs[1]->dump(caller);
+    // 叶子函数不溢出时不保存 lr, 也不建立栈帧
+    for (auto s : {"PUSH", "POP", "R7", "SP"})
+        ASSERT_EQ(leaf.str().find(s), std::string::npos) << leaf.str();
+    ASSERT_NE(leaf.str().find("BX LR"), std::string::npos) << leaf.str();
+    ASSERT_NE(caller.str().find("PUSH {LR}"), std::string::npos)
+        << caller.str();
+}
+
+TEST(Backend, ParallelOutput) {
+    const char *src = "int g[16];\n"
+                      "int f(int n) { int s = 0, i = 0;\n"
+                      "    while (i < n) { s = s + g[i] * i; i = i + 1; }\n"
+                      "    return s; }\n"
+                      "int h(int a, int b) { if (a > b) return a / b;\n"
+                      "    return b * 7 + f(a); }\n"
+                      "int k(int x) { return x * x + 1; }\n"
+                      "int main() { int a = getint();\n"
+                      "    putint(f(a) + h(a, 3) + k(a)); return 0; }\n";
+    std::stringstream serial, parallel;
+    CompileAsm(src, 1, kLinearScan, 1)->dump(serial);
+    // 输出与线程数无关, 函数按源码顺序排列
+    for (int jobs : {2, 4}) {
+        parallel.str("");
+        CompileAsm(src, 1, kLinearScan, jobs)->dump(parallel);
+        ASSERT_EQ(parallel.str(), serial.str());
+    }
+}
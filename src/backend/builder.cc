@@ -27,6 +27,24 @@ void Store(instr_list &insts, instr_iter it, Reg rd, Address addr) {
     insts.insert(it, std::move(str));
 }
 
+void LoadPair(instr_list &insts, instr_iter it, Reg rd, Reg rd2,
+              Address addr) {
+    auto ldrd = std::make_unique<LDRD>();
+    ldrd->rd = rd;
+    ldrd->rd2 = rd2;
+    ldrd->addr = addr;
+    insts.insert(it, std::move(ldrd));
+}
+
+void StorePair(instr_list &insts, instr_iter it, Reg rd, Reg rd2,
+               Address addr) {
+    auto strd = std::make_unique<STRD>();
+    strd->rd = rd;
+    strd->rd2 = rd2;
+    strd->addr = addr;
+    insts.insert(it, std::move(strd));
+}
+
 void Push(instr_list &insts, instr_iter it, Reg r) {
     auto push = std::make_unique<PUSH>();
     push->regs.push_back(r);
@@ -40,6 +58,21 @@ void Push(instr_list &insts, instr_iter it, Reg from, Reg to, Reg r) {
     insts.insert(it, std::move(push));
 }
 
+void Push(instr_list &insts, instr_iter it, Reg from, Reg to,
+          std::vector<Reg> regs) {
+    auto push = std::make_unique<PUSH>();
+    push->range = {from, to};
+    push->regs = regs;
+    insts.insert(it, std::move(push));
+}
+
+void Push(instr_list &insts, instr_iter it, std::vector<Reg> regs) {
+    auto push = std::make_unique<PUSH>();
+    push->range = {Reg::R0, Reg::R0};
+    push->regs = regs;
+    insts.insert(it, std::move(push));
+}
+
 void Pop(instr_list &insts, instr_iter it, Reg r) {
     auto pop = std::make_unique<POP>();
     pop->regs.push_back(r);
@@ -53,6 +86,21 @@ void Pop(instr_list &insts, instr_iter it, Reg from, Reg to, Reg r) {
     insts.insert(it, std::move(pop));
 }
 
+void Pop(instr_list &insts, instr_iter it, Reg from, Reg to,
+         std::vector<Reg> regs) {
+    auto pop = std::make_unique<POP>();
+    pop->range = {from, to};
+    pop->regs = regs;
+    insts.insert(it, std::move(pop));
+}
+
+void Pop(instr_list &insts, instr_iter it, std::vector<Reg> regs) {
+    auto pop = std::make_unique<POP>();
+    pop->range = {Reg::R0, Reg::R0};
+    pop->regs = regs;
+    insts.insert(it, std::move(pop));
+}
+
 void Branch(instr_list &insts, instr_iter it, std::string label) {
     insts.insert(it, std::make_unique<backend::Branch>(Cond(), label));
 }
@@ -74,6 +122,10 @@ void BranchLink(instr_list &insts, instr_iter it, std::string func) {
     insts.insert(it, std::make_unique<backend::BranchLink>(func));
 }
 
+void BranchExchange(instr_list &insts, instr_iter it, Reg r) {
+    insts.insert(it, std::make_unique<backend::BranchExchange>(r));
+}
+
 void BinaryAlu(instr_list &insts, instr_iter it, int op, Reg rd, Reg a, Reg b) {
     auto alu = std::make_unique<backend::BinaryAlu>(op);
     alu->rd = rd;
@@ -100,6 +152,51 @@ void Move(instr_list &insts, instr_iter it, Reg rd, Word imm) {
     insts.insert(it, std::make_unique<MOV>(rd, imm));
 }
 
+void MoveWide(instr_list &insts, instr_iter it, int op, Reg rd, Word imm) {
+    insts.insert(it, std::make_unique<backend::MoveWide>(op, rd, imm));
+}
+
+void MoveWide(instr_list &insts, instr_iter it, int op, Reg rd,
+              std::string label) {
+    insts.insert(it, std::make_unique<backend::MoveWide>(op, rd, label));
+}
+
+// 8 位数循环右移, 或 00XY00XY / XY00XY00 / XYXYXYXY 形式
+bool IsModImm(Word imm) {
+    if (imm <= 0xff)
+        return true;
+    Word b = imm & 0xff;
+    if (imm == b * 0x00010001u || imm == b * 0x01010101u ||
+        imm == (imm >> 8 & 0xff) * 0x01000100u)
+        return true;
+    for (int rot = 8; rot < 32; rot++) {
+        Word x = imm << rot | imm >> (32 - rot);
+        if (x <= 0xff && (x & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// 依次尝试 mov #imm16 / 修正立即数, mvn #~imm, movw + movt, 不使用文字池
+void LoadImm(instr_list &insts, instr_iter it, Reg rd, Word imm) {
+    if (imm <= 0xffff || IsModImm(imm)) {
+        Move(insts, it, rd, imm);
+    } else if (IsModImm(~imm)) {
+        auto mvn = std::make_unique<MOV>(rd, ~imm);
+        mvn->op = Instr::kMVN;
+        insts.insert(it, std::move(mvn));
+    } else {
+        MoveWide(insts, it, Instr::kMOVW, rd, imm & 0xffff);
+        MoveWide(insts, it, Instr::kMOVT, rd, imm >> 16);
+    }
+}
+
+// 全局变量地址同样由 movw + movt 得到
+void LoadAddr(instr_list &insts, instr_iter it, Reg rd, std::string label) {
+    MoveWide(insts, it, Instr::kMOVW, rd, label);
+    MoveWide(insts, it, Instr::kMOVT, rd, label);
+}
+
 void Cmp(instr_list &insts, instr_iter it, Reg a, Reg b) {
     auto cmp = std::make_unique<CMP>();
     cmp->a = a;
@@ -121,45 +218,45 @@ void Label(instr_list &insts, instr_iter it, std::string label) {
 
 namespace adv {
 
-int NBit(Word x) {
-    int count = 0;
-    while (x)
-        (x >>= 1), count++;
-    return count;
-}
-
 // 为立即数分配寄存器
 Reg Op2Reg(Func &func, instr_list &insts, instr_iter it, Operand op, Reg rd) {
     if (op.flags & op.kIsImm) {
         if (rd == Reg::INVALID)
             rd = func.AllocaVReg();
-        int nbit = NBit(op.imm); // 检查是否能通过mov直接得到立即数
-        if (nbit <= 16) {
-            builder::Move(insts, it, rd, op.imm);
-            return rd;
-        } else { // 使用load获取立即数
-            auto label = func.CreateIntImm(op.imm);
-            builder::Load(insts, it, rd, Address(label));
-            // Load(insts, it, rd, rd);
-            return rd;
-        }
+        builder::LoadImm(insts, it, rd, op.imm);
+        return rd;
     } else {
         return op.r;
     }
 }
 
-void SetB(Func &func, instr_list &insts, instr_iter it, Operand op, int &flags,
-          RegImmU &b) {
-    if (op.flags & op.kIsImm) {
-        int nbit = NBit(op.imm);
-        if (nbit <= 12) {
-            b.imm = op.imm;
-            flags |= Instr::kFlagBIsImm;
-        } else {
-            b.r = Op2Reg(func, insts, it, op);
-        }
+// 指令能否直接编码该立即数
+bool ImmEncodable(int op, Word imm) {
+    switch (op) {
+    case Instr::kADD:
+    case Instr::kSUB:
+        return imm <= 0xfff || IsModImm(imm);
+    case Instr::kLSL:
+    case Instr::kLSR:
+    case Instr::kASR:
+        return imm < 32;
+    case Instr::kRSB:
+    case Instr::kCMP:
+    case Instr::kAND:
+    case Instr::kOR:
+    case Instr::kADC:
+        return IsModImm(imm);
+    }
+    return false;
+}
+
+void SetB(Func &func, instr_list &insts, instr_iter it, int op, Operand b,
+          int &flags, RegImmU &rb) {
+    if ((b.flags & b.kIsImm) && ImmEncodable(op, b.imm)) {
+        rb.imm = b.imm;
+        flags |= Instr::kFlagBIsImm;
     } else {
-        b.r = op.r;
+        rb.r = Op2Reg(func, insts, it, b);
     }
 }
 
@@ -183,17 +280,20 @@ void BinaryAlu(Func &func, instr_list &insts, instr_iter it, int op, Operand r,
         alu->flags |= alu->kFlagHasShift;
         alu->shift = shift;
     }
-    if (op == Instr::kMUL || op == Instr::kSDIV) {
-        alu->b.r = Op2Reg(func, insts, it, b);
-    } else
-        SetB(func, insts, it, b, alu->flags, alu->b);
+    // add #-x => sub #x
+    if ((op == Instr::kADD || op == Instr::kSUB) && (b.flags & b.kIsImm) &&
+        !ImmEncodable(op, b.imm) && ImmEncodable(op, -b.imm)) {
+        alu->op = op == Instr::kADD ? Instr::kSUB : Instr::kADD;
+        b.imm = -b.imm;
+    }
+    SetB(func, insts, it, alu->op, b, alu->flags, alu->b);
     insts.insert(it, std::move(alu));
 }
 
 void Cmp(Func &func, instr_list &insts, instr_iter it, Operand a, Operand b) {
     auto cmp = std::make_unique<CMP>();
     cmp->a = Op2Reg(func, insts, it, a);
-    SetB(func, insts, it, b, cmp->flags, cmp->b);
+    SetB(func, insts, it, Instr::kCMP, b, cmp->flags, cmp->b);
     insts.insert(it, std::move(cmp));
 }
 
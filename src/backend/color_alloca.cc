@@ -0,0 +1,388 @@
+#include "backend.h"
+#include <cmath>
+
+namespace backend {
+
+GraphColoring::GraphColoring(Func &f, LiveAnalysis &live, int k)
+    : func(f), live(live), k(k) {
+    n = live.vreg_count;
+    in_graph.assign(n, false);
+    adj_set.assign(n, BitSet(n));
+    adj_list.assign(n, {});
+    degree.assign(n, 0);
+    alias.assign(n, -1);
+    color.assign(n, -1);
+    state.assign(n, kInitial);
+    cost.assign(n, 0);
+    cross_call.assign(n, false);
+    move_list.assign(n, {});
+}
+
+Reg GraphColoring::GetAlias(Reg r) {
+    return LiveAnalysis::IdxVReg(Alias(LiveAnalysis::VRegIdx(r)));
+}
+
+int GraphColoring::GetColor(Reg r) {
+    return color[Alias(LiveAnalysis::VRegIdx(r))];
+}
+
+bool GraphColoring::InGraph(Reg r) {
+    return in_graph[LiveAnalysis::VRegIdx(r)];
+}
+
+// Combine 不会为已入栈的邻居补边, 需由原始冲突边推出合并结点间的冲突
+bool GraphColoring::Interfere(Reg a, Reg b) {
+    if (class_adj.empty()) {
+        class_adj.assign(n, BitSet(n));
+        for (int u = 0; u < n; u++)
+            for (int v : adj_list[u])
+                class_adj[Alias(u)].Set(Alias(v));
+    }
+    int x = Alias(LiveAnalysis::VRegIdx(a));
+    int y = Alias(LiveAnalysis::VRegIdx(b));
+    return x == y || class_adj[x].Test(y);
+}
+
+void GraphColoring::AddEdge(int u, int v) {
+    if (u == v || adj_set[u].Test(v))
+        return;
+    adj_set[u].Set(v);
+    adj_set[v].Set(u);
+    adj_list[u].push_back(v);
+    adj_list[v].push_back(u);
+    degree[u]++;
+    degree[v]++;
+}
+
+void GraphColoring::Build() {
+    auto node = [&](Reg *r) -> int {
+        if (!LiveAnalysis::IsVReg(*r) || excluded.count(*r))
+            return -1;
+        int x = LiveAnalysis::VRegIdx(*r);
+        in_graph[x] = true;
+        return x;
+    };
+
+    for (auto &bb : func.bbs) {
+        double weight = std::pow(10.0, std::min(bb->loop_depth, 8));
+        BitSet cur = live.liveout[bb->id];
+        for (auto &e : excluded)
+            cur.Reset(LiveAnalysis::VRegIdx(e));
+
+        for (auto it = bb->insts.rbegin(); it != bb->insts.rend(); it++) {
+            auto &inst = *it;
+            std::vector<int> uses, defs;
+            for (auto r : inst->RRegs())
+                if (int x = node(r); x >= 0)
+                    uses.push_back(x);
+            for (auto r : inst->WRegs())
+                if (int x = node(r); x >= 0)
+                    defs.push_back(x);
+            for (int x : uses)
+                cost[x] += weight;
+            for (int x : defs)
+                cost[x] += weight;
+
+            // 寄存器之间的拷贝, 源与目标不因此冲突
+            if (inst->op == Instr::kMOV && inst->cond.type == Cond::AL &&
+                uses.size() == 1 && defs.size() == 1) {
+                cur.Reset(uses[0]);
+                int m = moves.size();
+                moves.push_back({defs[0], uses[0], kMWorklist});
+                move_list[defs[0]].push_back(m);
+                move_list[uses[0]].push_back(m);
+                worklist_moves.insert(m);
+            }
+
+            for (int d : defs) {
+                cur.Set(d);
+                cur.ForEach([&](int l) { AddEdge(l, d); });
+            }
+            for (int d : defs)
+                cur.Reset(d);
+            if (inst->op == Instr::kCall)
+                cur.ForEach([&](int l) { cross_call[l] = true; });
+            for (int x : uses)
+                cur.Set(x);
+        }
+    }
+
+    for (auto r : remat)
+        if (InGraph(r))
+            cost[LiveAnalysis::VRegIdx(r)] /= 2; // 重新计算不访存
+
+    // 参数在入口同时写入
+    for (int i = 0; i < params.size(); i++) {
+        if (excluded.count(params[i]))
+            continue;
+        int x = LiveAnalysis::VRegIdx(params[i]);
+        in_graph[x] = true;
+        for (int j = 0; j < i; j++)
+            if (!excluded.count(params[j]))
+                AddEdge(x, LiveAnalysis::VRegIdx(params[j]));
+    }
+}
+
+void GraphColoring::SetState(int x, int s) {
+    switch (state[x]) {
+    case kSimplify:
+        simplify_wl.erase(x);
+        break;
+    case kFreeze:
+        freeze_wl.erase(x);
+        break;
+    case kSpill:
+        spill_wl.erase(x);
+        break;
+    }
+    state[x] = s;
+    switch (s) {
+    case kSimplify:
+        simplify_wl.insert(x);
+        break;
+    case kFreeze:
+        freeze_wl.insert(x);
+        break;
+    case kSpill:
+        spill_wl.insert(x);
+        break;
+    }
+}
+
+void GraphColoring::MakeWorklist() {
+    for (int x = 0; x < n; x++) {
+        if (!in_graph[x])
+            continue;
+        if (degree[x] >= k)
+            SetState(x, kSpill);
+        else if (MoveRelated(x))
+            SetState(x, kFreeze);
+        else
+            SetState(x, kSimplify);
+    }
+}
+
+std::vector<int> GraphColoring::Adjacent(int x) {
+    std::vector<int> res;
+    for (int y : adj_list[x])
+        if (state[y] != kSelect && state[y] != kCoalesced)
+            res.push_back(y);
+    return res;
+}
+
+std::vector<int> GraphColoring::NodeMoves(int x) {
+    std::vector<int> res;
+    for (int m : move_list[x])
+        if (moves[m].state == kMActive || moves[m].state == kMWorklist)
+            res.push_back(m);
+    return res;
+}
+
+bool GraphColoring::MoveRelated(int x) { return !NodeMoves(x).empty(); }
+
+void GraphColoring::Simplify() {
+    int x = *simplify_wl.begin();
+    SetState(x, kSelect);
+    select_stack.push_back(x);
+    for (int y : Adjacent(x))
+        DecrementDegree(y);
+}
+
+void GraphColoring::DecrementDegree(int x) {
+    if (degree[x]-- != k)
+        return;
+    EnableMoves(x);
+    for (int y : Adjacent(x))
+        EnableMoves(y);
+    if (MoveRelated(x))
+        SetState(x, kFreeze);
+    else
+        SetState(x, kSimplify);
+}
+
+void GraphColoring::EnableMoves(int x) {
+    for (int m : NodeMoves(x)) {
+        if (moves[m].state == kMActive) {
+            active_moves.erase(m);
+            moves[m].state = kMWorklist;
+            worklist_moves.insert(m);
+        }
+    }
+}
+
+void GraphColoring::AddWorkList(int x) {
+    if (state[x] == kFreeze && !MoveRelated(x) && degree[x] < k)
+        SetState(x, kSimplify);
+}
+
+// Briggs: 合并后高度数邻居少于 k 个; George: v 的邻居都与 u 相邻或度数低
+bool GraphColoring::Conservative(int u, int v) {
+    bool george = true;
+    for (int t : Adjacent(v)) {
+        if (degree[t] >= k && !adj_set[t].Test(u)) {
+            george = false;
+            break;
+        }
+    }
+    if (george)
+        return true;
+
+    int high = 0;
+    BitSet seen(n);
+    for (int x : {u, v}) {
+        for (int t : Adjacent(x)) {
+            if (seen.Test(t))
+                continue;
+            seen.Set(t);
+            if (degree[t] >= k)
+                high++;
+        }
+    }
+    return high < k;
+}
+
+int GraphColoring::Alias(int x) {
+    while (state[x] == kCoalesced)
+        x = alias[x];
+    return x;
+}
+
+void GraphColoring::Coalesce() {
+    int m = *worklist_moves.begin();
+    worklist_moves.erase(m);
+    int u = Alias(moves[m].dst), v = Alias(moves[m].src);
+
+    if (u == v) {
+        moves[m].state = kMCoalesced;
+        AddWorkList(u);
+    } else if (adj_set[u].Test(v)) {
+        moves[m].state = kMConstrained;
+        AddWorkList(u);
+        AddWorkList(v);
+    } else if (Conservative(u, v)) {
+        moves[m].state = kMCoalesced;
+        Combine(u, v);
+        AddWorkList(u);
+    } else {
+        moves[m].state = kMActive;
+        active_moves.insert(m);
+    }
+}
+
+void GraphColoring::Combine(int u, int v) {
+    SetState(v, kCoalesced);
+    alias[v] = u;
+    for (int m : move_list[v])
+        move_list[u].push_back(m);
+    cost[u] += cost[v];
+    cross_call[u] = cross_call[u] || cross_call[v];
+    EnableMoves(v);
+    for (int t : Adjacent(v)) {
+        AddEdge(t, u);
+        DecrementDegree(t);
+    }
+    if (degree[u] >= k && state[u] == kFreeze)
+        SetState(u, kSpill);
+}
+
+void GraphColoring::Freeze() {
+    int u = *freeze_wl.begin();
+    SetState(u, kSimplify);
+    FreezeMoves(u);
+}
+
+void GraphColoring::FreezeMoves(int u) {
+    for (int m : NodeMoves(u)) {
+        int x = moves[m].dst, y = moves[m].src;
+        int v = Alias(y) == Alias(u) ? Alias(x) : Alias(y);
+        if (moves[m].state == kMActive)
+            active_moves.erase(m);
+        else
+            worklist_moves.erase(m);
+        moves[m].state = kMFrozen;
+        if (state[v] == kFreeze && !MoveRelated(v))
+            SetState(v, kSimplify);
+    }
+}
+
+// 选择 代价 / 度数 最小的结点作为潜在溢出
+void GraphColoring::SelectSpill() {
+    int best = -1;
+    double best_val = 0;
+    for (int x : spill_wl) {
+        double val = cost[x] / std::max(degree[x], 1);
+        if (best < 0 || val < best_val) {
+            best = x;
+            best_val = val;
+        }
+    }
+    SetState(best, kSimplify);
+    FreezeMoves(best);
+}
+
+void GraphColoring::AssignColors() {
+    while (!select_stack.empty()) {
+        int x = select_stack.back();
+        select_stack.pop_back();
+        std::vector<bool> ok(k, true);
+        for (int y : adj_list[x]) {
+            int a = Alias(y);
+            if (state[a] == kColored)
+                ok[color[a]] = false;
+        }
+        // 跨越调用的结点优先使用被调用方保存的寄存器, 其余相反
+        int c = -1;
+        for (int i = 0; i < k; i++) {
+            if (!ok[i])
+                continue;
+            bool caller = i < caller_saved.size() && caller_saved[i];
+            if (caller != cross_call[x]) {
+                c = i;
+                break;
+            }
+            if (c < 0)
+                c = i;
+        }
+        if (c < 0) {
+            state[x] = kSpilled;
+        } else {
+            state[x] = kColored;
+            color[x] = c;
+        }
+    }
+}
+
+void GraphColoring::Run() {
+    Build();
+    MakeWorklist();
+    while (!simplify_wl.empty() || !worklist_moves.empty() ||
+           !freeze_wl.empty() || !spill_wl.empty()) {
+        if (!simplify_wl.empty())
+            Simplify();
+        else if (!worklist_moves.empty())
+            Coalesce();
+        else if (!freeze_wl.empty())
+            Freeze();
+        else
+            SelectSpill();
+    }
+    AssignColors();
+}
+
+void GraphColoring::Dump(std::ostream &os) {
+    os << "------ dump graph coloring: " << func.name << " ------\n";
+    for (int x = 0; x < n; x++) {
+        if (!in_graph[x])
+            continue;
+        os << Reg2Str(LiveAnalysis::IdxVReg(x)) << "\tcost " << cost[x];
+        if (state[x] == kCoalesced)
+            os << " -> " << Reg2Str(LiveAnalysis::IdxVReg(Alias(x)));
+        else if (color[x] >= 0)
+            os << " color " << color[x];
+        else
+            os << " spilled";
+        os << "\n";
+    }
+}
+
+} // namespace backend
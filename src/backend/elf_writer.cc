@@ -0,0 +1,215 @@
+#include "backend.h"
+#include <cassert>
+#include <ostream>
+
+namespace backend {
+
+// ELF32 / ARM 常量, 见 ELF for the Arm Architecture
+enum {
+    kSecText = 1, // 节下标
+    kSecData,
+    kSecRodata,
+    kSecRelText,
+    kSecSymtab,
+    kSecStrtab,
+    kSecShstrtab,
+    kSecCount,
+
+    kSHT_NULL = 0,
+    kSHT_PROGBITS = 1,
+    kSHT_SYMTAB = 2,
+    kSHT_STRTAB = 3,
+    kSHT_REL = 9,
+    kSHF_WRITE = 1,
+    kSHF_ALLOC = 2,
+    kSHF_EXECINSTR = 4,
+    kSHF_INFO_LINK = 0x40,
+
+    kSTB_LOCAL = 0,
+    kSTB_GLOBAL = 1,
+    kSTT_NOTYPE = 0,
+    kSTT_OBJECT = 1,
+    kSTT_FUNC = 2,
+    kSTT_SECTION = 3,
+
+    kR_ARM_THM_CALL = 10,
+    kR_ARM_THM_JUMP24 = 30,
+    kR_ARM_THM_MOVW_ABS_NC = 47,
+    kR_ARM_THM_MOVT_ABS = 48,
+    kR_ARM_THM_JUMP19 = 51,
+};
+
+struct StrTab {
+    std::string data{'\0'};
+    int Add(const std::string &s) {
+        int off = data.size();
+        data += s;
+        data += '\0';
+        return off;
+    }
+};
+
+struct Bytes {
+    std::string data;
+    void U8(int v) { data += (char)v; }
+    void U16(int v) { U8(v), U8(v >> 8); }
+    void U32(Word v) { U16(v), U16(v >> 16); }
+    void Align(int n) { data.resize((data.size() + n - 1) / n * n, '\0'); }
+};
+
+struct Symbol {
+    std::string name;
+    Word value, size;
+    int bind, type, shndx;
+};
+
+void EmitObject(Asm &_asm, std::ostream &os) {
+    // 符号表中局部符号须在全局符号之前
+    std::vector<Symbol> locals{
+        {"", 0, 0, kSTB_LOCAL, kSTT_NOTYPE, 0},
+        {"", 0, 0, kSTB_LOCAL, kSTT_SECTION, kSecText},
+        {"", 0, 0, kSTB_LOCAL, kSTT_SECTION, kSecData},
+        {"", 0, 0, kSTB_LOCAL, kSTT_SECTION, kSecRodata},
+        {"$t", 0, 0, kSTB_LOCAL, kSTT_NOTYPE, kSecText}, // 映射符号
+    };
+    std::vector<Symbol> globals;
+
+    ThumbEncoder enc;
+    for (auto &f : _asm.funcs) {
+        Word start = enc.text.size();
+        enc.EmitFunc(*f);
+        // thumb 函数的符号值最低位置 1
+        Symbol sym{f->name, start | 1, (Word)enc.text.size() - start,
+                   kSTB_LOCAL, kSTT_FUNC, kSecText};
+        if (f->name == "main") {
+            sym.bind = kSTB_GLOBAL;
+            globals.push_back(sym);
+        } else {
+            locals.push_back(sym);
+        }
+    }
+
+    Bytes sec[kSecCount];
+    bool has_data[kSecCount] = {};
+    for (auto &def : _asm.defs) {
+        int shndx = def->is_const ? kSecRodata : kSecData;
+        if (!has_data[shndx])
+            locals.push_back({"$d", 0, 0, kSTB_LOCAL, kSTT_NOTYPE, shndx});
+        has_data[shndx] = true;
+        auto words = def->Words();
+        locals.push_back({def->name, (Word)sec[shndx].data.size(),
+                          (Word)words.size() * 4, kSTB_LOCAL, kSTT_OBJECT,
+                          shndx});
+        for (auto w : words)
+            sec[shndx].U32(w);
+    }
+
+    std::map<std::string, int> sym_idx;
+    for (int i = 0; i < locals.size(); i++)
+        if (!locals[i].name.empty() && locals[i].name[0] != '$')
+            sym_idx[locals[i].name] = i;
+    for (int i = 0; i < globals.size(); i++)
+        sym_idx[globals[i].name] = locals.size() + i;
+
+    // 本地标签回填后剩下外部函数与全局变量地址
+    for (auto &fix : enc.Resolve()) {
+        static std::map<int, int> types{
+            {ThumbEncoder::kFixJump, kR_ARM_THM_JUMP24},
+            {ThumbEncoder::kFixCondJump, kR_ARM_THM_JUMP19},
+            {ThumbEncoder::kFixCall, kR_ARM_THM_CALL},
+            {ThumbEncoder::kFixMovw, kR_ARM_THM_MOVW_ABS_NC},
+            {ThumbEncoder::kFixMovt, kR_ARM_THM_MOVT_ABS},
+        };
+        if (!sym_idx.count(fix.label)) {
+            sym_idx[fix.label] = locals.size() + globals.size();
+            globals.push_back(
+                {fix.label, 0, 0, kSTB_GLOBAL, kSTT_NOTYPE, 0});
+        }
+        sec[kSecRelText].U32(fix.offset);
+        sec[kSecRelText].U32(sym_idx[fix.label] << 8 | types.at(fix.type));
+    }
+    sec[kSecText].data.assign(enc.text.begin(), enc.text.end());
+
+    StrTab strtab, shstrtab;
+    for (auto *syms : {&locals, &globals}) {
+        for (auto &sym : *syms) {
+            auto &b = sec[kSecSymtab];
+            b.U32(sym.name.empty() ? 0 : strtab.Add(sym.name));
+            b.U32(sym.value);
+            b.U32(sym.size);
+            b.U8(sym.bind << 4 | sym.type);
+            b.U8(0);
+            b.U16(sym.shndx);
+        }
+    }
+    sec[kSecStrtab].data = strtab.data;
+
+    struct {
+        const char *name;
+        int type, flags, link, info, align, entsize;
+    } headers[kSecCount] = {
+        {"", kSHT_NULL, 0, 0, 0, 0, 0},
+        {".text", kSHT_PROGBITS, kSHF_ALLOC | kSHF_EXECINSTR, 0, 0, 4, 0},
+        {".data", kSHT_PROGBITS, kSHF_WRITE | kSHF_ALLOC, 0, 0, 4, 0},
+        {".rodata", kSHT_PROGBITS, kSHF_ALLOC, 0, 0, 4, 0},
+        {".rel.text", kSHT_REL, kSHF_INFO_LINK, kSecSymtab, kSecText, 4, 8},
+        {".symtab", kSHT_SYMTAB, 0, kSecStrtab, (int)locals.size(), 4, 16},
+        {".strtab", kSHT_STRTAB, 0, 0, 0, 1, 0},
+        {".shstrtab", kSHT_STRTAB, 0, 0, 0, 1, 0},
+    };
+    int name_off[kSecCount] = {};
+    for (int i = 1; i < kSecCount; i++)
+        name_off[i] = shstrtab.Add(headers[i].name);
+    sec[kSecShstrtab].data = shstrtab.data;
+
+    // ELF 头 | 各节内容 | 节头表
+    const int ehsize = 52, shentsize = 40;
+    Bytes body;
+    int offset[kSecCount] = {};
+    for (int i = 1; i < kSecCount; i++) {
+        body.Align(4);
+        offset[i] = ehsize + body.data.size();
+        body.data += sec[i].data;
+    }
+    body.Align(4);
+    int shoff = ehsize + body.data.size();
+
+    Bytes out;
+    out.data = "\x7f"
+               "ELF";
+    out.U8(1); // ELFCLASS32
+    out.U8(1); // ELFDATA2LSB
+    out.U8(1); // EV_CURRENT
+    out.Align(16);
+    out.U16(1);          // ET_REL
+    out.U16(40);         // EM_ARM
+    out.U32(1);          // EV_CURRENT
+    out.U32(0);          // e_entry
+    out.U32(0);          // e_phoff
+    out.U32(shoff);      // e_shoff
+    out.U32(0x05000000); // EF_ARM_EABI_VER5
+    out.U16(ehsize);
+    out.U16(0); // e_phentsize
+    out.U16(0); // e_phnum
+    out.U16(shentsize);
+    out.U16(kSecCount);
+    out.U16(kSecShstrtab);
+    assert(out.data.size() == ehsize);
+    out.data += body.data;
+    for (int i = 0; i < kSecCount; i++) {
+        auto &h = headers[i];
+        out.U32(name_off[i]);
+        out.U32(h.type);
+        out.U32(h.flags);
+        out.U32(0); // sh_addr
+        out.U32(offset[i]);
+        out.U32(sec[i].data.size());
+        out.U32(h.link);
+        out.U32(h.info);
+        out.U32(h.align);
+        out.U32(h.entsize);
+    }
+    os.write(out.data.data(), out.data.size());
+}
+
+} // namespace backend
@@ -0,0 +1,419 @@
+#include "backend.h"
+#include <cassert>
+#include <cstdlib>
+
+namespace backend {
+
+// 编码中的寄存器号, R13 与 SP 均为 13
+static int RegNo(Reg r) {
+    switch (r) {
+    case Reg::SP:
+        return 13;
+    case Reg::LR:
+        return 14;
+    case Reg::PC:
+        return 15;
+    default:
+        assert((unsigned)r <= (unsigned)Reg::R13);
+        return (int)r;
+    }
+}
+
+static int CondNo(Cond cond) {
+    // EQ, NE, HI, HS, LS, LO, GT, GE, LT, LE, AL
+    static int m[]{0, 1, 8, 2, 9, 3, 12, 10, 11, 13, 14};
+    return m[cond.type];
+}
+
+// 修正立即数的 i:imm3:imm8 编码, 不可编码时返回 -1
+static int ModImm(Word imm) {
+    if (imm <= 0xff)
+        return imm;
+    Word b = imm & 0xff;
+    if (imm == b * 0x00010001u)
+        return 0x100 | b;
+    if (imm == (imm >> 8 & 0xff) * 0x01000100u)
+        return 0x200 | (imm >> 8 & 0xff);
+    if (imm == b * 0x01010101u)
+        return 0x300 | b;
+    for (int rot = 8; rot < 32; rot++) {
+        Word x = imm << rot | imm >> (32 - rot);
+        if (x <= 0xff && (x & 0x80))
+            return rot << 7 | (x & 0x7f);
+    }
+    return -1;
+}
+
+// 数据处理指令的 op 字段
+enum { kOpAND = 0, kOpORR = 2, kOpORN = 3, kOpADD = 8, kOpADC = 10,
+       kOpSUB = 13, kOpRSB = 14 };
+
+void ThumbEncoder::Emit16(int hw) {
+    text.push_back(hw & 0xff);
+    text.push_back(hw >> 8 & 0xff);
+}
+
+void ThumbEncoder::Emit32(int hw1, int hw2) {
+    Emit16(hw1);
+    Emit16(hw2);
+}
+
+void ThumbEncoder::Label(std::string label) {
+    assert(!labels.count(label));
+    labels[label] = text.size();
+}
+
+// <op>{S}.W rd, rn, #imm
+void ThumbEncoder::DpImm(int op, bool s, int rd, int rn, Word imm) {
+    int imm12 = ModImm(imm);
+    if (imm12 < 0 && !s && (op == kOpADD || op == kOpSUB) && imm <= 0xfff) {
+        // ADDW / SUBW
+        Emit32(0xf200 | (op == kOpSUB ? 0xa0 : 0) | (imm >> 11 & 1) << 10 | rn,
+               (imm >> 8 & 7) << 12 | rd << 8 | (imm & 0xff));
+        return;
+    }
+    assert(imm12 >= 0);
+    Emit32(0xf000 | (imm12 >> 11 & 1) << 10 | op << 5 | s << 4 | rn,
+           (imm12 >> 8 & 7) << 12 | rd << 8 | (imm12 & 0xff));
+}
+
+// <op>{S}.W rd, rn, rm{, <shift> #imm}
+void ThumbEncoder::DpReg(int op, bool s, int rd, int rn, int rm, Shift shift) {
+    if (shift.imm == 0) // LSR/ASR #0 表示移 32 位
+        shift.type = Shift::kLSL;
+    assert(shift.imm >= 0 && shift.imm < 32);
+    Emit32(0xea00 | op << 5 | s << 4 | rn, (shift.imm >> 2 & 7) << 12 |
+                                               rd << 8 | (shift.imm & 3) << 6 |
+                                               shift.type << 4 | rm);
+}
+
+// MOVW / MOVT rd, #imm16
+void ThumbEncoder::MoveWide(bool top, int rd, Word imm) {
+    Emit32((top ? 0xf2c0 : 0xf240) | (imm >> 11 & 1) << 10 | (imm >> 12 & 0xf),
+           (imm >> 8 & 7) << 12 | rd << 8 | (imm & 0xff));
+}
+
+// LDR.W / STR.W rt, addr
+void ThumbEncoder::LoadStore(bool load, int rt, const Address &addr) {
+    int rn = RegNo(addr.base);
+    int l = load ? 0x10 : 0;
+    switch (addr.mode & Address::mode_m_mask) {
+    case Address::kMBase:
+        Emit32(0xf8c0 | l | rn, rt << 12);
+        return;
+    case Address::kMBaseImm: {
+        int off = (int)addr.offset.imm;
+        int index = addr.mode & Address::mode_index_mask;
+        if (index == 0 && off >= 0) {
+            assert(off <= 0xfff);
+            Emit32(0xf8c0 | l | rn, rt << 12 | off);
+            return;
+        }
+        // 1 P U W imm8
+        int p = index != Address::PostIndex, w = index != 0;
+        int u = off >= 0;
+        off = std::abs(off);
+        assert(off <= 0xff);
+        Emit32(0xf840 | l | rn,
+               rt << 12 | 0x800 | p << 10 | u << 9 | w << 8 | off);
+        return;
+    }
+    case Address::kMBaseReg:
+    case Address::kMBaseRegShift: {
+        int imm2 = (addr.mode & Address::mode_m_mask) == Address::kMBaseReg
+                       ? 0
+                       : addr.offset.shift.imm;
+        assert(imm2 <= 3 && (imm2 == 0 || addr.offset.shift.type == Shift::kLSL));
+        Emit32(0xf840 | l | rn, rt << 12 | imm2 << 4 | RegNo(addr.offset.reg));
+        return;
+    }
+    }
+    assert(false && "unsupported address mode");
+}
+
+// LDRD / STRD rt, rt2, [rn, #imm]
+void ThumbEncoder::LoadStorePair(bool load, int rt, int rt2,
+                                 const Address &addr) {
+    int off = 0;
+    if ((addr.mode & Address::mode_m_mask) == Address::kMBaseImm)
+        off = (int)addr.offset.imm;
+    else
+        assert((addr.mode & Address::mode_m_mask) == Address::kMBase);
+    int index = addr.mode & Address::mode_index_mask;
+    int p = index != Address::PostIndex, w = index != 0, u = off >= 0;
+    off = std::abs(off);
+    assert(off % 4 == 0 && off <= 1020);
+    Emit32(0xe840 | p << 8 | u << 7 | w << 5 | (load ? 0x10 : 0) |
+               RegNo(addr.base),
+           rt << 12 | rt2 << 8 | off / 4);
+}
+
+// PUSH / POP 的寄存器位图
+static int RegList(std::pair<Reg, Reg> range, const std::vector<Reg> &regs) {
+    int list = 0;
+    if (range.first != range.second)
+        for (int r = RegNo(range.first); r <= RegNo(range.second); r++)
+            list |= 1 << r;
+    for (auto r : regs)
+        list |= 1 << RegNo(r);
+    return list;
+}
+
+void ThumbEncoder::Fix(int type, std::string label) {
+    fixups.push_back({(int)text.size(), type, label});
+}
+
+void ThumbEncoder::Emit(Instr *inst) {
+    switch (inst->op) {
+    case Instr::kLDR: {
+        auto ldr = dynamic_cast<LDR *>(inst);
+        if (ldr->eq_addr) { // =label 不使用文字池, 由 movw + movt 得到
+            assert(ldr->addr.mode == Address::KMLabel);
+            Fix(kFixMovw, ldr->addr.label);
+            MoveWide(false, RegNo(ldr->rd), 0);
+            Fix(kFixMovt, ldr->addr.label);
+            MoveWide(true, RegNo(ldr->rd), 0);
+        } else {
+            LoadStore(true, RegNo(ldr->rd), ldr->addr);
+        }
+    } break;
+    case Instr::kSTR: {
+        auto str = dynamic_cast<STR *>(inst);
+        LoadStore(false, RegNo(str->rd), str->addr);
+    } break;
+    case Instr::kLDRD: {
+        auto ldrd = dynamic_cast<LDRD *>(inst);
+        LoadStorePair(true, RegNo(ldrd->rd), RegNo(ldrd->rd2), ldrd->addr);
+    } break;
+    case Instr::kSTRD: {
+        auto strd = dynamic_cast<STRD *>(inst);
+        LoadStorePair(false, RegNo(strd->rd), RegNo(strd->rd2), strd->addr);
+    } break;
+    case Instr::kPUSH: {
+        auto push = dynamic_cast<PUSH *>(inst);
+        int list = RegList(push->range, push->regs);
+        if (__builtin_popcount(list) == 1) // STR.W rt, [sp, #-4]!
+            Emit32(0xf84d, __builtin_ctz(list) << 12 | 0xd04);
+        else // STMDB sp!, {...}
+            Emit32(0xe92d, list);
+    } break;
+    case Instr::kPOP: {
+        auto pop = dynamic_cast<POP *>(inst);
+        int list = RegList(pop->range, pop->regs);
+        if (__builtin_popcount(list) == 1) // LDR.W rt, [sp], #4
+            Emit32(0xf85d, __builtin_ctz(list) << 12 | 0xb04);
+        else // LDMIA sp!, {...}
+            Emit32(0xe8bd, list);
+    } break;
+    case Instr::kADR: {
+        auto adr = dynamic_cast<ADR *>(inst);
+        Fix(kFixAdr, adr->label);
+        Emit32(0xf20f, RegNo(adr->rd) << 8);
+    } break;
+    case Instr::kB: {
+        auto b = dynamic_cast<Branch *>(inst);
+        if (b->cond.type == Cond::AL) {
+            Fix(kFixJump, b->label);
+            Emit32(0xf000, 0x9000);
+        } else {
+            Fix(kFixCondJump, b->label);
+            Emit32(0xf000 | CondNo(b->cond) << 6, 0x8000);
+        }
+    } break;
+    case Instr::kBL:
+        Fix(kFixCall, dynamic_cast<BranchLink *>(inst)->label);
+        Emit32(0xf000, 0xd000);
+        break;
+    case Instr::kCall:
+        Fix(kFixCall, dynamic_cast<Call *>(inst)->func);
+        Emit32(0xf000, 0xd000);
+        break;
+    case Instr::kBX:
+        Emit16(0x4700 | RegNo(dynamic_cast<BranchExchange *>(inst)->r) << 3);
+        break;
+    case Instr::kADD:
+    case Instr::kSUB:
+    case Instr::kRSB:
+    case Instr::kAND:
+    case Instr::kOR:
+    case Instr::kADC: {
+        static std::map<int, int> ops{
+            {Instr::kADD, kOpADD}, {Instr::kSUB, kOpSUB},
+            {Instr::kRSB, kOpRSB}, {Instr::kAND, kOpAND},
+            {Instr::kOR, kOpORR},  {Instr::kADC, kOpADC},
+        };
+        auto alu = dynamic_cast<BinaryAlu *>(inst);
+        int op = ops[inst->op], rd = RegNo(alu->rd), rn = RegNo(alu->a);
+        bool s = inst->flags & Instr::kFlagS;
+        if (inst->flags & Instr::kFlagBIsImm)
+            DpImm(op, s, rd, rn, alu->b.imm);
+        else
+            DpReg(op, s, rd, rn, RegNo(alu->b.r),
+                  inst->flags & Instr::kFlagHasShift ? alu->shift
+                                                     : Shift{Shift::kLSL, 0});
+    } break;
+    case Instr::kMUL:
+    case Instr::kSMMUL:
+    case Instr::kSDIV:
+    case Instr::kUDIV: {
+        static std::map<int, std::pair<int, int>> ops{
+            {Instr::kMUL, {0xfb00, 0xf000}},
+            {Instr::kSMMUL, {0xfb50, 0xf000}},
+            {Instr::kSDIV, {0xfb90, 0xf0f0}},
+            {Instr::kUDIV, {0xfbb0, 0xf0f0}},
+        };
+        auto alu = dynamic_cast<BinaryAlu *>(inst);
+        assert(!(inst->flags & (Instr::kFlagBIsImm | Instr::kFlagS)));
+        auto [hw1, hw2] = ops[inst->op];
+        Emit32(hw1 | RegNo(alu->a),
+               hw2 | RegNo(alu->rd) << 8 | RegNo(alu->b.r));
+    } break;
+    case Instr::kLSL:
+    case Instr::kLSR:
+    case Instr::kASR: {
+        auto alu = dynamic_cast<BinaryAlu *>(inst);
+        int type = inst->op - Instr::kLSL + Shift::kLSL;
+        bool s = inst->flags & Instr::kFlagS;
+        if (inst->flags & Instr::kFlagBIsImm) // MOV.W rd, rm, <shift> #imm
+            DpReg(kOpORR, s, RegNo(alu->rd), 15, RegNo(alu->a),
+                  Shift{type, (int)alu->b.imm});
+        else
+            Emit32(0xfa00 | type << 5 | s << 4 | RegNo(alu->a),
+                   0xf000 | RegNo(alu->rd) << 8 | RegNo(alu->b.r));
+    } break;
+    case Instr::kMOV:
+    case Instr::kMVN: {
+        auto mov = dynamic_cast<MOV *>(inst);
+        int op = inst->op == Instr::kMOV ? kOpORR : kOpORN;
+        int rd = RegNo(mov->rd);
+        bool s = inst->flags & Instr::kFlagS;
+        if (inst->flags & Instr::kFlagBIsImm) {
+            if (op == kOpORR && ModImm(mov->src.imm) < 0) {
+                assert(!s && mov->src.imm <= 0xffff);
+                MoveWide(false, rd, mov->src.imm);
+            } else {
+                DpImm(op, s, rd, 15, mov->src.imm);
+            }
+        } else if (op == kOpORR && !s) { // 16 位编码可以使用全部寄存器
+            int rm = RegNo(mov->src.r);
+            Emit16(0x4600 | (rd >> 3) << 7 | rm << 3 | (rd & 7));
+        } else {
+            DpReg(op, s, rd, 15, RegNo(mov->src.r), Shift{Shift::kLSL, 0});
+        }
+    } break;
+    case Instr::kMOVW:
+    case Instr::kMOVT: {
+        auto mw = dynamic_cast<backend::MoveWide *>(inst);
+        bool top = inst->op == Instr::kMOVT;
+        if (!mw->label.empty())
+            Fix(top ? kFixMovt : kFixMovw, mw->label);
+        MoveWide(top, RegNo(mw->rd), mw->label.empty() ? mw->imm : 0);
+    } break;
+    case Instr::kNEG: { // RSB rd, rs, #0
+        auto neg = dynamic_cast<NEG *>(inst);
+        DpImm(kOpRSB, false, RegNo(neg->rd), RegNo(neg->rs), 0);
+    } break;
+    case Instr::kCMP: {
+        auto cmp = dynamic_cast<CMP *>(inst);
+        if (inst->flags & Instr::kFlagBIsImm)
+            DpImm(kOpSUB, true, 15, RegNo(cmp->a), cmp->b.imm);
+        else
+            DpReg(kOpSUB, true, 15, RegNo(cmp->a), RegNo(cmp->b.r),
+                  Shift{Shift::kLSL, 0});
+    } break;
+    case Instr::kLabel:
+        Label(dynamic_cast<LabelInstr *>(inst)->label);
+        break;
+    case Instr::kIT: {
+        auto it = dynamic_cast<IT *>(inst);
+        int first = CondNo(it->first);
+        // 后续指令 T 取 firstcond[0], E 取反, 最后补 1
+        int mask = 0, bit = 3;
+        for (char c : it->mask)
+            mask |= ((c == 'T') == (first & 1)) << bit--;
+        mask |= 1 << bit;
+        Emit16(0xbf00 | first << 4 | mask);
+    } break;
+    default:
+        assert(false && "unsupported instruction");
+    }
+}
+
+// 与 BB::dump / Func::dump 的输出顺序一致
+void ThumbEncoder::EmitFunc(Func &f) {
+    auto emit_bb = [&](BB &bb) {
+        if (bb.label.length() > 0)
+            Label(bb.label);
+        for (auto &inst : bb.insts)
+            Emit(inst.get());
+        if (bb.branch)
+            Emit(bb.branch.get());
+    };
+    Label(f.name);
+    emit_bb(f.entry);
+    for (auto &bb : f.bbs)
+        emit_bb(*bb);
+    emit_bb(f.end);
+}
+
+// B.W / BL: S:I1:I2:imm10:imm11:0, J1 = !I1 ^ S, J2 = !I2 ^ S
+static void PatchJump(uint8_t *p, int off, bool link) {
+    int s = off >> 24 & 1, i1 = off >> 23 & 1, i2 = off >> 22 & 1;
+    int j1 = !i1 ^ s, j2 = !i2 ^ s;
+    int hw1 = 0xf000 | s << 10 | (off >> 12 & 0x3ff);
+    int hw2 = (link ? 0xd000 : 0x9000) | j1 << 13 | j2 << 11 |
+              (off >> 1 & 0x7ff);
+    p[0] = hw1, p[1] = hw1 >> 8, p[2] = hw2, p[3] = hw2 >> 8;
+}
+
+// B<c>.W: S:J2:J1:imm6:imm11:0
+static void PatchCondJump(uint8_t *p, int off) {
+    int hw1 = p[0] | p[1] << 8;
+    hw1 = (hw1 & 0xfbc0) | (off >> 20 & 1) << 10 | (off >> 12 & 0x3f);
+    int hw2 = 0x8000 | (off >> 18 & 1) << 13 | (off >> 19 & 1) << 11 |
+              (off >> 1 & 0x7ff);
+    p[0] = hw1, p[1] = hw1 >> 8, p[2] = hw2, p[3] = hw2 >> 8;
+}
+
+std::vector<ThumbEncoder::Fixup> ThumbEncoder::Resolve() {
+    std::vector<Fixup> relocs;
+    for (auto &fix : fixups) {
+        uint8_t *p = &text[fix.offset];
+        auto it = labels.find(fix.label);
+        if (fix.type == kFixMovw || fix.type == kFixMovt ||
+            it == labels.end()) {
+            // 外部符号: 跳转的加数为 -4, 即 pc 读出值与指令地址之差
+            if (fix.type == kFixJump || fix.type == kFixCall)
+                PatchJump(p, -4, fix.type == kFixCall);
+            else if (fix.type == kFixCondJump)
+                PatchCondJump(p, -4);
+            else
+                assert(fix.type != kFixAdr && "adr to undefined label");
+            relocs.push_back(fix);
+            continue;
+        }
+        int off = it->second - (fix.offset + 4);
+        switch (fix.type) {
+        case kFixJump:
+        case kFixCall:
+            assert(off >= -(1 << 24) && off < (1 << 24));
+            PatchJump(p, off, fix.type == kFixCall);
+            break;
+        case kFixCondJump:
+            assert(off >= -(1 << 20) && off < (1 << 20));
+            PatchCondJump(p, off);
+            break;
+        case kFixAdr: { // pc 按 4 字节对齐; 负偏移改用 SUB 编码
+            off = it->second - ((fix.offset + 4) & ~3);
+            int imm = std::abs(off);
+            assert(imm <= 0xfff);
+            int hw1 = (off < 0 ? 0xf2af : 0xf20f) | (imm >> 11 & 1) << 10;
+            int hw2 = (p[2] | p[3] << 8) | (imm >> 8 & 7) << 12 | (imm & 0xff);
+            p[0] = hw1, p[1] = hw1 >> 8, p[2] = hw2, p[3] = hw2 >> 8;
+        } break;
+        }
+    }
+    return relocs;
+}
+
+} // namespace backend
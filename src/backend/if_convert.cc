@@ -0,0 +1,178 @@
+#include "backend.h"
+
+namespace backend {
+
+const int kMaxIfConvertInsts = 4; // 两臂合计不超过一个 IT 块
+
+// 可以无条件提前执行的指令: 没有副作用, 不读写标志位
+static bool Speculable(Instr *inst) {
+    if (inst->cond.type != Cond::AL || (inst->flags & Instr::kFlagS))
+        return false;
+    switch (inst->op) {
+    case Instr::kMOV:
+    case Instr::kMVN:
+    case Instr::kMOVW:
+    case Instr::kMOVT:
+    case Instr::kADD:
+    case Instr::kSUB:
+    case Instr::kRSB:
+    case Instr::kMUL:
+    case Instr::kSMMUL:
+    case Instr::kAND:
+    case Instr::kOR:
+    case Instr::kLSL:
+    case Instr::kLSR:
+    case Instr::kASR:
+        return true;
+    }
+    return false;
+}
+
+// 可以条件执行的指令: 条件执行时还会读 rd, 溢出时所需的临时寄存器不能超过两个
+static bool Predicable(Instr *inst) {
+    switch (inst->op) {
+    case Instr::kMOV:
+    case Instr::kMVN:
+    case Instr::kMOVW:
+    case Instr::kMOVT:
+        return true;
+    }
+    return inst->flags & Instr::kFlagBIsImm;
+}
+
+// head: cmp; b<c> else    then: ...; b join    else: ...; b join
+// =>
+// head: cmp; then 中指令以 !c 执行; else 中指令以 c 执行; b join
+void Func::IfConvert() {
+    std::map<Reg, int> def_count;
+    for (auto &bb : bbs)
+        for (auto &inst : bb->insts)
+            for (auto r : inst->WRegs())
+                def_count[*r]++;
+
+    // 单臂结点至多一个前驱 head、一个后继 join, 且以无条件方式到达 join
+    auto is_arm = [&](BB *arm, BB *head) {
+        if (arm->preds.size() != 1 || arm->preds[0] != head ||
+            arm->succs.size() != 1)
+            return false;
+        if (arm->branch && arm->branch->cond.type != Cond::AL)
+            return false;
+        return std::all_of(arm->insts.begin(), arm->insts.end(),
+                           [](auto &inst) { return Speculable(inst.get()); });
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < bbs.size(); i++) {
+            BB *head = bbs[i].get();
+            if (!head->branch || head->branch->cond.type == Cond::AL ||
+                head->succs.size() != 2)
+                continue;
+            // 布局之前运行, 条件不成立时进入非跳转目标的后继
+            BB *else_bb = head->succs[0], *then_bb = head->succs[1];
+            if (then_bb->label == head->branch->label)
+                std::swap(then_bb, else_bb);
+            if (else_bb->label != head->branch->label || then_bb == else_bb ||
+                !is_arm(then_bb, head) || !is_arm(else_bb, head))
+                continue;
+            BB *join = then_bb->succs[0];
+            if (else_bb->succs[0] != join || join == head ||
+                join->label.empty() ||
+                then_bb->insts.size() + else_bb->insts.size() >
+                    kMaxIfConvertInsts)
+                continue;
+
+            // 只在一臂中定值的临时变量无需条件执行; then 中定值的寄存器若在
+            // else 中先被改写, 则 then 中首次定值也无需条件执行
+            std::set<Reg> else_kill, else_read;
+            for (auto &inst : else_bb->insts) {
+                for (auto r : inst->RRegs())
+                    if (!else_kill.count(*r))
+                        else_read.insert(*r);
+                for (auto r : inst->WRegs())
+                    else_kill.insert(*r);
+            }
+            std::vector<std::pair<Instr *, Cond>> plan;
+            auto predicate = [&](BB *arm, Cond cond) {
+                std::set<Reg> defined;
+                for (auto &inst : arm->insts) {
+                    Reg rd = *inst->WRegs()[0];
+                    bool uncond =
+                        LiveAnalysis::IsVReg(rd) && def_count[rd] == 1;
+                    if (arm == then_bb && !defined.count(rd) &&
+                        else_kill.count(rd) && !else_read.count(rd))
+                        uncond = true;
+                    plan.push_back({inst.get(), uncond ? Cond() : cond});
+                    defined.insert(rd);
+                }
+            };
+            Cond cond = head->branch->cond;
+            predicate(then_bb, cond.Not());
+            predicate(else_bb, cond);
+            if (!std::all_of(plan.begin(), plan.end(), [](auto &p) {
+                    return p.second.type == Cond::AL || Predicable(p.first);
+                }))
+                continue;
+            for (auto &[inst, c] : plan)
+                inst->cond = c;
+            head->insts.splice(head->insts.end(), then_bb->insts);
+            head->insts.splice(head->insts.end(), else_bb->insts);
+
+            head->succs = {join};
+            auto &preds = join->preds;
+            preds.erase(std::remove_if(preds.begin(), preds.end(),
+                                       [&](BB *bb) {
+                                           return bb == then_bb ||
+                                                  bb == else_bb;
+                                       }),
+                        preds.end());
+            preds.push_back(head);
+            bbs.erase(std::remove_if(bbs.begin(), bbs.end(),
+                                     [&](auto &bb) {
+                                         return bb.get() == then_bb ||
+                                                bb.get() == else_bb;
+                                     }),
+                      bbs.end());
+            // 臂可能位于 head 之前, 删除后重新定位
+            auto it = std::find_if(bbs.begin(), bbs.end(),
+                                   [&](auto &bb) { return bb.get() == head; });
+            if (it + 1 != bbs.end() && (it + 1)->get() == join)
+                head->branch = nullptr;
+            else
+                head->SetBranch(Cond(), join->label);
+            changed = true;
+        }
+    }
+}
+
+// 连续的条件执行指令按 4 条一组放入 IT 块, 条件须与首条相同或相反
+void Func::InsertITBlocks() {
+    auto insert = [](BB &bb) {
+        auto &insts = bb.insts;
+        for (auto it = insts.begin(); it != insts.end();) {
+            if ((*it)->cond.type == Cond::AL) {
+                it++;
+                continue;
+            }
+            Cond first = (*it)->cond;
+            Cond other = first.Not();
+            std::string mask;
+            auto end = std::next(it);
+            for (; end != insts.end() && mask.size() < 3; end++) {
+                int type = (*end)->cond.type;
+                if (type != first.type && type != other.type)
+                    break;
+                mask += type == first.type ? 'T' : 'E';
+            }
+            insts.insert(it, std::make_unique<IT>(first, mask));
+            it = end;
+        }
+    };
+    insert(entry);
+    for (auto &bb : bbs)
+        insert(*bb);
+    insert(end);
+}
+
+} // namespace backend
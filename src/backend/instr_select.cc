@@ -1,5 +1,6 @@
 #include "backend.h"
 #include "dbg.hpp"
+#include <algorithm>
 
 namespace backend {
 
@@ -11,15 +12,21 @@ const std::string DumpVregCode = "dump-vreg-code";
 const std::string DbgConvertCall = "convert-call";
 const std::string DbgConvertPhi = "convert-phi";
 
-struct InstrSelectHelper {                // 选择指令，完成转化
-    ir::Module &m;                        // LLVM IR
-    Asm &_asm;                            // ARM
+// 选择指令，完成转化; 每个函数使用独立的 helper, 不同函数可并行转化
+struct InstrSelectHelper {
+    ir::Func &f;                          // LLVM IR 函数
     Func *func;                           // 当前函数对象
-    Define *def;                          // 当前全局声明
     BB *bb;                               // 当前基本块
     std::map<ir::Value *, Reg> v_to_vreg; // 变量与寄存器映射表
-
-    InstrSelectHelper(ir::Module &m, Asm &_asm) : m(m), _asm(_asm) {
+    int edge_count = 0;                   // 拆分关键边产生的基本块数
+    // 已在入口块取得的全局变量地址
+    std::map<std::string, Reg> global_addr;
+    // 除 load / store 的地址外还有其他用途的值
+    std::set<ir::Value *> addr_escaped;
+    // 折叠进 load / store 寻址方式的 GEP 与 alloca
+    std::map<ir::Value *, Address> folded_addr;
+
+    InstrSelectHelper(ir::Func &f, Func &func) : f(f), func(&func) {
         VRegReset();
     }
 
@@ -30,23 +37,38 @@ struct InstrSelectHelper {                // 选择指令，完成转化
     Reg GetGlobalAdrr(std::shared_ptr<ir::Value> g);
     Reg LoadGlobal(Reg rt, std::shared_ptr<ir::Value> g);
     void StoreGlobal(std::shared_ptr<ir::Value> g, Reg rd);
+    Address GetAddress(std::shared_ptr<ir::Value> ptr);
 
     builder::adv::Operand GetOperand(std::shared_ptr<ir::Value> v);
     builder::adv::Operand GetOperand(Reg r);
     builder::adv::Operand GetOperand(Word imm);
     void ConvertBinaryAlu(ir::BinaryAlu *alu);
+    void ConvertMulImm(Reg rd, Reg a, Word c);
+    void ConvertDivImm(Reg rd, Reg a, int d, bool rem);
     void ConvertOtherInst(ir::Instr *inst);
     void ConvertGetelementPtr(ir::Getelementptr *getelementptr);
     int ShiftCount(Word x);
     Cond IrCond2AsmCond(int cond);
     Reg ConvertIcmpI32(ir::Icmp *icmp);
     std::string GetBBLabel(std::shared_ptr<ir::LocalValue> l);
+    BB *SplitEdge(BB *pred, BB *succ);
+    void ConvertPhiCopies(
+        BB *bb, std::vector<std::pair<Reg, builder::adv::Operand>> copies);
 
     void Build();
 };
 
 void InstrSelectHelper ::VRegReset() { v_to_vreg.clear(); }
 
+// v 是否仅作为 inst 访存的地址
+static bool IsAddrUse(ir::Instr *inst, std::shared_ptr<ir::Value> &v) {
+    if (auto load = dynamic_cast<ir::Load *>(inst))
+        return load->ptr == v;
+    if (auto store = dynamic_cast<ir::Store *>(inst))
+        return store->ptr == v && store->val != v;
+    return false;
+}
+
 // Value  -- 变量
 Reg InstrSelectHelper ::GetVReg(
     std::shared_ptr<ir::Value> v) { // 变量与寄存器映射
@@ -79,28 +101,40 @@ int InstrSelectHelper ::IrAluOpToAsmOp(int op) {
     return m[op];
 }
 
+// 每个全局变量的地址在函数入口块取一次, 之后复用同一个虚拟寄存器;
+// 寄存器紧张时由寄存器分配在使用处重新计算, 见 RegAllocaHelper::FindRemat
 Reg InstrSelectHelper ::GetGlobalAdrr(std::shared_ptr<ir::Value> g) {
     auto var = std::dynamic_pointer_cast<ir::GlobalVar>(g);
+    auto it = global_addr.find(var->name);
+    if (it != global_addr.end())
+        return it->second;
     Reg rd = GetVReg();
-    builder::Load(BACK(bb->insts), rd, Address(var->name), true);
+    auto &entry = func->bbs.front()->insts;
+    builder::LoadAddr(entry, entry.begin(), rd, var->name);
+    global_addr[var->name] = rd;
     return rd;
 }
 
 Reg InstrSelectHelper ::LoadGlobal(Reg rt, std::shared_ptr<ir::Value> g) {
-    Reg rd = GetGlobalAdrr(g); // LDR rd =name
+    Reg rd = GetGlobalAdrr(g); // rd = &name
     builder::Load(BACK(bb->insts), rt, Address(rd));
     return rt; /// ?
 }
 
 void InstrSelectHelper ::StoreGlobal(std::shared_ptr<ir::Value> g,
                                      Reg rd) { //******
-    auto var = std::dynamic_pointer_cast<ir::GlobalVar>(g);
-    Reg rtemp = GetVReg();
-    builder::Load(BACK(bb->insts), rtemp, Address(var->name),
-                  true);                                 // LDR rtemp =name
+    Reg rtemp = GetGlobalAdrr(g);                        // rtemp = &name
     builder::Store(BACK(bb->insts), rd, Address(rtemp)); // STR rd [rtemp]
 }
 
+// load / store 的地址, 折叠的 GEP 与 alloca 直接使用对应的寻址方式
+Address InstrSelectHelper ::GetAddress(std::shared_ptr<ir::Value> ptr) {
+    auto it = folded_addr.find(ptr.get());
+    if (it != folded_addr.end())
+        return it->second;
+    return Address(GetVReg(ptr));
+}
+
 builder::adv::Operand
 InstrSelectHelper ::GetOperand(std::shared_ptr<ir::Value> v) {
     if (v->kind == ir::Value::kImm) {
@@ -125,7 +159,17 @@ builder::adv::Operand InstrSelectHelper ::GetOperand(Word imm) {
 void InstrSelectHelper ::ConvertBinaryAlu(ir::BinaryAlu *alu) {
     auto r = GetOperand(alu->result), a = GetOperand(alu->l),
          b = GetOperand(alu->r);
-    if (alu->op == ir::Instr::kOpSrem) {
+    if (alu->op == ir::Instr::kOpMul && (a.flags & a.kIsImm) &&
+        !(b.flags & b.kIsImm))
+        std::swap(a, b);
+    bool b_imm = (b.flags & b.kIsImm) && !(a.flags & a.kIsImm);
+    if (alu->op == ir::Instr::kOpMul && b_imm) {
+        ConvertMulImm(r.r, a.r, b.imm);
+    } else if ((alu->op == ir::Instr::kOpSdiv ||
+                alu->op == ir::Instr::kOpSrem) &&
+               b_imm && (int)b.imm != 0 && (int)b.imm != INT32_MIN) {
+        ConvertDivImm(r.r, a.r, b.imm, alu->op == ir::Instr::kOpSrem);
+    } else if (alu->op == ir::Instr::kOpSrem) {
         // l % r == l - l / r
         builder::adv::BinaryAlu(*func, BACK(bb->insts), Instr::kSDIV, r, a, b);
         builder::adv::BinaryAlu(*func, BACK(bb->insts), Instr::kMUL, r, r, b);
@@ -136,6 +180,133 @@ void InstrSelectHelper ::ConvertBinaryAlu(ir::BinaryAlu *alu) {
     }
 }
 
+// rd = a * c, c 为 2^k, 2^k +/- 1 及其左移时用移位与加减代替乘法
+void InstrSelectHelper ::ConvertMulImm(Reg rd, Reg a, Word c) {
+    auto &insts = bb->insts;
+    if (c == 0) {
+        builder::Move(BACK(insts), rd, (Word)0);
+        return;
+    }
+    if (c == (Word)-1) {
+        builder::BinaryAlu(BACK(insts), Instr::kRSB, rd, a, (Word)0);
+        return;
+    }
+    int low = __builtin_ctz(c); // c = m << low, m 为奇数
+    Word m = c >> low;
+    int k = 0;
+    Reg t = low ? func->AllocaVReg() : rd;
+    if (m == 1) {
+        t = a;
+    } else if (ShiftCount(m - 1)) { // m = 2^k + 1
+        k = ShiftCount(m - 1);
+        builder::adv::BinaryAlu(*func, BACK(insts), Instr::kADD, t, a, a, true,
+                                Shift{Shift::kLSL, k});
+    } else if (ShiftCount(m + 1)) { // m = 2^k - 1
+        k = ShiftCount(m + 1);
+        builder::adv::BinaryAlu(*func, BACK(insts), Instr::kRSB, t, a, a, true,
+                                Shift{Shift::kLSL, k});
+    } else {
+        builder::adv::BinaryAlu(*func, BACK(insts), Instr::kMUL, rd, a, c);
+        return;
+    }
+    if (low)
+        builder::BinaryAlu(BACK(insts), Instr::kLSL, rd, t, low);
+    else if (t != rd)
+        builder::Move(BACK(insts), rd, t);
+}
+
+// 有符号除以常数 d 的魔数 m 与移位量 s: q = hi(m * n) >> s (Hacker's Delight
+// 10-1), 要求 2 <= |d| < 2^31
+static void SignedMagic(int d, int &m, int &s) {
+    const Word two31 = 0x80000000u;
+    Word ad = d < 0 ? -(Word)d : d;
+    Word t = two31 + ((Word)d >> 31);
+    Word anc = t - 1 - t % ad; // |nc|
+    Word q1 = two31 / anc, r1 = two31 - q1 * anc;
+    Word q2 = two31 / ad, r2 = two31 - q2 * ad;
+    Word delta;
+    int p = 31;
+    do {
+        p++;
+        q1 *= 2, r1 *= 2;
+        if (r1 >= anc)
+            q1++, r1 -= anc;
+        q2 *= 2, r2 *= 2;
+        if (r2 >= ad)
+            q2++, r2 -= ad;
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    m = q2 + 1;
+    if (d < 0)
+        m = -m;
+    s = p - 32;
+}
+
+// rd = a / d 或 a % d, 结果向零取整; 2 的幂用移位修正负数的舍入,
+// 其余用乘法取高位代替除法
+void InstrSelectHelper ::ConvertDivImm(Reg rd, Reg a, int d, bool rem) {
+    auto &insts = bb->insts;
+    auto alu = [&](int op, Reg r, Reg x, Reg y, int shift_type = Shift::kLSL,
+                   int shift = 0) {
+        builder::adv::BinaryAlu(*func, BACK(insts), op, r, x, y, shift > 0,
+                                Shift{shift_type, shift});
+    };
+    if (rem) // a % d == a % -d
+        d = d < 0 ? -d : d;
+    Word ad = d < 0 ? -(Word)d : d;
+    int k = ShiftCount(ad);
+    if (ad == 1) {
+        if (rem)
+            builder::Move(BACK(insts), rd, (Word)0);
+        else if (d > 0)
+            builder::Move(BACK(insts), rd, a);
+        else
+            builder::BinaryAlu(BACK(insts), Instr::kRSB, rd, a, (Word)0);
+        return;
+    }
+
+    Reg q = rem || (k && d < 0) ? func->AllocaVReg() : rd;
+    if (k) {
+        // 被除数为负时先加上 2^k - 1
+        Reg sign = a, biased = func->AllocaVReg();
+        if (k > 1) {
+            sign = func->AllocaVReg();
+            builder::BinaryAlu(BACK(insts), Instr::kASR, sign, a, 31);
+        }
+        alu(Instr::kADD, biased, a, sign, Shift::kLSR, 32 - k);
+        builder::BinaryAlu(BACK(insts), Instr::kASR, q, biased, k);
+        if (rem)
+            alu(Instr::kSUB, rd, a, q, Shift::kLSL, k);
+        else if (d < 0)
+            builder::BinaryAlu(BACK(insts), Instr::kRSB, rd, q, (Word)0);
+        return;
+    }
+
+    // 负除数的魔数已经给出取反后的商
+    int m, s;
+    SignedMagic(d, m, s);
+    Reg magic = builder::adv::Op2Reg(*func, BACK(insts), (Word)m);
+    Reg t = func->AllocaVReg();
+    alu(Instr::kSMMUL, t, a, magic);
+    if ((d > 0 && m < 0) || (d < 0 && m > 0)) {
+        Reg t2 = func->AllocaVReg();
+        alu(d > 0 ? Instr::kADD : Instr::kSUB, t2, t, a);
+        t = t2;
+    }
+    if (s > 0) {
+        Reg t2 = func->AllocaVReg();
+        builder::BinaryAlu(BACK(insts), Instr::kASR, t2, t, s);
+        t = t2;
+    }
+    // 商为负时加一, 向零取整
+    alu(Instr::kADD, q, t, t, Shift::kLSR, 31);
+    if (rem) {
+        Reg prod = func->AllocaVReg();
+        ConvertMulImm(prod, q, d);
+        alu(Instr::kSUB, rd, a, prod);
+    }
+}
+
 void InstrSelectHelper ::ConvertOtherInst(ir::Instr *inst) {
     switch (inst->op) {
     case ir::Instr::kOpCall: {
@@ -143,6 +314,7 @@ void InstrSelectHelper ::ConvertOtherInst(ir::Instr *inst) {
         int argc = call->args.size();
         func->frame.max_call_arg_count =
             std::max(func->frame.max_call_arg_count, argc);
+        func->frame.has_call = true;
         Reg ret = Reg::INVALID;
         std::vector<Reg> args;
         for (auto arg : call->args) {
@@ -172,7 +344,7 @@ void InstrSelectHelper ::ConvertOtherInst(ir::Instr *inst) {
             LoadGlobal(GetVReg(load->result), load->ptr);
         } else {
             builder::Load(BACK(bb->insts), GetVReg(load->result),
-                          Address(GetVReg(load->ptr)));
+                          GetAddress(load->ptr));
         }
     } break;
     case ir::Instr::kOpStore: {
@@ -181,83 +353,109 @@ void InstrSelectHelper ::ConvertOtherInst(ir::Instr *inst) {
             StoreGlobal(store->ptr, GetVReg(store->val));
         } else {
             builder::Store(BACK(bb->insts), GetVReg(store->val),
-                           Address(GetVReg(store->ptr)));
+                           GetAddress(store->ptr));
         }
     } break;
     case ir::Instr::kOpAlloca: {
         auto alloca = dynamic_cast<ir::Alloca *>(inst);
-        builder::BinaryAlu(
-            BACK(bb->insts), Instr::kADD, GetVReg(alloca->result),
-            func->frame.local_var_base,
-            func->frame.AllocaVar(alloca->ty->size(), alloca->alignment));
+        Word offset =
+            func->frame.AllocaVar(alloca->ty->size(), alloca->alignment);
+        if (!addr_escaped.count(alloca->result.get()) && offset <= 4095) {
+            folded_addr[alloca->result.get()] =
+                Address(func->frame.local_var_base, offset);
+            break;
+        }
+        builder::BinaryAlu(BACK(bb->insts), Instr::kADD,
+                           GetVReg(alloca->result), func->frame.local_var_base,
+                           offset);
     } break;
     case ir::Instr::kOpZext:
     case ir::Instr::kOpBitcast: {
-        v_to_vreg[inst->Result().get()] = GetVReg((*inst->RValues().front()));
+        // 全局变量需要先取地址
+        v_to_vreg[inst->Result().get()] = builder::adv::Op2Reg(
+            *func, BACK(bb->insts), GetOperand(*inst->RValues().front()));
     } break;
     }
 }
 
+// 地址为 base + (index << shift) + offset; 结果只用作 load / store 的地址时,
+// 最后一步折叠进 [base, #offset] 或 [base, index, LSL #shift]
 void InstrSelectHelper ::ConvertGetelementPtr(
     ir::Getelementptr *getelementptr) {
-    auto rd = GetOperand(getelementptr->result);
-    auto base = GetOperand(getelementptr->ptr);
+    Reg base = GetOperand(getelementptr->ptr).r, index = Reg::INVALID;
+    int shift = 0;
+    Word offset = 0;
 
-    auto set_index = [&](std::shared_ptr<ir::Value> idx, int size) {
+    // 已有的下标先累加进基址
+    auto flush_index = [&](Reg rd) {
+        builder::adv::BinaryAlu(*func, BACK(bb->insts), Instr::kADD, rd, base,
+                                index, shift > 0, Shift{Shift::kLSL, shift});
+        base = rd;
+        index = Reg::INVALID;
+    };
+    auto add_index = [&](std::shared_ptr<ir::Value> idx, int size) {
         if (idx->kind == ir::Value::kImm) {
-            auto offset =
-                size * std::dynamic_pointer_cast<ir::ImmValue>(idx)->imm;
-            if (offset != 0) {
-                builder::adv::BinaryAlu(*func, BACK(bb->insts), Instr::kADD, rd,
-                                        base, GetOperand(offset));
-            } else {
-                builder::adv::Move(*func, BACK(bb->insts), rd, base);
-            }
-        } else {
-            int shift = ShiftCount(size);
-            if (shift) {
-                builder::adv::BinaryAlu(*func, BACK(bb->insts), Instr::kADD, rd,
-                                        base, GetVReg(idx), true,
-                                        Shift{Shift::kLSL, shift});
-            } else {
-                builder::adv::Operand t = rd;
-                if (rd.r == base.r)
-                    t = builder::adv::Operand(func->AllocaVReg());
-                builder::adv::BinaryAlu(*func, BACK(bb->insts), Instr::kMUL, t,
-                                        GetVReg(idx), GetOperand(size));
-                builder::adv::BinaryAlu(*func, BACK(bb->insts), Instr::kADD, rd,
-                                        base, t);
-            }
+            offset += size * std::dynamic_pointer_cast<ir::ImmValue>(idx)->imm;
+            return;
+        }
+        if (index != Reg::INVALID)
+            flush_index(func->AllocaVReg());
+        index = GetVReg(idx);
+        shift = ShiftCount(size);
+        if ((1 << shift) != size) {
+            Reg t = func->AllocaVReg();
+            ConvertMulImm(t, index, size);
+            index = t;
+            shift = 0;
         }
     };
 
-    auto idx = getelementptr->indices[0];
-    set_index(idx, getelementptr->ty->size());
+    add_index(getelementptr->indices[0], getelementptr->ty->size());
 
     if (!NotAllowTy) //
         printf("0 size : %d ty: %d\n", getelementptr->ty->size(),
                getelementptr->ty->kind);
 
     if (getelementptr->indices.size() >= 2) {
-        base = rd;
-        idx = getelementptr->indices[1];
         auto arr_ty = getelementptr->ty->cast<ir::ArrayT>();
 
         if (!NotAllowTy) //
             printf("1 size : %d ty: %d\n", arr_ty->element->size(),
                    arr_ty->element->kind);
-        set_index(idx, arr_ty->element->size());
+        add_index(getelementptr->indices[1], arr_ty->element->size());
+    }
+
+    auto result = getelementptr->result.get();
+    if (!addr_escaped.count(result)) {
+        if (index == Reg::INVALID && offset <= 4095) {
+            folded_addr[result] = Address(base, offset);
+            return;
+        }
+        // Thumb-2 寄存器偏移只支持 LSL #0-3
+        if (index != Reg::INVALID && offset == 0 && shift <= 3) {
+            folded_addr[result] = Address(base, index, shift);
+            return;
+        }
+    }
+
+    Reg rd = GetVReg(getelementptr->result);
+    if (index != Reg::INVALID)
+        flush_index(rd);
+    if (offset != 0) {
+        builder::adv::BinaryAlu(*func, BACK(bb->insts), Instr::kADD, rd, base,
+                                GetOperand(offset));
+        base = rd;
     }
+    // 下标全为 0 时结果即基址, 共用同一个寄存器而不产生拷贝
+    if (base != rd)
+        v_to_vreg[result] = base;
 }
 
+// x 为 2 的幂时返回其指数, 否则返回 0
 int InstrSelectHelper ::ShiftCount(Word x) {
-    if (x == 0)
+    if (x == 0 || (x & (x - 1)))
         return 0;
-    Word n = 1;
-    int shift = 0;
-    while (n < x && n & x)
-        (n <<= 1), shift++;
-    return n == x ? shift : 0;
+    return __builtin_ctz(x);
 }
 
 Cond InstrSelectHelper ::IrCond2AsmCond(int cond) {
@@ -271,19 +469,15 @@ Cond InstrSelectHelper ::IrCond2AsmCond(int cond) {
     return Cond(m[cond]);
 }
 
+// cmp a, b; mov rd, #0; it cond; mov<cond> rd, #1
 Reg InstrSelectHelper ::ConvertIcmpI32(ir::Icmp *icmp) {
     builder::adv::Cmp(*func, BACK(bb->insts), GetOperand(icmp->l),
                       GetOperand(icmp->r));
 
     Reg rd = GetVReg(icmp->result);
-    auto lout = ".L_cmp_out_" + std::to_string((int)rd),
-         l1 = ".L_cmp_1_" + std::to_string((int)rd);
-    builder::Branch(BACK(bb->insts), IrCond2AsmCond(icmp->cond), l1);
     builder::Move(BACK(bb->insts), rd, 0);
-    builder::Branch(BACK(bb->insts), Cond(), lout);
-    builder::Label(BACK(bb->insts), l1);
     builder::Move(BACK(bb->insts), rd, 1);
-    builder::Label(BACK(bb->insts), lout);
+    bb->insts.back()->cond = IrCond2AsmCond(icmp->cond);
     return rd;
 }
 
@@ -291,169 +485,230 @@ std::string InstrSelectHelper ::GetBBLabel(std::shared_ptr<ir::LocalValue> l) {
     return ".L_" + func->name + "_bb_" + l->var();
 }
 
-void InstrSelectHelper ::Build() { // 进行转化
-
-    for (auto &def : m.defs) {
-        _asm.defs.push_back(std::make_unique<Define>());
-        this->def = _asm.defs.back().get();
+// 在关键边 pred -> succ 上插入新的基本块, 用于放置 phi 拷贝
+BB *InstrSelectHelper ::SplitEdge(BB *pred, BB *succ) {
+    auto nbb = std::make_unique<BB>();
+    BB *edge = nbb.get();
+    edge->label = ".L_" + func->name + "_edge_" + std::to_string(edge_count++);
+
+    // 执行拷贝后跳到 succ, 位置由布局决定
+    if (pred->branch && pred->branch->label == succ->label)
+        pred->branch->label = edge->label;
+    edge->SetBranch(Cond(), succ->label);
+    func->bbs.push_back(std::move(nbb));
+
+    std::replace(pred->succs.begin(), pred->succs.end(), succ, edge);
+    std::replace(succ->preds.begin(), succ->preds.end(), pred, edge);
+    edge->preds.push_back(pred);
+    edge->succs.push_back(succ);
+    return edge;
+}
 
-        this->def->is_const = def->is_const;
-        this->def->name = def->var->name;
-        this->def->init = std::move(def->init);
+// 同一条边上的 phi 拷贝语义上是并行的, 按依赖顺序串行化, 成环时借助临时寄存器
+void InstrSelectHelper ::ConvertPhiCopies(
+    BB *bb, std::vector<std::pair<Reg, builder::adv::Operand>> copies) {
+    auto is_src = [&](Reg r) {
+        for (auto &c : copies)
+            if (!(c.second.flags & builder::adv::Operand::kIsImm) &&
+                c.second.r == r)
+                return true;
+        return false;
+    };
+    while (!copies.empty()) {
+        auto it = std::find_if(copies.begin(), copies.end(), [&](auto &c) {
+            return !is_src(c.first);
+        });
+        if (it != copies.end()) {
+            builder::adv::Move(*func, BACK(bb->insts), it->first, it->second);
+            copies.erase(it);
+            continue;
+        }
+        Reg d = copies.front().first, tmp = func->AllocaVReg();
+        builder::Move(BACK(bb->insts), tmp, d);
+        for (auto &c : copies)
+            if (!(c.second.flags & builder::adv::Operand::kIsImm) &&
+                c.second.r == d)
+                c.second.r = tmp;
     }
+}
 
-    for (auto &f : m.funcs) {
-
-        std::map<ir::BB *, std::vector<ir::Phi *>> phis; // 基本块与指令的映射
-
-        // first: br refer count, second: alu refer count
-        std::map<std::shared_ptr<ir::Value>, std::pair<int, int>> icmp_refcount;
-        std::map<std::shared_ptr<ir::Value>, Cond> icmp_cond;
-        std::vector<BB *> ir_bb_to_asm_bb;
-
-        // build function
-        _asm.funcs.push_back(
-            std::make_unique<Func>(f->name)); // 初始化当前函数块
-        this->func = _asm.funcs.back().get(); // 得到当前函数指针
+void InstrSelectHelper ::Build() { // 进行转化
+    std::map<ir::BB *, std::vector<ir::Phi *>> phis; // 基本块与指令的映射
 
-        // clear vreg allocator
-        v_to_vreg.clear(); // 初始化 ？
+    // first: br refer count, second: alu refer count
+    std::map<std::shared_ptr<ir::Value>, std::pair<int, int>> icmp_refcount;
+    // 只被同一块内 br 使用的 icmp, 比较推迟到 br 处, 以免中间的指令改写标志位
+    std::map<std::shared_ptr<ir::Value>, ir::Icmp *> flag_icmps;
+    std::vector<BB *> ir_bb_to_asm_bb;
 
-        for (auto &arg : f->args) { // 将传递的参数与寄存器建立映射
-            this->func->args.push_back(GetVReg(arg));
-        }
+    for (auto &arg : f.args) { // 将传递的参数与寄存器建立映射
+        this->func->args.push_back(GetVReg(arg));
+    }
 
-        this->func->frame.spilled_arg_count = std::max(
-            (int)f->args.size() - this->func->frame.max_reg_arg_count, 0);
+    this->func->frame.spilled_arg_count = std::max(
+        (int)f.args.size() - this->func->frame.max_reg_arg_count, 0);
 
-        this->func->has_ret = (f->ft->ret->kind != ir::Type::kVoid);
-        f->ResetBBID();
-        f->ResetTmpVar();
+    this->func->has_ret = (f.ft->ret->kind != ir::Type::kVoid);
+    f.ResetBBID();
+    f.ResetTmpVar();
 
-        // first traversal, create bb, collecting icmp info
-        for (auto &bb : f->bblocks) {
+    // first traversal, create bb, collecting icmp info
+    for (auto &bb : f.bblocks) {
 
-            this->func->bbs.push_back(std::make_unique<BB>());
-            this->bb = this->func->bbs.back().get();
-            this->bb->ir_bb = bb.get();
+        this->func->bbs.push_back(std::make_unique<BB>());
+        this->bb = this->func->bbs.back().get();
+        this->bb->ir_bb = bb.get();
 
-            if (bb->label) // 基本块标签
-                this->bb->label = GetBBLabel(bb->label);
+        if (bb->label) // 基本块标签
+            this->bb->label = GetBBLabel(bb->label);
 
-            assert(bb->id == ir_bb_to_asm_bb.size());
-            ir_bb_to_asm_bb.push_back(this->bb);
+        assert(bb->id == ir_bb_to_asm_bb.size());
+        ir_bb_to_asm_bb.push_back(this->bb);
 
-            for (auto &inst : bb->insts) {
+        std::set<ir::Value *> local_icmps;
+        for (auto &inst : bb->insts) {
 
-                if (inst->op == ir::Instr::kOpIcmp) { // Icmp
-                    auto res = inst->Result();
-                    icmp_refcount[res] = {0, 0};
-                }
-                for (auto p : inst->RValues()) {
-                    auto &v = *p;
-                    auto it = icmp_refcount.find(v);
-                    if (it != icmp_refcount.end()) {
-                        if (inst->op == ir::Instr::kOpBr) {
-                            it->second.first++;
-                        } else {
-                            it->second.second++;
-                        }
+            if (inst->op == ir::Instr::kOpIcmp) { // Icmp
+                auto res = inst->Result();
+                icmp_refcount[res] = {0, 0};
+                local_icmps.insert(res.get());
+            }
+            for (auto p : inst->RValues()) {
+                auto &v = *p;
+                if (!IsAddrUse(inst.get(), v))
+                    addr_escaped.insert(v.get());
+                auto it = icmp_refcount.find(v);
+                if (it != icmp_refcount.end()) {
+                    // 只有同一块内的 br 能直接使用标志位
+                    if (inst->op == ir::Instr::kOpBr &&
+                        local_icmps.count(v.get())) {
+                        it->second.first++;
+                    } else {
+                        it->second.second++;
                     }
                 }
             }
         }
+    }
 
-        // second traversal, convert instr
-        for (auto &bb : f->bblocks) {
-            this->bb = ir_bb_to_asm_bb[bb->id];
-
-            for (auto &inst : bb->insts) {
-                if (inst->IsBinaryAlu()) { // 运算指令
-                    ConvertBinaryAlu(dynamic_cast<ir::BinaryAlu *>(inst.get()));
-                } else if (inst->op == ir::Instr::kOpIcmp) { // Icmp
-                    auto &refcount = icmp_refcount[inst->Result()];
-                    auto icmp = dynamic_cast<ir::Icmp *>(inst.get());
-                    if (refcount.second > 0) {
-                        ConvertIcmpI32(icmp);
-                    } else {
+    // second traversal, convert instr
+    for (auto &bb : f.bblocks) {
+        this->bb = ir_bb_to_asm_bb[bb->id];
+
+        for (auto &inst : bb->insts) {
+            if (inst->IsBinaryAlu()) { // 运算指令
+                ConvertBinaryAlu(dynamic_cast<ir::BinaryAlu *>(inst.get()));
+            } else if (inst->op == ir::Instr::kOpIcmp) { // Icmp
+                auto &refcount = icmp_refcount[inst->Result()];
+                auto icmp = dynamic_cast<ir::Icmp *>(inst.get());
+                if (refcount.second > 0) {
+                    ConvertIcmpI32(icmp);
+                } else {
+                    flag_icmps[icmp->result] = icmp;
+                }
+            } else if (inst->op == ir::Instr::kOpPhi) { // phi
+                phis[bb.get()].push_back(
+                    dynamic_cast<ir::Phi *>(inst.get()));
+            } else if (inst->op == ir::Instr::kOpGetelementptr) {
+                ConvertGetelementPtr(
+                    dynamic_cast<ir::Getelementptr *>(inst.get()));
+            } else if (inst->op == ir::Instr::kOpBr) { // br
+                auto br = dynamic_cast<ir::Br *>(inst.get());
+                // 条件不成立时跳到 l2, 否则顺序进入 l1; 块的先后由布局决定
+                if (br->cond) {
+                    // 每个块各自比较; 条件已物化为 0 / 1 时与 0 比较
+                    Cond cond(Cond::EQ);
+                    auto it = flag_icmps.find(br->cond);
+                    if (it != flag_icmps.end()) {
+                        auto icmp = it->second;
                         builder::adv::Cmp(*func, BACK(this->bb->insts),
                                           GetOperand(icmp->l),
                                           GetOperand(icmp->r));
-                        icmp_cond[icmp->result] =
-                            IrCond2AsmCond(icmp->cond).Not();
-                    }
-                } else if (inst->op == ir::Instr::kOpPhi) { // phi
-                    phis[bb.get()].push_back(
-                        dynamic_cast<ir::Phi *>(inst.get()));
-                } else if (inst->op == ir::Instr::kOpGetelementptr) {
-                    ConvertGetelementPtr(
-                        dynamic_cast<ir::Getelementptr *>(inst.get()));
-                } else if (inst->op == ir::Instr::kOpBr) { // br
-                    auto br = dynamic_cast<ir::Br *>(inst.get());
-                    if (br->cond) {
-                        // 若l2在l1前，会出现问题
-                        int l1_int = atoi(br->l1->var().c_str());
-                        int l2_int = atoi(br->l2->var().c_str());
-                        if (l2_int < l1_int) {
-                            swap(br->l1, br->l2);
-                            icmp_cond[br->cond] = icmp_cond[br->cond].Not();
-                        }
-                        this->bb->SetBranch(icmp_cond[br->cond],
-                                            GetBBLabel(br->l2));
-                        auto bb2 =
-                            ir_bb_to_asm_bb[f->label_map[br->l2.get()]->id];
-
-                        this->bb->succs.push_back(bb2);
-                        bb2->preds.push_back(this->bb);
+                        cond = IrCond2AsmCond(icmp->cond).Not();
                     } else {
-                        // check next bb is equal to label or not
-                        auto need_branch = [&]() -> bool {
-                            if (bb->id + 1 < func->bbs.size()) {
-                                auto &next_bb = f->bblocks[bb->id + 1];
-                                return next_bb->label != br->l1;
-                            }
-                            return true;
-                        };
-                        if (need_branch())
-                            this->bb->SetBranch(Cond(), GetBBLabel(br->l1));
+                        builder::adv::Cmp(*func, BACK(this->bb->insts),
+                                          GetOperand(br->cond), (Word)0);
                     }
-                    auto bb1 = ir_bb_to_asm_bb[f->label_map[br->l1.get()]->id];
-                    this->bb->succs.push_back(bb1);
-                    bb1->preds.push_back(this->bb);
+                    this->bb->SetBranch(cond, GetBBLabel(br->l2));
+                    auto bb2 =
+                        ir_bb_to_asm_bb[f.label_map[br->l2.get()]->id];
+
+                    this->bb->succs.push_back(bb2);
+                    bb2->preds.push_back(this->bb);
+                } else {
+                    this->bb->SetBranch(Cond(), GetBBLabel(br->l1));
                 }
+                auto bb1 = ir_bb_to_asm_bb[f.label_map[br->l1.get()]->id];
+                this->bb->succs.push_back(bb1);
+                bb1->preds.push_back(this->bb);
+            }
 
-                else {
-                    ConvertOtherInst(inst.get());
-                }
+            else {
+                ConvertOtherInst(inst.get());
             }
         }
+    }
 
-        // convert phi instr
-        for (auto &i : phis) {
-            for (auto &phi : i.second) {
-                auto rd = GetOperand(phi->result);
+    // convert phi instr, 按边收集拷贝, 关键边需要拆分
+    for (auto &ir_bb : f.bblocks) {
+        auto it = phis.find(ir_bb.get());
+        if (it == phis.end())
+            continue;
+        BB *succ = ir_bb_to_asm_bb[ir_bb->id];
+        std::vector<BB *> preds;
+        std::map<BB *, std::vector<std::pair<Reg, builder::adv::Operand>>>
+            copies;
+        for (auto &phi : it->second) {
+            auto rd = GetVReg(phi->result);
+            if (DbgEnabled(DbgConvertPhi)) {
+                std::cerr << "PHI -> " + Reg2Str(rd) << "\n";
+            }
+            for (auto &pv : phi->vals) {
+                auto pred =
+                    ir_bb_to_asm_bb[f.label_map[pv.label.get()]->id];
                 if (DbgEnabled(DbgConvertPhi)) {
-                    std::cerr << "PHI -> " + Reg2Str(rd.r) << "\n";
-                }
-                for (auto &pv : phi->vals) {
-                    auto bb = ir_bb_to_asm_bb[f->label_map[pv.label.get()]->id];
-                    if (DbgEnabled(DbgConvertPhi)) {
-                        fprintf(stderr, "%s -> %s\n", pv.label->str().c_str(),
-                                bb->label.c_str());
-                    }
-                    builder::adv::Move(*func, BACK(bb->insts), rd,
-                                       GetOperand(pv.val));
+                    fprintf(stderr, "%s -> %s\n", pv.label->str().c_str(),
+                            pred->label.c_str());
                 }
+                if (!copies.count(pred))
+                    preds.push_back(pred);
+                this->bb = pred; // 全局变量地址在前驱中获取
+                copies[pred].push_back({rd, GetOperand(pv.val)});
             }
         }
+        for (auto pred : preds) {
+            BB *at = pred->succs.size() > 1 ? SplitEdge(pred, succ) : pred;
+            ConvertPhiCopies(at, copies[pred]);
+        }
     }
+
+    func->IfConvert();
+    func->ComputeLoopDepth();
+    func->LayoutBlocks();
 }
 
-void InstrSelect(ir::Module &m, Asm &_asm) {
-    InstrSelectHelper helper(m, _asm);
+void InstrSelectDefs(ir::Module &m, Asm &_asm) {
+    for (auto &def : m.defs) {
+        _asm.defs.push_back(std::make_unique<Define>());
+        auto d = _asm.defs.back().get();
+        d->is_const = def->is_const;
+        d->name = def->var->name;
+        d->init = std::move(def->init);
+    }
+}
+
+void InstrSelect(ir::Func &f, Func &func) {
+    InstrSelectHelper helper(f, func);
     helper.Build();
-    if (DbgEnabled(DumpVregCode)) {
-        _asm.dump(std::cerr);
+    if (DbgEnabled(DumpVregCode))
+        func.dump(std::cerr);
+}
+
+void InstrSelect(ir::Module &m, Asm &_asm) {
+    InstrSelectDefs(m, _asm);
+    for (auto &f : m.funcs) {
+        _asm.funcs.push_back(std::make_unique<Func>(f->name));
+        InstrSelect(*f, *_asm.funcs.back());
     }
 }
 
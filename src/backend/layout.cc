@@ -0,0 +1,199 @@
+#include "backend.h"
+#include "dbg.hpp"
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <set>
+
+namespace backend {
+
+const std::string DbgLayout = "layout";
+
+// 静态估计的执行频率: 每层循环按 8 倍计
+static int64_t Freq(BB *bb) {
+    return (int64_t)1 << (3 * std::min(bb->loop_depth, 8));
+}
+
+// Pettis-Hansen 链式放置:
+// 1. 按估计权重从大到小合并链, 边的源须为链尾、目标须为链首, 回边不参与合并,
+//    使循环头位于循环体之前, 回边成为循环内唯一的跳转
+// 2. 入口所在链放在最前, 其余链按与已放置块相连的最大权重依次放置
+// 3. 修正跳转: 条件跳转目标紧随其后时取反条件, 两个后继都不紧随时插入跳转块,
+//    删除到下一块的无条件跳转
+void Func::LayoutBlocks() {
+    ResetBBID();
+    int n = bbs.size();
+    if (n == 0)
+        return;
+
+    auto valid = [&](BB *bb) { return bb != &end && bb != &entry; };
+    // 顺序后继: 条件跳转块中非跳转目标的后继
+    auto fall_succ = [&](BB *bb) -> BB * {
+        if (!bb->branch || bb->branch->cond.type == Cond::AL)
+            return nullptr;
+        for (auto succ : bb->succs)
+            if (succ->label != bb->branch->label)
+                return succ;
+        return nullptr;
+    };
+
+    // 深度优先搜索找出回边
+    std::set<std::pair<BB *, BB *>> back_edges;
+    std::vector<int> vis(n, 0); // 0: 未访问, 1: 在栈上, 2: 已完成
+    std::vector<std::pair<BB *, int>> stack{{bbs[0].get(), 0}};
+    vis[0] = 1;
+    while (!stack.empty()) {
+        auto &top = stack.back();
+        BB *bb = top.first;
+        if (top.second < bb->succs.size()) {
+            BB *succ = bb->succs[top.second++];
+            if (!valid(succ))
+                continue;
+            if (vis[succ->id] == 1)
+                back_edges.insert({bb, succ});
+            else if (vis[succ->id] == 0) {
+                vis[succ->id] = 1;
+                stack.push_back({succ, 0});
+            }
+        } else {
+            vis[bb->id] = 2;
+            stack.pop_back();
+        }
+    }
+
+    // 边权重: 源块频率 * 分支概率; 离开循环的边概率取 1/8
+    struct Edge {
+        BB *from, *to;
+        int64_t weight;
+    };
+    std::vector<Edge> edges;
+    for (auto &bb : bbs) {
+        std::vector<BB *> succs;
+        for (auto succ : bb->succs)
+            if (valid(succ))
+                succs.push_back(succ);
+        // 原有的顺序后继排在前面, 权重相同时优先保持
+        if (BB *fall = fall_succ(bb.get()))
+            std::stable_partition(succs.begin(), succs.end(),
+                                  [&](BB *s) { return s == fall; });
+        for (auto succ : succs) {
+            int64_t w = Freq(bb.get()) * 8;
+            if (succs.size() == 2) {
+                BB *other = succs[0] == succ ? succs[1] : succs[0];
+                if (succ->loop_depth < bb->loop_depth &&
+                    other->loop_depth >= bb->loop_depth)
+                    w = Freq(bb.get()) * 1;
+                else if (other->loop_depth < bb->loop_depth &&
+                         succ->loop_depth >= bb->loop_depth)
+                    w = Freq(bb.get()) * 7;
+                else
+                    w = Freq(bb.get()) * 4;
+            }
+            edges.push_back({bb.get(), succ, w});
+        }
+    }
+    std::stable_sort(edges.begin(), edges.end(),
+                     [](auto &a, auto &b) { return a.weight > b.weight; });
+
+    // 链合并, chain[i] 为块 i 所在链的编号
+    std::vector<std::vector<BB *>> chains(n);
+    std::vector<int> chain(n);
+    for (int i = 0; i < n; i++) {
+        chains[i] = {bbs[i].get()};
+        chain[i] = i;
+    }
+    for (auto &e : edges) {
+        int a = chain[e.from->id], b = chain[e.to->id];
+        if (a == b || e.to == bbs[0].get() || back_edges.count({e.from, e.to}))
+            continue;
+        if (chains[a].back() != e.from || chains[b].front() != e.to)
+            continue;
+        for (auto bb : chains[b]) {
+            chain[bb->id] = a;
+            chains[a].push_back(bb);
+        }
+        chains[b].clear();
+    }
+
+    // 放置链
+    std::vector<BB *> order;
+    std::vector<bool> placed(n, false);
+    std::vector<int64_t> link(n, 0); // 链与已放置块之间的最大边权重
+    for (int c = chain[0]; c >= 0;) {
+        order.insert(order.end(), chains[c].begin(), chains[c].end());
+        placed[c] = true;
+        for (auto &e : edges)
+            if (chain[e.from->id] == c && !placed[chain[e.to->id]])
+                link[chain[e.to->id]] =
+                    std::max(link[chain[e.to->id]], e.weight + 1);
+        c = -1;
+        for (int i = 0; i < n; i++) {
+            if (placed[i] || chains[i].empty())
+                continue;
+            if (c < 0 || link[i] > link[c])
+                c = i;
+        }
+    }
+
+    std::map<BB *, std::unique_ptr<BB>> owner;
+    for (auto &bb : bbs)
+        owner[bb.get()] = std::move(bb);
+    bbs.clear();
+    int jmp_count = 0;
+    for (int i = 0; i < order.size(); i++) {
+        BB *bb = order[i];
+        BB *next = i + 1 < order.size() ? order[i + 1] : nullptr;
+        bbs.push_back(std::move(owner[bb]));
+
+        // 无显式跳转的单后继块, 补上跳转; 没有后继的块原先顺序进入出口
+        if (!bb->branch && bb->succs.size() == 1 && valid(bb->succs[0]))
+            bb->SetBranch(Cond(), bb->succs[0]->label);
+        if (!bb->branch && bb->succs.empty() && next &&
+            (bb->insts.empty() || bb->insts.back()->op != Instr::kB))
+            bb->SetBranch(Cond(), end.label);
+        if (!bb->branch)
+            continue;
+        if (bb->branch->cond.type == Cond::AL) {
+            if (next && bb->branch->label == next->label)
+                bb->branch = nullptr;
+            continue;
+        }
+
+        BB *fall = fall_succ(bb);
+        if (!fall) { // 两个后继相同
+            bb->branch->cond = Cond();
+            if (next && bb->branch->label == next->label)
+                bb->branch = nullptr;
+            continue;
+        }
+        if (fall == next)
+            continue;
+        if (next && bb->branch->label == next->label) {
+            bb->branch->cond = bb->branch->cond.Not();
+            bb->branch->label = fall->label;
+            continue;
+        }
+        // 两个后继都不紧随其后, 顺序进入新的跳转块
+        auto nbb = std::make_unique<BB>();
+        BB *jmp = nbb.get();
+        jmp->label = ".L_" + name + "_jmp_" + std::to_string(jmp_count++);
+        jmp->loop_depth = std::min(bb->loop_depth, fall->loop_depth);
+        jmp->ir_bb = bb->ir_bb;
+        jmp->SetBranch(Cond(), fall->label);
+        std::replace(bb->succs.begin(), bb->succs.end(), fall, jmp);
+        std::replace(fall->preds.begin(), fall->preds.end(), bb, jmp);
+        jmp->preds.push_back(bb);
+        jmp->succs.push_back(fall);
+        bbs.push_back(std::move(nbb));
+    }
+    ResetBBID();
+
+    if (DbgEnabled(DbgLayout)) {
+        std::cerr << "layout " << name << ":";
+        for (auto &bb : bbs)
+            std::cerr << " " << bb->label;
+        std::cerr << "\n";
+    }
+}
+
+} // namespace backend
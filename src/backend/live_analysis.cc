@@ -0,0 +1,112 @@
+#include "backend.h"
+
+namespace backend {
+
+LiveAnalysis::LiveAnalysis(Func &f) : func(f) {
+    f.ResetBBID();
+    vreg_count = f.vreg - (int)Reg::VREG;
+    int n = f.bbs.size();
+    uses.assign(n, BitSet(vreg_count));
+    defs.assign(n, BitSet(vreg_count));
+    livein.assign(n, BitSet(vreg_count));
+    liveout.assign(n, BitSet(vreg_count));
+}
+
+// 求基本块的逆后序，函数出口 Func::end 不参与分析
+void LiveAnalysis::ComputeOrder() {
+    int n = func.bbs.size();
+    order.clear();
+    if (n == 0)
+        return;
+
+    std::vector<bool> vis(n, false);
+    std::vector<BB *> post;
+    // 迭代式 DFS, 避免深层 CFG 栈溢出
+    std::vector<std::pair<BB *, int>> stack;
+    stack.push_back({func.bbs[0].get(), 0});
+    vis[0] = true;
+    while (!stack.empty()) {
+        auto &top = stack.back();
+        BB *bb = top.first;
+        if (top.second < bb->succs.size()) {
+            BB *succ = bb->succs[top.second++];
+            if (succ == &func.end || succ == &func.entry || vis[succ->id])
+                continue;
+            vis[succ->id] = true;
+            stack.push_back({succ, 0});
+        } else {
+            post.push_back(bb);
+            stack.pop_back();
+        }
+    }
+    order.assign(post.rbegin(), post.rend());
+    for (auto &bb : func.bbs)
+        if (!vis[bb->id])
+            order.push_back(bb.get());
+}
+
+// 块内向上暴露的使用 (uses) 与定值 (defs)
+void LiveAnalysis::ComputeLocal() {
+    for (auto &bb : func.bbs) {
+        auto &use = uses[bb->id], &def = defs[bb->id];
+        for (auto &inst : bb->insts) {
+            for (Reg *r : inst->RRegs()) {
+                if (!IsVReg(*r))
+                    continue;
+                if (!def.Test(VRegIdx(*r)))
+                    use.Set(VRegIdx(*r));
+            }
+            for (Reg *r : inst->WRegs()) {
+                if (!IsVReg(*r))
+                    continue;
+                def.Set(VRegIdx(*r));
+            }
+        }
+    }
+}
+
+void LiveAnalysis::Run() {
+    ComputeOrder();
+    ComputeLocal();
+
+    // liveout(b) = U livein(s), livein(b) = uses(b) U (liveout(b) - defs(b))
+    // 后向问题，按逆后序的反序迭代收敛最快
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto it = order.rbegin(); it != order.rend(); it++) {
+            BB *bb = *it;
+            int id = bb->id;
+            for (auto succ : bb->succs) {
+                if (succ == &func.end || succ == &func.entry)
+                    continue;
+                liveout[id].Union(livein[succ->id]);
+            }
+            BitSet in = liveout[id];
+            in.Subtract(defs[id]);
+            in.Union(uses[id]);
+            if (in != livein[id]) {
+                livein[id] = std::move(in);
+                changed = true;
+            }
+        }
+    }
+}
+
+void LiveAnalysis::Dump(std::ostream &os) {
+    auto dump_set = [&](const char *name, BitSet &s) {
+        os << "  " << name << ": ";
+        s.ForEach([&](int i) { os << Reg2Str(IdxVReg(i)) << " "; });
+        os << "\n";
+    };
+    os << "------ dump live analysis: " << func.name << " ------\n";
+    for (auto bb : order) {
+        os << "bb " << bb->id << " " << bb->label << "\n";
+        dump_set("uses", uses[bb->id]);
+        dump_set("defs", defs[bb->id]);
+        dump_set("livein", livein[bb->id]);
+        dump_set("liveout", liveout[bb->id]);
+    }
+}
+
+} // namespace backend
@@ -0,0 +1,275 @@
+#include "backend.h"
+#include "dbg.hpp"
+#include <iostream>
+
+namespace backend {
+
+const std::string DbgPeephole = "peephole";
+
+using builder::instr_iter;
+
+// 以 rd <- rs 替换 it 处的指令, 保留执行条件
+static void ReplaceWithMove(BB &bb, instr_iter &it, Reg rd, Reg rs) {
+    Cond cond = (*it)->cond;
+    builder::Move(bb.insts, it, rd, rs);
+    it = bb.insts.erase(it);
+    std::prev(it)->get()->cond = cond;
+}
+
+// mov rx, rx
+static int SelfMove(Func &func) {
+    int hits = 0;
+    for (auto &bb : func.bbs) {
+        bb->insts.remove_if([&](std::unique_ptr<Instr> &inst) {
+            if (inst->op != Instr::kMOV ||
+                (inst->flags & (Instr::kFlagBIsImm | Instr::kFlagS)))
+                return false;
+            auto mov = dynamic_cast<MOV *>(inst.get());
+            return mov->rd == mov->src.r && ++hits;
+        });
+    }
+    return hits;
+}
+
+// add / sub / lsl / lsr / asr rd, rs, #0 => mov rd, rs
+static int ZeroOperand(Func &func) {
+    int hits = 0;
+    for (auto &bb : func.bbs) {
+        for (auto it = bb->insts.begin(); it != bb->insts.end(); it++) {
+            auto alu = dynamic_cast<BinaryAlu *>(it->get());
+            if (!alu || alu->flags != Instr::kFlagBIsImm || alu->b.imm != 0)
+                continue;
+            if (alu->op == Instr::kADD || alu->op == Instr::kSUB ||
+                alu->op == Instr::kLSL || alu->op == Instr::kLSR ||
+                alu->op == Instr::kASR) {
+                ReplaceWithMove(*bb, it, alu->rd, alu->a);
+                it--;
+                hits++;
+            }
+        }
+    }
+    return hits;
+}
+
+// 块内记录各内存字当前保存在哪个寄存器中:
+//   str rt, [a] ... ldr rd, [a]  => mov rd, rt
+//   ldr rx, [a] ... ldr rd, [a]  => mov rd, rx
+static int ForwardLoad(Func &func) {
+    struct Slot { // [base, #offset] 的值位于 reg
+        Reg base;
+        unsigned offset;
+        Reg reg;
+    };
+    auto slot_of = [](Address &addr, Slot &s) {
+        if (addr.mode == Address::kMBase)
+            s.offset = 0;
+        else if (addr.mode == Address::kMBaseImm)
+            s.offset = addr.offset.imm;
+        else
+            return false;
+        s.base = addr.base;
+        return true;
+    };
+
+    int hits = 0;
+    for (auto &bb : func.bbs) {
+        std::vector<Slot> slots;
+        auto kill_reg = [&](Reg r) {
+            slots.erase(std::remove_if(slots.begin(), slots.end(),
+                                       [&](Slot &s) {
+                                           return s.base == r || s.reg == r;
+                                       }),
+                        slots.end());
+        };
+        for (auto it = bb->insts.begin(); it != bb->insts.end(); it++) {
+            Instr *inst = it->get();
+            Slot cur;
+            if (inst->op == Instr::kCall || inst->op == Instr::kBL ||
+                inst->op == Instr::kLabel || inst->op == Instr::kSTRD) {
+                slots.clear();
+                continue;
+            }
+            if (inst->op == Instr::kSTR) {
+                auto str = dynamic_cast<STR *>(inst);
+                if (inst->cond.type != Cond::AL || !slot_of(str->addr, cur)) {
+                    slots.clear();
+                    continue;
+                }
+                // 基址不同时可能指向同一位置
+                slots.erase(std::remove_if(slots.begin(), slots.end(),
+                                           [&](Slot &s) {
+                                               return s.base != cur.base ||
+                                                      s.offset == cur.offset;
+                                           }),
+                            slots.end());
+                cur.reg = str->rd;
+                slots.push_back(cur);
+                continue;
+            }
+            auto ldr = dynamic_cast<LDR *>(inst);
+            if (!ldr || ldr->eq_addr || inst->cond.type != Cond::AL ||
+                !slot_of(ldr->addr, cur)) {
+                for (auto r : inst->WRegs())
+                    kill_reg(*r);
+                continue;
+            }
+
+            Reg rd = ldr->rd;
+            auto known =
+                std::find_if(slots.begin(), slots.end(), [&](Slot &s) {
+                    return s.base == cur.base && s.offset == cur.offset;
+                });
+            if (known != slots.end()) {
+                hits++;
+                if (known->reg == rd) { // 值已在 rd 中
+                    it = bb->insts.erase(it);
+                    it--;
+                    continue;
+                }
+                ReplaceWithMove(*bb, it, rd, known->reg);
+                it--;
+            }
+            kill_reg(rd);
+            cur.reg = rd;
+            if (rd != cur.base)
+                slots.push_back(cur);
+        }
+    }
+    return hits;
+}
+
+// 相邻的两次同基址访存, 地址相差 4 时合并为 ldrd / strd
+static int PairMemory(Func &func) {
+    struct Access {
+        bool load;
+        Reg rd, base;
+        unsigned offset;
+    };
+    auto access_of = [](Instr *inst, Access &a) {
+        Address *addr;
+        if (auto ldr = dynamic_cast<LDR *>(inst); ldr && !ldr->eq_addr) {
+            a.load = true;
+            a.rd = ldr->rd;
+            addr = &ldr->addr;
+        } else if (auto str = dynamic_cast<STR *>(inst)) {
+            a.load = false;
+            a.rd = str->rd;
+            addr = &str->addr;
+        } else {
+            return false;
+        }
+        if (addr->mode == Address::kMBase)
+            a.offset = 0;
+        else if (addr->mode == Address::kMBaseImm)
+            a.offset = addr->offset.imm;
+        else
+            return false;
+        a.base = addr->base;
+        return inst->cond.type == Cond::AL && a.rd != Reg::SP &&
+               a.rd != Reg::PC;
+    };
+
+    int hits = 0;
+    auto pair = [&](BB &bb) {
+        auto &insts = bb.insts;
+        for (auto it = insts.begin(); it != insts.end(); it++) {
+            auto next = std::next(it);
+            Access a, b;
+            if (next == insts.end() || !access_of(it->get(), a) ||
+                !access_of(next->get(), b) || a.load != b.load ||
+                a.base != b.base)
+                continue;
+            if (b.offset < a.offset)
+                std::swap(a, b);
+            // imm8 * 4; 合并后的读取在写回前完成, 不能改写基址
+            if (b.offset != a.offset + 4 || a.offset % 4 || a.offset > 1020)
+                continue;
+            if (a.load && (a.rd == b.rd || a.rd == a.base || b.rd == a.base))
+                continue;
+
+            Address addr(a.base);
+            if (a.offset) {
+                addr.mode = Address::kMBaseImm;
+                addr.offset.imm = a.offset;
+            }
+            it = insts.erase(it, std::next(next));
+            if (a.load)
+                builder::LoadPair(insts, it, a.rd, b.rd, addr);
+            else
+                builder::StorePair(insts, it, a.rd, b.rd, addr);
+            it--;
+            hits++;
+        }
+    };
+    pair(func.entry);
+    for (auto &bb : func.bbs)
+        pair(*bb);
+    pair(func.end);
+    return hits;
+}
+
+// 跳转到紧随其后的块 (中间只隔着空块)
+static int BranchToNext(Func &func) {
+    int hits = 0;
+    for (int i = 0; i < func.bbs.size(); i++) {
+        BB *bb = func.bbs[i].get();
+        std::string *label = nullptr;
+        if (bb->branch)
+            label = &bb->branch->label;
+        else if (!bb->insts.empty() && bb->insts.back()->op == Instr::kB)
+            label = &dynamic_cast<Branch *>(bb->insts.back().get())->label;
+        if (!label)
+            continue;
+
+        bool fall = false;
+        for (int j = i + 1; j <= func.bbs.size(); j++) {
+            BB *next = j < func.bbs.size() ? func.bbs[j].get() : &func.end;
+            if (next->label == *label) {
+                fall = true;
+                break;
+            }
+            if (!next->insts.empty() || next->branch || next == &func.end)
+                break;
+        }
+        if (!fall)
+            continue;
+        if (bb->branch)
+            bb->branch = nullptr;
+        else
+            bb->insts.pop_back();
+        hits++;
+    }
+    return hits;
+}
+
+// 模式表, 依次执行直到没有模式命中
+static const struct {
+    std::string name;
+    int (*run)(Func &func);
+} patterns[] = {
+    {"zero-operand", ZeroOperand},
+    {"self-move", SelfMove},
+    {"forward-load", ForwardLoad},
+    {"branch-to-next", BranchToNext},
+    {"pair-memory", PairMemory},
+};
+
+void Func::Peephole() {
+    std::vector<int> total(std::size(patterns), 0);
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < std::size(patterns); i++) {
+            int hits = patterns[i].run(*this);
+            total[i] += hits;
+            changed |= hits > 0;
+        }
+    }
+    if (DbgEnabled(DbgPeephole)) {
+        std::cerr << "peephole " << name << ":";
+        for (int i = 0; i < std::size(patterns); i++)
+            std::cerr << " " << patterns[i].name << " " << total[i];
+        std::cerr << "\n";
+    }
+}
+
+} // namespace backend
@@ -1,6 +1,8 @@
 #include "backend.h"
 #include "dbg.hpp"
 #include <algorithm>
+#include <cmath>
+#include <functional>
 #include <queue>
 #include <set>
 
@@ -12,73 +14,23 @@ namespace regalloca {
 
 const std::string DbgRegAlloca = "reg-alloca";
 const std::string DbgLiveAnalysis = "live-analysis";
-const std::string DbgDisableBuiltBackup = "dis-builtin-bck";
 
-struct Location { // 活跃点
-    int bb;
-    int n;
+// 调用约定: r0-r3, r12 由调用方保存, 其余由被调用方保存
+static bool IsCallerSaved(Reg r) { return r <= Reg::R3 || r == Reg::R12; }
 
-    Location() { bb = 0, n = 0; }
-    Location(int bb_, int n_) : bb(bb_), n(n_) {}
+// 指令编号:
+//   0, 1 为函数入口, 参数在位置 1 定值
+//   每个基本块入口占两个位置, 每条指令占两个位置
+//   指令读寄存器位于偶数位置 pos, 写寄存器位于 pos + 1
+struct Range { // 活跃区间 [start, end]
+    int start, end;
 
-    inline Location inc(int N) const {
-        Location res = *this;
-        if (n + 1 == N)
-            res.bb++, res.n = 0;
-        else
-            res.n++;
-        return res;
-    }
-
-    inline Location dec(int prevN) const {
-        Location res = *this;
-        if (n - 1 < 0)
-            res.bb--, res.n = prevN - 1;
-        else
-            res.n--;
-        return res;
-    }
-
-    friend bool operator<(const Location &a, const Location &b) {
-        if (a.bb < b.bb)
-            return 1;
-        if (a.bb == b.bb) {
-            if (a.n != -1 && a.n < b.n)
-                return 1;
-            if (a.n != -1 && b.n == -1)
-                return 1;
-        }
-        return 0;
-    }
-
-    friend bool operator==(const Location &a, const Location &b) {
-        return a.bb == b.bb && a.n == b.n;
-    }
-
-    friend bool operator>(const Location &a, const Location &b) {
-        if (a.bb > b.bb)
-            return 1;
-        if (a.bb == b.bb) {
-            if (a.n == -1 && b.n != -1)
-                return 1;
-            if (a.n > b.n && b.n != -1)
-                return 1;
-        }
-        return 0;
-    }
-};
-
-struct Range {
-    Location start, end;
-
-    inline bool contain(const Location &loc) {
-        return !(loc < start) && !(loc > end);
-    }
+    inline bool contain(int pos) const { return start <= pos && pos <= end; }
 };
 
 struct LiveInterval {
-    Reg vreg; // 虚拟寄存器编号
-    Range lr; // 活跃区间
+    Reg vreg;                  // 虚拟寄存器编号
+    std::vector<Range> ranges; // 活跃区间, 有序且互不相交, 允许存在空洞
 
     int state;
     enum {
@@ -89,13 +41,27 @@ struct LiveInterval {
     Reg phy_reg; // 实际寄存器编号
     int stack_slot;
     bool stack_allocated; // 需要在栈上分配空间
+    bool cross_call;      // 在某个调用之后仍然活跃
+    bool remat;           // 溢出时在使用处重新计算, 不占用栈槽
+    double weight;        // 使用与定值次数, 按 10^循环深度 加权
 
     LiveInterval() {
         state = kVReg;
         stack_allocated = false;
+        cross_call = false;
+        remat = false;
+        weight = 0;
     }
 
-    bool CheckInterfering(const Range &rng);
+    inline int Start() const { return ranges.front().start; }
+    inline int End() const { return ranges.back().end; }
+    double SpillWeight() const; // 溢出代价: 加权的使用密度
+
+    bool Covers(int pos) const;
+    int NextIntersection(const LiveInterval &o) const;
+    void AddRange(int start, int end);
+    void SetFrom(int start);
+
     void AssignPhyReg(Reg r);
     void AssignStackSlot(int slot);
     bool Assigned() const;
@@ -104,67 +70,139 @@ struct LiveInterval {
     void Dump(std::ostream &os, StackFrame *frame = nullptr);
 };
 
+// 可重新计算的值, 溢出时在使用处重新生成而不占用栈槽
+struct RematValue {
+    enum {
+        kImm,       // 立即数
+        kAddr,      // 全局变量地址
+        kFrameAddr, // 局部变量地址, local_var_base + imm
+    };
+    int kind;
+    Word imm;
+    std::string label;
+};
+
 struct RegAllocaHelper {
     struct CmpIntervalStartNLess {
         bool operator()(const std::shared_ptr<LiveInterval> &a,
                         const std::shared_ptr<LiveInterval> &b) const {
-            return !(a->lr.start < b->lr.start);
+            if (a->Start() != b->Start())
+                return a->Start() > b->Start();
+            return a->vreg > b->vreg;
         }
     };
 
     Func &func;
-    const int phy_reg_count = 7;     // Thumb能够使用的寄存器 7 个
+    const TargetProfile &profile;
+    const int phy_reg_count;         // 参与分配的寄存器个数
     const int max_reg_arg_count = 4; // Sys2022传递参数最多4个
+    // 溢出变量的临时寄存器, 不参与分配 (LR 已在入口处保存)
+    const Reg *scratch_regs;
 
     std::priority_queue<std::shared_ptr<LiveInterval>,
                         std::vector<std::shared_ptr<LiveInterval>>,
                         CmpIntervalStartNLess>
         intervals; // 用于排列区间
-    std::vector<std::shared_ptr<LiveInterval>> phy_intervals;
-    std::vector<std::shared_ptr<LiveInterval>> active;
-    // // pre-alloca vreg
-    // std::map<Reg, std::shared_ptr<LiveInterval>> pre_alloca;
+    // 当前位置占用寄存器的区间 / 占用寄存器但当前位置处于空洞的区间
+    std::vector<std::shared_ptr<LiveInterval>> active, inactive;
     // current alloca status: verg -> interval
     std::map<Reg, std::shared_ptr<LiveInterval>> alloca_map;
-    // free registers at loaction
-    std::map<Location, std::vector<Reg>> loc_free_regs;
-
-    // max location, set by CollectLiveInfo
-    Location max_loc; // IR指令标号上限
-    // max n of each bb
-    std::vector<int> bb_loc_N;
-
-    // defs 已定义的指令
-    std::vector<std::set<Reg>> defs, uses, livein, liveout;
-
-    RegAllocaHelper(Func &f) : func(f) {
-        phy_intervals.resize(phy_reg_count);
-        defs.resize(f.bbs.size());
-        uses.resize(f.bbs.size());
-        livein.resize(f.bbs.size());
-        liveout.resize(f.bbs.size());
-        f.ResetBBID();
-    }
+
+    LiveAnalysis live;
+    // 基本块的起止位置, 以 BB::id 为下标
+    std::vector<int> bb_from, bb_to;
+    std::vector<int> call_pos; // 调用指令的位置, 升序
+    // 调用之后仍然活跃, 需要备份的物理寄存器
+    std::map<Instr *, std::set<Reg>> live_after_call;
+    // 可重新计算的虚拟寄存器及其值
+    std::map<Reg, RematValue> remat;
+
+    int algo; // 分配算法
+
+    RegAllocaHelper(Func &f, int algo, const TargetProfile &profile)
+        : func(f), profile(profile), phy_reg_count(profile.alloc_regs.size()),
+          scratch_regs(profile.scratch_regs), live(f), algo(algo) {}
+
+    int RegIndex(Reg r); // r 在 profile.alloc_regs 中的下标
 
     std::shared_ptr<LiveInterval> Dequeue();
 
     void Enqueue(std::shared_ptr<LiveInterval> v);
+    void FindRemat();
+    void Rematerialize(builder::instr_list &insts, builder::instr_iter it,
+                       Reg rd, const RematValue &v);
     void CollectLiveInfo();
-    void DumpLiveAnalysis();
-    void Spill(std::shared_ptr<LiveInterval> &interval);
-    void AssignPhyReg(std::shared_ptr<LiveInterval> interval);
+    void Spill(std::shared_ptr<LiveInterval> interval);
+    void AssignSpillSlots(
+        std::function<bool(LiveInterval &, LiveInterval &)> interfere);
+    void AssignPhyReg(std::shared_ptr<LiveInterval> interval, Reg r);
     void DumpIntervals();
     void DumpAllocaMap();
-    std::shared_ptr<LiveInterval> PopLastLongestActive();
+    void UpdateActive(int pos);
+    bool TryAssignFreeReg(std::shared_ptr<LiveInterval> &interval);
+    void AssignBlockedReg(std::shared_ptr<LiveInterval> &interval);
 
+    void LinearScan();
+    void ColorAlloca();
     void Alloca();
-    bool FuncIsBuiltIn(std::string name);
-    bool GetBackupRegs(std::vector<Reg> &regs, Reg ret, int count);
+    void ComputeLiveAfterCall();
+    bool GetBackupRegs(std::vector<Reg> &regs, Instr *call);
+    void ParallelMove(builder::instr_list &insts, builder::instr_iter it,
+                      std::vector<std::pair<Reg, Reg>> moves, Reg tmp);
+    void SplitStoreAddr(builder::instr_list &insts, builder::instr_iter it,
+                        std::function<Reg(Reg, Reg)> refer_vreg);
     void ReWrite();
 };
 
-bool LiveInterval::CheckInterfering(const Range &rng) {
-    return lr.contain(rng.start) || lr.contain(rng.end);
+double LiveInterval::SpillWeight() const {
+    int size = 0;
+    for (auto &rng : ranges)
+        size += rng.end - rng.start + 1;
+    // 重新计算不访存, 代价按一半计
+    return weight / std::max(size, 1) * (remat ? 0.5 : 1);
+}
+
+bool LiveInterval::Covers(int pos) const {
+    for (auto &rng : ranges) {
+        if (rng.contain(pos))
+            return true;
+        if (rng.start > pos)
+            break;
+    }
+    return false;
+}
+
+// 两个区间第一个公共位置, 不相交返回 -1
+int LiveInterval::NextIntersection(const LiveInterval &o) const {
+    auto a = ranges.begin(), b = o.ranges.begin();
+    while (a != ranges.end() && b != o.ranges.end()) {
+        if (a->end < b->start)
+            a++;
+        else if (b->end < a->start)
+            b++;
+        else
+            return std::max(a->start, b->start);
+    }
+    return -1;
+}
+
+// 逆序构造区间, 新区间总是位于已有区间之前
+void LiveInterval::AddRange(int start, int end) {
+    if (!ranges.empty() && ranges.front().start <= end + 1) {
+        auto &first = ranges.front();
+        first.start = std::min(first.start, start);
+        first.end = std::max(first.end, end);
+        return;
+    }
+    ranges.insert(ranges.begin(), Range{start, end});
+}
+
+// 遇到定值, 缩短第一个区间
+void LiveInterval::SetFrom(int start) {
+    if (ranges.empty())
+        ranges.push_back(Range{start, start});
+    else
+        ranges.front().start = start;
 }
 
 void LiveInterval::AssignPhyReg(Reg r) {
@@ -183,10 +221,10 @@ Address LiveInterval::GetAddr(StackFrame &frame) {
     return frame.VarAddr(stack_slot);
 }
 void LiveInterval::Dump(std::ostream &os, StackFrame *frame) {
-#define DUMP_LOC(loc) "(" << loc.bb << ", " << loc.n << ")"
-    os << Reg2Str(vreg) << "\t" << DUMP_LOC(lr.start) << " -> "
-       << DUMP_LOC(lr.end);
-    if (Assigned())
+    os << Reg2Str(vreg) << "\t";
+    for (auto &rng : ranges)
+        os << "[" << rng.start << ", " << rng.end << "] ";
+    if (Assigned()) {
         if (state == kPhyReg)
             os << " " << Reg2Str(phy_reg);
         else {
@@ -195,7 +233,8 @@ void LiveInterval::Dump(std::ostream &os, StackFrame *frame) {
             else
                 os << " " << stack_slot;
         }
-    std::cerr << std::endl;
+    }
+    os << std::endl;
 }
 
 std::shared_ptr<LiveInterval> RegAllocaHelper::Dequeue() {
@@ -210,195 +249,187 @@ void RegAllocaHelper::Enqueue(std::shared_ptr<LiveInterval> v) {
     intervals.push(v);
 }
 
-void RegAllocaHelper::CollectLiveInfo() { // 活跃信息
-    std::map<Reg, std::shared_ptr<LiveInterval>> vreg_to_interval;
-    Location &loc = max_loc;
-
-    int i = 0;
-    for (auto vr : func.args) {
-        defs[0].insert(vr);
-        auto interval = std::make_shared<LiveInterval>();
-        interval->vreg = vr;
-        interval->stack_allocated = true;
-        interval->lr = {loc, loc};
-        if (i >= max_reg_arg_count) { // 超过了参数上限，将其存入栈中
-            interval->state = LiveInterval::kStack; // 栈
-            alloca_map[vr] = interval;
+// 定值不依赖其他虚拟寄存器且是 rd 仅有的定值时, rd 溢出后可在使用处重新计算:
+//   mov / mvn rd, #imm              立即数
+//   movw rd, #lo; movt rd, #hi      立即数或全局变量地址
+//   add rd, r7, #off                局部变量地址 (kOpAlloca)
+void RegAllocaHelper::FindRemat() {
+    std::map<Reg, int> def_count;
+    // 候选的值与对应的定值指令数
+    std::map<Reg, std::pair<RematValue, int>> candidates;
+    for (auto &bb : func.bbs) {
+        for (auto it = bb->insts.begin(); it != bb->insts.end(); it++) {
+            Instr *inst = it->get();
+            for (auto r : inst->WRegs())
+                def_count[*r]++;
+            if (inst->cond.type != Cond::AL || (inst->flags & Instr::kFlagS))
+                continue;
+            bool b_imm = inst->flags & Instr::kFlagBIsImm;
+            if (auto mov = dynamic_cast<MOV *>(inst)) {
+                Word imm = mov->src.imm;
+                if (mov->op == Instr::kMVN)
+                    imm = ~imm;
+                if (b_imm)
+                    candidates[mov->rd] = {{RematValue::kImm, imm, ""}, 1};
+            } else if (auto alu = dynamic_cast<BinaryAlu *>(inst)) {
+                if (alu->op == Instr::kADD && b_imm &&
+                    alu->a == StackFrame::local_var_base &&
+                    !(alu->flags & Instr::kFlagHasShift))
+                    candidates[alu->rd] = {
+                        {RematValue::kFrameAddr, alu->b.imm, ""}, 1};
+            } else if (auto movw = dynamic_cast<MoveWide *>(inst)) {
+                if (movw->op != Instr::kMOVW ||
+                    std::next(it) == bb->insts.end())
+                    continue;
+                auto movt = dynamic_cast<MoveWide *>(std::next(it)->get());
+                if (!movt || movt->op != Instr::kMOVT || movt->rd != movw->rd ||
+                    movt->label != movw->label || movt->cond.type != Cond::AL)
+                    continue;
+                int kind = movw->label.empty() ? RematValue::kImm
+                                               : RematValue::kAddr;
+                candidates[movw->rd] = {
+                    {kind, movw->imm | movt->imm << 16, movw->label}, 2};
+            }
         }
-        vreg_to_interval[vr] = interval;
-        Enqueue(interval); // 装入优先队列
-        i++;
     }
+    for (auto &[vr, c] : candidates)
+        if (LiveAnalysis::IsVReg(vr) && def_count[vr] == c.second)
+            remat[vr] = c.first;
+}
 
-    for (int i = 0; i < func.bbs.size(); i++) { // 提取出每个基本块
-        auto &bb = func.bbs[i];
-        loc.n = 0; // 对于一个新的块，行数置0
-        for (auto &inst : bb->insts) {
-            auto r_regs = inst->RRegs(); // 得到每条指令所用的  源寄存器
-            for (Reg *r : r_regs) {
-                if (*r < Reg::VREG) // 虚拟寄存器与实际对应，无需分配
-                    continue;
+void RegAllocaHelper::Rematerialize(builder::instr_list &insts,
+                                    builder::instr_iter it, Reg rd,
+                                    const RematValue &v) {
+    switch (v.kind) {
+    case RematValue::kImm:
+        builder::LoadImm(insts, it, rd, v.imm);
+        break;
+    case RematValue::kAddr:
+        builder::LoadAddr(insts, it, rd, v.label);
+        break;
+    case RematValue::kFrameAddr:
+        builder::BinaryAlu(insts, it, Instr::kADD, rd,
+                           StackFrame::local_var_base, v.imm);
+        break;
+    }
+}
 
-                if (!vreg_to_interval[*r]) // 当前寄存器活跃区间不存在实例
-                    continue;
+void RegAllocaHelper::CollectLiveInfo() { // 活跃信息
+    live.Run();
+    if (DbgEnabled(DbgLiveAnalysis))
+        live.Dump(std::cerr);
+
+    // 编号
+    int pos = 2;
+    bb_from.resize(func.bbs.size());
+    bb_to.resize(func.bbs.size());
+    for (auto &bb : func.bbs) {
+        bb_from[bb->id] = pos;
+        pos += 2 * (bb->insts.size() + 1);
+        bb_to[bb->id] = pos - 1;
+    }
 
-                vreg_to_interval[*r]->lr.end = loc;
-                uses[loc.bb].insert(*r);
-            }
+    std::map<Reg, std::shared_ptr<LiveInterval>> vreg_to_interval;
+    auto get_interval = [&](Reg r) {
+        auto &interval = vreg_to_interval[r];
+        if (!interval) {
+            interval = std::make_shared<LiveInterval>();
+            interval->vreg = r;
+        }
+        return interval;
+    };
 
-            auto w_regs = inst->WRegs();
-            for (Reg *r : w_regs) {
-                if (*r < Reg::VREG)
+    // 按块逆序、指令逆序构造带空洞的活跃区间
+    for (auto it_bb = func.bbs.rbegin(); it_bb != func.bbs.rend(); it_bb++) {
+        auto &bb = *it_bb;
+        int from = bb_from[bb->id], to = bb_to[bb->id];
+        double weight = std::pow(10.0, std::min(bb->loop_depth, 8));
+        BitSet cur = live.liveout[bb->id];
+        cur.ForEach([&](int i) {
+            get_interval(LiveAnalysis::IdxVReg(i))->AddRange(from, to);
+        });
+
+        int inst_pos = to - 1;
+        for (auto it = bb->insts.rbegin(); it != bb->insts.rend(); it++) {
+            auto &inst = *it;
+            if (inst->op == Instr::kCall)
+                call_pos.push_back(inst_pos);
+            for (Reg *r : inst->WRegs()) {
+                if (!LiveAnalysis::IsVReg(*r))
                     continue;
-
-                defs[loc.bb].insert(*r);
-                auto temp = vreg_to_interval.insert(
-                    {*r, std::make_shared<LiveInterval>()});
-                if (temp.second) {
-                    temp.first->second->vreg = *r;
-                    temp.first->second->lr = {loc, loc};
-                    Enqueue(temp.first->second);
-                } else {
-                    temp.first->second->lr.end = loc;
-                }
+                int idx = LiveAnalysis::VRegIdx(*r);
+                auto interval = get_interval(*r);
+                interval->weight += weight;
+                if (cur.Test(idx))
+                    interval->SetFrom(inst_pos + 1);
+                else // 定值后未被使用
+                    interval->AddRange(inst_pos + 1, inst_pos + 1);
+                cur.Reset(idx);
             }
-            loc.n++;
-        }
-        bb_loc_N.push_back(loc.n);
-        loc.bb++;
-    }
-    max_loc.bb--, max_loc.n--;
-
-    // bool changed = true;
-    // while (changed) {
-    //     changed = false;
-    //     for (int id = 0; id < func.bbs.size(); id++) {
-    //         std::set<Reg> nliveout;
-    //         for (auto succ : func.bbs[id]->succs) {
-    //             std::set<Reg> tmp = livein[succ->id];
-    //             nliveout.merge(tmp);
-    //         }
-    //         if (nliveout != liveout[id]) {
-    //             changed = true;
-    //             liveout[id] = nliveout;
-    //         }
-
-    //         if (uses[id] != livein[id]) {
-    //             livein[id] = uses[id];
-    //             changed = true;
-    //         }
-    //     }
-    //     if (DbgEnabled(DbgLiveAnalysis)) {
-    //         DumpLiveAnalysis();
-    //     }
-    // }
-
-    // update live range
-    /*std::set<int> loop_header_bb;
-    for (int i = 0; i < func.bbs.size(); i++) {
-        auto &bb = func.bbs[i];
-        for (auto pred : bb->preds) {
-            if (pred->id > bb->id) {
-                loop_header_bb.insert(i);
+            for (Reg *r : inst->RRegs()) {
+                if (!LiveAnalysis::IsVReg(*r))
+                    continue;
+                auto interval = get_interval(*r);
+                interval->weight += weight;
+                interval->AddRange(from, inst_pos);
+                cur.Set(LiveAnalysis::VRegIdx(*r));
             }
+            inst_pos -= 2;
         }
     }
 
-    // 处理调用关系，根据调用图更新每个寄存器活跃区间
-    for (auto i : loop_header_bb) {
-        int max_id = 0;
-        for (auto &succ : func.bbs[i]->succs)
-            max_id = std::max(max_id, succ->id);
-        for (auto vr : uses[i]) {
-            auto &interval = vreg_to_interval[vr];
-            if (DbgEnabled(DbgLiveAnalysis)) {
-                fprintf(stderr, "update lr %s after liveness analysis\n",
-                        Reg2Str(vr).c_str());
-            }
-            if(interval->lr.end.bb <= max_id)
-            {
-                interval->lr.end.bb = max_id;
-                interval->lr.end.n = -1;
-            }
-
+    int i = 0;
+    for (auto vr : func.args) {
+        auto interval = get_interval(vr);
+        // 参数在函数入口定值
+        if (!interval->ranges.empty() &&
+            interval->ranges.front().start == bb_from[0])
+            interval->SetFrom(1);
+        else
+            interval->AddRange(1, 1);
+        if (i >= max_reg_arg_count) { // 超过了参数上限，将其存入栈中
+            interval->state = LiveInterval::kStack; // 栈
+            interval->stack_allocated = true;
+            alloca_map[vr] = interval;
         }
-    }*/
-
-    // 采用最贪心的方法解决活跃区间
-    Location L, R;
-    std::set<std::shared_ptr<LiveInterval>> buffer;
-    std::shared_ptr<LiveInterval> interval;
-    for (int i = 0; i < func.bbs.size(); i++) {
-        auto &bb = func.bbs[i];
-        for (auto succs : bb->succs) {
-            if (succs->id < bb->id) {
-                buffer.clear();
-                R = {bb->id, -1};
-                L = {succs->id, 0};
-                while (intervals.size() > 0) {
-                    interval = Dequeue();
-                    if (interval->lr.start < L && interval->lr.end > L)
-                        if (R > interval->lr.end)
-                            interval->lr.end = R;
-                    buffer.insert(interval);
-                    if (interval->lr.start > L)
-                        break;
-                }
-                for (auto k : buffer)
-                    Enqueue(k);
+        i++;
+    }
+
+    // 同时覆盖调用的读 (pos) 与写 (pos + 1) 位置即跨越调用
+    std::sort(call_pos.begin(), call_pos.end());
+    for (auto &[vr, interval] : vreg_to_interval) {
+        for (auto &rng : interval->ranges) {
+            auto it = std::lower_bound(call_pos.begin(), call_pos.end(),
+                                       rng.start);
+            if (it != call_pos.end() && *it < rng.end) {
+                interval->cross_call = true;
+                break;
             }
         }
     }
-    // for (auto vr : liveout[i]) {
-    //     auto &interval = vreg_to_interval[vr];
-    //     if (interval->lr.end.bb < i) {
-    //         if (DbgEnabled(DbgLiveAnalysis)) {
-    //             fprintf(stderr,
-    //                     "update lr %s after liveness analysis\n",
-    //                     Reg2Str(vr).c_str());
-    //         }
-    //         interval->lr.end.bb = i;
-    //         interval->lr.end.n = bb_loc_N[i] - 1;
-    //     }
-    // }
-}
-
-void RegAllocaHelper::DumpLiveAnalysis() {
-    fprintf(stderr, "------ dump live analysis ------\n");
-    for (int i = 0; i < func.bbs.size(); i++) {
-        fprintf(stderr, "bb %d\n", i);
-        fprintf(stderr, "  livein: ");
-        for (auto x : livein[i]) {
-            fprintf(stderr, "%s ", Reg2Str(x).c_str());
-        }
-        fprintf(stderr, "\n  liveout: ");
-        for (auto x : liveout[i]) {
-            fprintf(stderr, "%s ", Reg2Str(x).c_str());
-        }
-        fprintf(stderr, "\n");
+
+    for (auto &[vr, interval] : vreg_to_interval) {
+        interval->remat = remat.count(vr);
+        Enqueue(interval); // 装入优先队列
     }
 }
 
-void RegAllocaHelper::Spill(std::shared_ptr<LiveInterval> &interval) {
-    if (!interval->stack_allocated)
-        interval->stack_slot = func.frame.AllocaVar(4);
+// 栈槽在分配结束后统一指定, 见 AssignSpillSlots
+void RegAllocaHelper::Spill(std::shared_ptr<LiveInterval> interval) {
     interval->state = LiveInterval::kStack;
     alloca_map[interval->vreg] = interval;
+    auto erase = [&](std::vector<std::shared_ptr<LiveInterval>> &v) {
+        v.erase(std::remove(v.begin(), v.end(), interval), v.end());
+    };
+    erase(active);
+    erase(inactive);
 }
 
-void RegAllocaHelper::AssignPhyReg(std::shared_ptr<LiveInterval> interval) {
-    bool found = false;
-    for (int i = 0; i < phy_reg_count; i++) {
-        if (!phy_intervals[i]) {
-            interval->phy_reg = (Reg)i;
-            interval->state = LiveInterval::kPhyReg;
-            phy_intervals[i] = interval;
-            alloca_map[interval->vreg] = interval;
-            found = true;
-            break;
-        }
-    }
-    assert(found);
+void RegAllocaHelper::AssignPhyReg(std::shared_ptr<LiveInterval> interval,
+                                   Reg r) {
+    interval->AssignPhyReg(r);
+    alloca_map[interval->vreg] = interval;
+    active.push_back(interval);
 }
 
 void RegAllocaHelper::DumpIntervals() {
@@ -417,94 +448,207 @@ void RegAllocaHelper::DumpAllocaMap() {
         i.second->Dump(std::cerr, &func.frame);
 }
 
-std::shared_ptr<LiveInterval> RegAllocaHelper::PopLastLongestActive() {
-    auto max_it = active.begin();
-    for (auto it = active.begin(); it != active.end(); it++) {
-        if ((*it)->lr.end > (*max_it)->lr.end)
-            max_it = it;
+// 到达位置 pos, 整理 active / inactive
+void RegAllocaHelper::UpdateActive(int pos) {
+    std::vector<std::shared_ptr<LiveInterval>> n_active, n_inactive;
+    for (auto &interval : active) {
+        if (interval->End() < pos)
+            continue; // 失活
+        if (interval->Covers(pos))
+            n_active.push_back(interval);
+        else
+            n_inactive.push_back(interval);
+    }
+    for (auto &interval : inactive) {
+        if (interval->End() < pos)
+            continue;
+        if (interval->Covers(pos))
+            n_active.push_back(interval);
+        else
+            n_inactive.push_back(interval);
     }
-    auto interval = *max_it;
-    active.erase(max_it);
-    return interval;
+    active.swap(n_active);
+    inactive.swap(n_inactive);
 }
 
-void RegAllocaHelper::Alloca() {
+int RegAllocaHelper::RegIndex(Reg r) {
+    auto &regs = profile.alloc_regs;
+    return std::find(regs.begin(), regs.end(), r) - regs.begin();
+}
+
+// 寻找在整个区间内空闲的寄存器
+bool RegAllocaHelper::TryAssignFreeReg(
+    std::shared_ptr<LiveInterval> &interval) {
+    std::vector<bool> free(phy_reg_count, true);
+    for (auto &x : active)
+        free[RegIndex(x->phy_reg)] = false;
+    for (auto &x : inactive)
+        if (free[RegIndex(x->phy_reg)] && x->NextIntersection(*interval) != -1)
+            free[RegIndex(x->phy_reg)] = false;
+    // 跨越调用的区间优先使用被调用方保存的寄存器, 避免在调用处备份;
+    // 其余区间优先使用调用方保存的寄存器, 避免在入口处保存
+    int reg = -1;
+    for (int i = 0; i < phy_reg_count; i++) {
+        if (!free[i])
+            continue;
+        if (IsCallerSaved(profile.alloc_regs[i]) != interval->cross_call) {
+            reg = i;
+            break;
+        }
+        if (reg < 0)
+            reg = i;
+    }
+    if (reg < 0)
+        return false;
+    AssignPhyReg(interval, profile.alloc_regs[reg]);
+    return true;
+}
+
+// 所有寄存器均被占用, 溢出代价较小的一方
+void RegAllocaHelper::AssignBlockedReg(
+    std::shared_ptr<LiveInterval> &interval) {
+    std::vector<double> reg_weight(phy_reg_count, 0);
+    for (auto &x : active)
+        reg_weight[RegIndex(x->phy_reg)] += x->SpillWeight();
+    for (auto &x : inactive)
+        if (x->NextIntersection(*interval) != -1)
+            reg_weight[RegIndex(x->phy_reg)] += x->SpillWeight();
+
+    int reg = 0;
+    for (int i = 1; i < phy_reg_count; i++)
+        if (reg_weight[i] < reg_weight[reg])
+            reg = i;
+
+    if (interval->SpillWeight() <= reg_weight[reg]) {
+        Spill(interval);
+        return;
+    }
+
+    Reg phy = profile.alloc_regs[reg];
+    std::vector<std::shared_ptr<LiveInterval>> to_spill;
+    for (auto &x : active)
+        if (x->phy_reg == phy)
+            to_spill.push_back(x);
+    for (auto &x : inactive)
+        if (x->phy_reg == phy && x->NextIntersection(*interval) != -1)
+            to_spill.push_back(x);
+    for (auto &x : to_spill)
+        Spill(x); // 入栈
+    AssignPhyReg(interval, phy);
+}
+
+// 栈槽着色: 互不冲突的溢出变量共享同一个栈槽
+void RegAllocaHelper::AssignSpillSlots(
+    std::function<bool(LiveInterval &, LiveInterval &)> interfere) {
+    std::vector<std::vector<LiveInterval *>> slots;
+    std::vector<int> offsets;
+    std::set<LiveInterval *> visited;
+    for (auto &[vr, interval] : alloca_map) {
+        if (interval->state != LiveInterval::kStack ||
+            interval->stack_allocated || interval->remat ||
+            visited.count(interval.get()))
+            continue;
+        visited.insert(interval.get());
+
+        int i = 0;
+        for (; i < slots.size(); i++) {
+            if (std::none_of(slots[i].begin(), slots[i].end(),
+                             [&](auto x) { return interfere(*x, *interval); }))
+                break;
+        }
+        if (i == slots.size()) {
+            slots.push_back({});
+            offsets.push_back(func.frame.AllocaVar(4));
+        }
+        slots[i].push_back(interval.get());
+        interval->stack_slot = offsets[i];
+    }
+}
+
+void RegAllocaHelper::LinearScan() {
+    FindRemat();
     CollectLiveInfo();
 
     if (DbgEnabled(DbgRegAlloca))
         DumpIntervals();
 
-    Location loc;
-    for (auto &bb : func.bbs) {
-        loc.n = 0;
-        for (auto &inst : bb->insts) { // 用于迭代loc
-            // expired old interval
-            // 将失活的interval所代表的寄存器清除
-            for (auto it = active.begin(); it != active.end(); it++) {
-                auto may_expired = *it;
-                if (may_expired->lr.end < loc) {
-                    if ((*it)->state == LiveInterval::kPhyReg)
-                        phy_intervals[(int)(*it)->phy_reg] = nullptr;
-                    active.erase(it--);
-                }
-            }
-
-            // for each interval, whose lr start from loc
-            for (std::shared_ptr<LiveInterval> interval;
-                 intervals.size() > 0;) {
-                interval = Dequeue();
-                if (interval->lr.start > loc) {
-                    Enqueue(interval);
-                    break;
-                }
+    for (std::shared_ptr<LiveInterval> interval; intervals.size() > 0;) {
+        interval = Dequeue();
+        if (interval->Assigned()) // 栈上传递的参数
+            continue;
+        UpdateActive(interval->Start());
+        if (!TryAssignFreeReg(interval))
+            AssignBlockedReg(interval);
+    }
 
-                if (!interval->Assigned()) { // 为虚拟寄存器
-                    active.push_back(interval);
+    AssignSpillSlots([](LiveInterval &a, LiveInterval &b) {
+        return a.NextIntersection(b) != -1;
+    });
+}
 
-                    // 寄存器堆中存在可用寄存器
-                    if (active.size() < phy_reg_count) {
-                        AssignPhyReg(interval);
-                    } else {
-                        // 取出最优寄存器
-                        auto to_spill = PopLastLongestActive();
-                        if (to_spill != interval) {
-                            phy_intervals[(int)to_spill->phy_reg] = nullptr;
-                            AssignPhyReg(interval);
-                        }
-                        Spill(to_spill); // 入栈
-                    }
-                }
-            }
+// 图着色分配, 合并的结点共享同一个区间 (寄存器或栈空间)
+void RegAllocaHelper::ColorAlloca() {
+    live.Run();
+    if (DbgEnabled(DbgLiveAnalysis))
+        live.Dump(std::cerr);
+    FindRemat();
+
+    GraphColoring graph(func, live, phy_reg_count);
+    graph.params = func.args;
+    for (auto &[vr, v] : remat)
+        graph.remat.insert(vr);
+    for (auto r : profile.alloc_regs)
+        graph.caller_saved.push_back(IsCallerSaved(r));
+    for (int i = max_reg_arg_count; i < func.args.size(); i++)
+        graph.excluded.insert(func.args[i]); // 栈上传递的参数
+    graph.Run();
+    if (DbgEnabled(DbgRegAlloca))
+        graph.Dump(std::cerr);
+
+    std::map<Reg, std::shared_ptr<LiveInterval>> rep_interval;
+    for (int i = 0; i < live.vreg_count; i++) {
+        Reg vr = LiveAnalysis::IdxVReg(i);
+        if (!graph.InGraph(vr))
+            continue;
+        auto &interval = rep_interval[graph.GetAlias(vr)];
+        if (!interval) {
+            interval = std::make_shared<LiveInterval>();
+            interval->vreg = graph.GetAlias(vr);
+            int c = graph.GetColor(vr);
+            if (c >= 0)
+                interval->AssignPhyReg(profile.alloc_regs[c]);
+            else
+                interval->state = LiveInterval::kStack;
+        }
+        alloca_map[vr] = interval;
+    }
 
-            // check stack slot reference count
-            int stack_slot_refc = 0;
-            if (inst->op != Instr::kCall)
-                for (Reg *r : inst->Regs()) {
-                    if (*r < Reg::VREG)
-                        continue;
-                    if (alloca_map[*r] &&
-                        alloca_map[*r]->state == LiveInterval::kStack) {
-                        stack_slot_refc++;
-                    }
-                }
-            // reserve enough free registers for stack slot reference
-            int spill_count = active.size() + stack_slot_refc - phy_reg_count;
-            while (spill_count-- > 0) {
-                auto to_spill = PopLastLongestActive();
-                Spill(to_spill);
-                phy_intervals[(int)to_spill->phy_reg] = nullptr;
-            }
+    // 合并了其他结点的代表结点有多处定值, 不能重新计算
+    std::map<Reg, int> class_size;
+    for (auto &[vr, interval] : alloca_map)
+        class_size[interval->vreg]++;
+    for (auto &[vr, interval] : alloca_map)
+        interval->remat = remat.count(vr) && class_size[vr] == 1;
 
-            // collection free registers at the location
-            for (int i = 0; i < phy_reg_count; i++) {
-                if (!phy_intervals[i])
-                    loc_free_regs[loc].push_back((Reg)i);
-            }
-            loc.n++;
-        }
-        loc.bb++;
+    for (int i = max_reg_arg_count; i < func.args.size(); i++) {
+        auto &interval = alloca_map[func.args[i]];
+        interval = std::make_shared<LiveInterval>();
+        interval->vreg = func.args[i];
+        interval->state = LiveInterval::kStack;
+        interval->stack_allocated = true; // 使用参数的栈空间
     }
 
+    AssignSpillSlots([&](LiveInterval &a, LiveInterval &b) {
+        return graph.Interfere(a.vreg, b.vreg);
+    });
+}
+
+void RegAllocaHelper::Alloca() {
+    if (algo == kGraphColoring)
+        ColorAlloca();
+    else
+        LinearScan();
+
     if (DbgEnabled(DbgRegAlloca)) {
         std::cerr << "before re-write\n";
         DumpAllocaMap();
@@ -520,100 +664,184 @@ void RegAllocaHelper::Alloca() {
     }
 }
 
-bool RegAllocaHelper::FuncIsBuiltIn(std::string name) {
-    static std::set<std::string> builtin_set{
-        "getint",          "getch",          "getarray",
-        "putint",          "putch",          "putarray",
-        "starttime",       "stoptime",       "set_i32_array",
-        "_sysy_starttime", "_sysy_stoptime", "_sysy_set_i32_array"};
-    return builtin_set.count(name) > 0;
-}
-
-bool RegAllocaHelper::GetBackupRegs(std::vector<Reg> &regs, Reg ret,
-                                    int count) {
-    // has ret: r0 + args except ret_phy
-    // no ret:  args except ret_phy
-    Reg except = Reg::INVALID;
-    if (ret != Reg::INVALID) {
-        auto &interval = alloca_map[ret];
-        if (interval && interval->state == LiveInterval::kPhyReg)
-            except = interval->phy_reg;
-        count = count == 0 ? 1 : count;
-    }
-    for (int i = 0; i < count; i++) {
-        if ((Reg)i != except)
-            regs.push_back((Reg)i);
+// 逐块逆序扫描, 求每个调用之后仍然活跃的调用方保存寄存器
+void RegAllocaHelper::ComputeLiveAfterCall() {
+    for (auto &bb : func.bbs) {
+        BitSet cur = live.liveout[bb->id];
+        for (auto it = bb->insts.rbegin(); it != bb->insts.rend(); it++) {
+            auto &inst = *it;
+            for (Reg *r : inst->WRegs())
+                if (LiveAnalysis::IsVReg(*r))
+                    cur.Reset(LiveAnalysis::VRegIdx(*r));
+            if (inst->op == Instr::kCall) {
+                auto &regs = live_after_call[inst.get()];
+                cur.ForEach([&](int i) {
+                    auto &interval = alloca_map[LiveAnalysis::IdxVReg(i)];
+                    if (interval && interval->state == LiveInterval::kPhyReg &&
+                        IsCallerSaved(interval->phy_reg))
+                        regs.insert(interval->phy_reg);
+                });
+                if (!regs.empty())
+                    func.frame.need_backup = true;
+            }
+            for (Reg *r : inst->RRegs())
+                if (LiveAnalysis::IsVReg(*r))
+                    cur.Set(LiveAnalysis::VRegIdx(*r));
+        }
     }
+}
+
+// 仅备份调用之后仍然活跃的调用方保存寄存器
+bool RegAllocaHelper::GetBackupRegs(std::vector<Reg> &regs, Instr *call) {
+    for (auto r : live_after_call[call])
+        regs.push_back(r);
     return regs.size() > 0;
 }
 
+// 并行赋值 dst <- src, 成环时借助 tmp 打破
+void RegAllocaHelper::ParallelMove(builder::instr_list &insts,
+                                   builder::instr_iter it,
+                                   std::vector<std::pair<Reg, Reg>> moves,
+                                   Reg tmp) {
+    moves.erase(std::remove_if(moves.begin(), moves.end(),
+                               [](auto &m) { return m.first == m.second; }),
+                moves.end());
+    auto is_src = [&](Reg r) {
+        for (auto &m : moves)
+            if (m.second == r)
+                return true;
+        return false;
+    };
+    while (!moves.empty()) {
+        auto ready = std::find_if(moves.begin(), moves.end(),
+                                  [&](auto &m) { return !is_src(m.first); });
+        if (ready != moves.end()) {
+            builder::Move(insts, it, ready->first, ready->second);
+            moves.erase(ready);
+            continue;
+        }
+        // 剩余的传递全部成环, 将某个目标的原值移入 tmp
+        Reg d = moves.front().first;
+        builder::Move(insts, it, tmp, d);
+        for (auto &m : moves)
+            if (m.second == d)
+                m.second = tmp;
+    }
+}
+
+// str rt, [rn, rm] 的三个操作数都溢出时临时寄存器不够用,
+// 先将地址算入 scratch_regs[1], 改为 str rt, [scratch]
+void RegAllocaHelper::SplitStoreAddr(builder::instr_list &insts,
+                                     builder::instr_iter it,
+                                     std::function<Reg(Reg, Reg)> refer_vreg) {
+    auto str = dynamic_cast<STR *>(it->get());
+    auto &addr = str->addr;
+    if (addr.mode != Address::kMBaseReg && addr.mode != Address::kMBaseRegShift)
+        return;
+    std::set<Reg> spilled;
+    for (auto r : str->RRegs())
+        if (LiveAnalysis::IsVReg(*r) &&
+            alloca_map[*r]->state != LiveInterval::kPhyReg)
+            spilled.insert(*r);
+    if (spilled.size() <= 2)
+        return;
+
+    Reg base = refer_vreg(addr.base, scratch_regs[0]);
+    Reg index = refer_vreg(addr.offset.reg, scratch_regs[1]);
+    builder::BinaryAlu(insts, it, Instr::kADD, scratch_regs[1], base, index);
+    if (addr.mode == Address::kMBaseRegShift) {
+        auto add = std::prev(it)->get();
+        add->flags |= Instr::kFlagHasShift;
+        dynamic_cast<BinaryAlu *>(add)->shift = addr.offset.shift;
+    }
+    addr = Address(scratch_regs[1]);
+}
+
 void RegAllocaHelper::ReWrite() { // 初始化栈帧，采用满递减堆栈
-    // push r0-r7, lr
     int reg_arg_count = std::min((int)func.args.size(), max_reg_arg_count);
-    int rx = std::max((int)func.has_ret, reg_arg_count);
-    func.frame.saved_reg_count = 7 - rx + 2;
-    builder::Push(BACK(func.entry.insts), Reg::R0, Reg::R7, Reg::LR);
-    // sub sp, sp, x
-    builder::BinaryAlu(BACK(func.entry.insts), Instr::kSUB, Reg::SP, Reg::SP,
-                       func.frame.AllocaSize());
-    // add r7, sp, x
-    builder::BinaryAlu(BACK(func.entry.insts), Instr::kADD, Reg::R7, Reg::SP,
-                       func.frame.LocalVarBaseOffset());
+    ComputeLiveAfterCall();
 
-    // move arg to allocated
-    for (int i = 0; i < reg_arg_count; i++) {
-        builder::Store(BACK(func.entry.insts), (Reg)i, func.frame.ArgAddr(i));
-    }
+    // 入口处将 r0-r3 中的参数移入分配的位置, 成环时借用 lr
+    builder::instr_list arg_insts;
+    std::vector<std::pair<Reg, Reg>> arg_moves;
     for (int i = 0; i < reg_arg_count; i++) {
         auto &interval = alloca_map[func.args[i]];
         if (interval->state == LiveInterval::kPhyReg)
-            builder::Load(BACK(func.entry.insts), interval->phy_reg,
-                          func.frame.ArgAddr(i));
+            arg_moves.push_back({interval->phy_reg, (Reg)i});
+        else
+            builder::Store(arg_insts, arg_insts.end(), (Reg)i,
+                           interval->GetAddr(func.frame));
+    }
+    ParallelMove(arg_insts, arg_insts.end(), arg_moves, Reg::LR);
+
+    // 统计函数改写的寄存器, 溢出变量经由 scratch_regs 中转, 调用会改写 lr
+    std::set<Reg> used_regs;
+    for (auto &[vr, interval] : alloca_map) {
+        if (interval->state == LiveInterval::kPhyReg)
+            used_regs.insert(interval->phy_reg);
         else
-            interval->stack_slot = func.frame.ArgOffset(i);
+            used_regs.insert({scratch_regs[0], scratch_regs[1]});
     }
+    for (auto &inst : arg_insts)
+        for (auto r : inst->WRegs())
+            used_regs.insert(*r);
+    if (func.frame.has_call)
+        used_regs.insert(Reg::LR);
+    if (func.frame.NeedLocalVarBase())
+        used_regs.insert(Reg::R7);
+
+    // 仅保存被改写的被调用方保存寄存器 (r4-r11, lr)
+    for (auto r : used_regs)
+        if (!IsCallerSaved(r))
+            func.frame.saved_regs.push_back(r);
+    bool save_lr = used_regs.count(Reg::LR);
+
+    // push {saved regs}
+    if (!func.frame.saved_regs.empty())
+        builder::Push(BACK(func.entry.insts), func.frame.saved_regs);
+    // sub sp, sp, x
+    if (func.frame.AllocaSize() > 0)
+        builder::BinaryAlu(BACK(func.entry.insts), Instr::kSUB, Reg::SP,
+                           Reg::SP, func.frame.AllocaSize());
+    // add r7, sp, x
+    if (func.frame.NeedLocalVarBase())
+        builder::BinaryAlu(BACK(func.entry.insts), Instr::kADD, Reg::R7,
+                           Reg::SP, func.frame.LocalVarBaseOffset());
+    func.entry.insts.splice(func.entry.insts.end(), arg_insts);
+
     for (int i = max_reg_arg_count; i < func.args.size(); i++) {
         auto &interval = alloca_map[func.args[i]];
         interval->stack_slot = func.frame.ArgOffset(i);
     }
 
+    // 溢出的可重新计算值不再定值, 改为在每个使用处重新生成
+    for (auto &bb : func.bbs) {
+        bb->insts.remove_if([&](std::unique_ptr<Instr> &inst) {
+            auto regs = inst->WRegs();
+            if (regs.size() != 1 || !remat.count(*regs[0]))
+                return false;
+            auto &interval = alloca_map[*regs[0]];
+            return interval->remat && interval->state != LiveInterval::kPhyReg;
+        });
+    }
+
     // re-write virtual register reference
-    Location loc;
     for (auto &bb : func.bbs) {
-        loc.n = 0;
         for (auto it_inst = bb->insts.begin(); it_inst != bb->insts.end();
              it_inst++) {
             auto inst = it_inst->get();
 
             // 将虚拟寄存器 转化为实际寄存器（函数）
             // load
-            auto refer_vreg = [&](Reg vr, Reg rd = Reg::INVALID) -> Reg {
+            auto refer_vreg = [&](Reg vr, Reg rd) -> Reg {
                 auto &interval = alloca_map[vr];
-                if (interval->state == LiveInterval::kPhyReg) {
+                if (interval->state == LiveInterval::kPhyReg)
                     return interval->phy_reg;
-                } else {
-                    if (rd == Reg::INVALID) {
-                        rd = loc_free_regs[loc].back();
-                        loc_free_regs[loc].pop_back();
-                    }
+                if (interval->remat)
+                    Rematerialize(bb->insts, it_inst, rd, remat[vr]);
+                else
                     builder::Load(bb->insts, it_inst, rd,
                                   interval->GetAddr(func.frame));
-                }
-                return rd;
-            };
-            // store
-            auto write_vreg = [&](Reg vr, Reg rd = Reg::INVALID) -> Reg {
-                auto &interval = alloca_map[vr];
-                if (interval->state == LiveInterval::kPhyReg) {
-                    return interval->phy_reg;
-                } else {
-                    if (rd == Reg::INVALID) {
-                        rd = loc_free_regs[loc].back();
-                        loc_free_regs[loc].pop_back();
-                    }
-                    builder::Store(bb->insts, it_inst, rd,
-                                   interval->GetAddr(func.frame));
-                }
                 return rd;
             };
 
@@ -622,10 +850,7 @@ void RegAllocaHelper::ReWrite() { // 初始化栈帧，采用满递减堆栈
                 int reg_arg_count =
                     std::min((int)call->args.size(), max_reg_arg_count);
                 std::vector<Reg> backup_regs;
-                int count = reg_arg_count;
-                if (!DbgEnabled(DbgDisableBuiltBackup))
-                    count = FuncIsBuiltIn(call->func) ? 4 : reg_arg_count;
-                bool need_backup = GetBackupRegs(backup_regs, call->ret, count);
+                bool need_backup = GetBackupRegs(backup_regs, call);
                 if (need_backup) {
                     for (auto r : backup_regs) {
                         Address addr = func.frame.BackupAddress(r);
@@ -633,43 +858,25 @@ void RegAllocaHelper::ReWrite() { // 初始化栈帧，采用满递减堆栈
                     }
                 }
 
-                bool has_ret = call->ret != Reg::INVALID;
-                Reg reg_free = Reg::INVALID;
-                if (backup_regs.size() > 0)
-                    reg_free = backup_regs.front();
-
-                // set a4, a5, ...
+                // set a4, a5, ... (r0-r3 尚未被改写)
                 for (int i = max_reg_arg_count; i < call->args.size(); i++) {
-                    Reg rd = reg_free;
-                    auto &interval = alloca_map[call->args[i]];
-                    if (interval->state == LiveInterval::kPhyReg &&
-                        interval->phy_reg == rd)
-                        builder::Load(bb->insts, it_inst, rd,
-                                      func.frame.BackupAddress(rd));
-                    else
-                        rd = refer_vreg(call->args[i], rd);
+                    Reg rd = refer_vreg(call->args[i], scratch_regs[0]);
                     builder::Store(bb->insts, it_inst, rd,
                                    func.frame.CallArgAddr(i));
                 }
 
-                // set r0-r3
+                // set r0-r3, 寄存器之间的传递需要并行完成
+                std::vector<std::pair<Reg, Reg>> moves;
                 for (int i = 0; i < reg_arg_count; i++) {
                     auto &interval = alloca_map[call->args[i]];
-                    if (interval->state == LiveInterval::kPhyReg) {
-                        // backup[x] -> rx
-                        if (std::find(backup_regs.begin(), backup_regs.end(),
-                                      interval->phy_reg) != backup_regs.end())
-                            builder::Load(
-                                bb->insts, it_inst, (Reg)i,
-                                func.frame.BackupAddress(interval->phy_reg));
-                        // phy -> rx
-                        else if ((Reg)i != interval->phy_reg)
-                            builder::Move(bb->insts, it_inst, (Reg)i,
-                                          interval->phy_reg);
-                    } else {
-                        // load from stack
-                        refer_vreg(call->args[i], (Reg)i);
-                    }
+                    if (interval->state == LiveInterval::kPhyReg)
+                        moves.push_back({(Reg)i, interval->phy_reg});
+                }
+                ParallelMove(bb->insts, it_inst, moves, Reg::LR); // 调用总会改写 lr
+                for (int i = 0; i < reg_arg_count; i++) {
+                    auto &interval = alloca_map[call->args[i]];
+                    if (interval->state != LiveInterval::kPhyReg)
+                        refer_vreg(call->args[i], (Reg)i); // load from stack
                 }
 
                 // insert at next instruction
@@ -678,10 +885,12 @@ void RegAllocaHelper::ReWrite() { // 初始化栈帧，采用满递减堆栈
                 if (call->ret != Reg::INVALID) {
                     auto &interval = alloca_map[call->ret];
                     if (interval->state == LiveInterval::kPhyReg) {
-                        builder::Move(bb->insts, it_inst, interval->phy_reg,
-                                      Reg::R0);
+                        if (interval->phy_reg != Reg::R0)
+                            builder::Move(bb->insts, it_inst,
+                                          interval->phy_reg, Reg::R0);
                     } else {
-                        write_vreg(call->ret, Reg::R0);
+                        builder::Store(bb->insts, it_inst, Reg::R0,
+                                       interval->GetAddr(func.frame));
                     }
                 }
 
@@ -693,47 +902,78 @@ void RegAllocaHelper::ReWrite() { // 初始化栈帧，采用满递减堆栈
                 }
                 it_inst--;
             } else {
-                std::vector<Reg *> RRegs = inst->RRegs();
-                std::vector<Reg *> WRegs = inst->WRegs();
-                if (inst->op == Instr::kSTR) {
-                    for (auto &r : WRegs)
-                        RRegs.push_back(r);
-                    WRegs.clear();
-                }
-
-                for (auto r : RRegs) {
-                    if (*r < Reg::VREG)
+                if (inst->op == Instr::kSTR)
+                    SplitStoreAddr(bb->insts, it_inst, refer_vreg);
+
+                // 溢出的寄存器通过 scratch_regs 中转
+                // 条件执行的指令同时读写 rd, 需在改写读操作数前记下写的寄存器
+                std::vector<std::pair<Reg *, Reg>> writes;
+                for (auto r : inst->WRegs())
+                    writes.push_back({r, *r});
+                std::map<Reg, Reg> loaded;
+                int scratch = 0;
+                for (auto r : inst->RRegs()) {
+                    if (!LiveAnalysis::IsVReg(*r))
                         continue;
-                    *r = refer_vreg(*r);
+                    auto it = loaded.find(*r);
+                    if (it != loaded.end()) {
+                        *r = it->second;
+                        continue;
+                    }
+                    auto &interval = alloca_map[*r];
+                    if (interval->state == LiveInterval::kPhyReg) {
+                        *r = interval->phy_reg;
+                        continue;
+                    }
+                    assert(scratch < 2 && "too many spilled operands");
+                    Reg vr = *r;
+                    *r = refer_vreg(vr, scratch_regs[scratch]);
+                    loaded[vr] = scratch_regs[scratch++];
                 }
-                for (auto &r : WRegs) {
-                    if (*r < Reg::VREG)
+                for (auto [r, vr] : writes) {
+                    if (!LiveAnalysis::IsVReg(vr))
+                        continue;
+                    auto &interval = alloca_map[vr];
+                    if (interval->state == LiveInterval::kPhyReg) {
+                        *r = interval->phy_reg;
                         continue;
+                    }
+                    // 已读入的溢出变量沿用同一个临时寄存器
+                    auto it = loaded.find(vr);
+                    *r = it != loaded.end() ? it->second : scratch_regs[0];
                     it_inst++;
-                    *r = write_vreg(*r);
+                    builder::Store(bb->insts, it_inst, *r,
+                                   interval->GetAddr(func.frame));
                     it_inst--;
                 }
             }
-            loc.n++;
         }
-        loc.bb++;
     }
 
     // add sp, sp, x
-    builder::BinaryAlu(BACK(func.end.insts), Instr::kADD, Reg::SP, Reg::SP,
-                       func.frame.AllocaSize() +
-                           (9 - func.frame.saved_reg_count) * 4);
-    // pop rx-r7, pc
-    builder::Pop(BACK(func.end.insts), (Reg)rx, Reg::R7, Reg::PC);
+    if (func.frame.AllocaSize() > 0)
+        builder::BinaryAlu(BACK(func.end.insts), Instr::kADD, Reg::SP,
+                           Reg::SP, func.frame.AllocaSize());
+    // pop {saved regs, pc}, 未保存 lr 时由 bx lr 返回
+    auto pop_regs = func.frame.saved_regs;
+    if (save_lr)
+        pop_regs.back() = Reg::PC;
+    if (!pop_regs.empty())
+        builder::Pop(BACK(func.end.insts), pop_regs);
+    if (!save_lr)
+        builder::BranchExchange(BACK(func.end.insts), Reg::LR);
 }
 
 } // namespace regalloca
 
-void RegAlloca(Asm &_asm) {
-    for (auto &f : _asm.funcs) {
-        regalloca::RegAllocaHelper helper(*f);
-        helper.Alloca();
-    }
+void RegAlloca(Func &f, int algo, const TargetProfile &profile) {
+    regalloca::RegAllocaHelper helper(f, algo, profile);
+    helper.Alloca();
+}
+
+void RegAlloca(Asm &_asm, int algo, const TargetProfile &profile) {
+    for (auto &f : _asm.funcs)
+        RegAlloca(*f, algo, profile);
 }
 
-} // namespace backend
\ No newline at end of file
+} // namespace backend
@@ -0,0 +1,444 @@
+#include "backend.h"
+#include "dbg.hpp"
+#include <iostream>
+
+namespace backend {
+
+const std::string DbgSchedule = "schedule";
+const std::string DbgScheduleDag = "schedule-dag";
+
+int PipelineModel::Latency(Instr *inst) const {
+    switch (inst->op) {
+    case Instr::kLDR:
+    case Instr::kLDRD:
+        return load;
+    case Instr::kMUL:
+        return mul;
+    case Instr::kSMMUL:
+        return mul_high;
+    case Instr::kSDIV:
+    case Instr::kUDIV:
+        return div;
+    }
+    return inst->flags & Instr::kFlagHasShift ? alu_shift : alu;
+}
+
+namespace {
+
+const Reg kFlags = (Reg)-2; // 标志位按一个寄存器处理
+
+// 调度区域的边界, 不参与调度
+bool IsBarrier(Instr *inst) {
+    switch (inst->op) {
+    case Instr::kCall:
+    case Instr::kBL:
+    case Instr::kB:
+    case Instr::kBX:
+    case Instr::kLabel:
+    case Instr::kPUSH:
+    case Instr::kPOP:
+    case Instr::kIT:
+        return true;
+    }
+    return false;
+}
+
+// 分配前读写参数、返回值等物理寄存器的指令保持原位: 移动它们会延长物理寄存器
+// 的活跃区间, 而分配器不会把这段区间与其间的虚拟寄存器视为冲突
+bool UsesPhyReg(Instr *inst) {
+    for (auto r : inst->Regs())
+        if (!LiveAnalysis::IsVReg(*r) && *r != Reg::SP && *r != Reg::R7)
+            return true;
+    return false;
+}
+
+// 区域内的指令数上限, 过长的区域分段调度, 使建图与选择的开销与块长成线性
+const int kMaxRegionSize = 128;
+
+// 调度单元: 一条指令, 或需要保持相邻的 MOVW / MOVT 与连续的条件执行指令
+struct Node {
+    std::vector<std::unique_ptr<Instr>> insts;
+    std::vector<std::pair<int, int>> succs; // 后继与延迟
+    std::vector<Reg> reads, writes;
+    int npreds = 0;
+    int latency = 0;
+    int height = 0; // 到区域末尾的最长延迟, 作为优先级
+    int ready = 0;  // 操作数全部就绪的周期
+    bool load = false, store = false;
+    bool used = false;       // 结果在区域内被读
+    bool known_addr = false; // [base, #lo] 到 [base, #hi) 之间
+    Reg base;
+    unsigned lo, hi;
+
+    void Add(std::unique_ptr<Instr> inst, const PipelineModel &model) {
+        // 结点内先写后读的寄存器不产生依赖
+        auto add = [](std::vector<Reg> &regs, Reg r) {
+            if (std::find(regs.begin(), regs.end(), r) == regs.end())
+                regs.push_back(r);
+        };
+        auto written = [&](Reg r) {
+            return std::find(writes.begin(), writes.end(), r) != writes.end();
+        };
+        for (auto r : inst->RRegs())
+            if (!written(*r))
+                add(reads, *r);
+        if ((inst->cond.type != Cond::AL || inst->op == Instr::kADC) &&
+            !written(kFlags))
+            add(reads, kFlags);
+        for (auto r : inst->WRegs())
+            add(writes, *r);
+        if (inst->op == Instr::kCMP || (inst->flags & Instr::kFlagS))
+            add(writes, kFlags);
+        AddMemory(inst.get());
+        latency =
+            std::max(latency, (int)insts.size() + model.Latency(inst.get()));
+        insts.push_back(std::move(inst));
+    }
+
+    void AddMemory(Instr *inst) {
+        Address *addr = nullptr;
+        unsigned size = 4;
+        if (auto ldr = dynamic_cast<LDR *>(inst); ldr && !ldr->eq_addr)
+            addr = &ldr->addr, load = true;
+        else if (auto str = dynamic_cast<STR *>(inst))
+            addr = &str->addr, store = true;
+        else if (auto ldrd = dynamic_cast<LDRD *>(inst))
+            addr = &ldrd->addr, load = true, size = 8;
+        else if (auto strd = dynamic_cast<STRD *>(inst))
+            addr = &strd->addr, store = true, size = 8;
+        if (!addr)
+            return;
+        bool first = !known_addr && insts.empty();
+        known_addr = first && (addr->mode == Address::kMBase ||
+                               addr->mode == Address::kMBaseImm);
+        if (known_addr) {
+            base = addr->base;
+            lo = addr->mode == Address::kMBase ? 0 : addr->offset.imm;
+            hi = lo + size;
+        }
+    }
+
+    bool MayAlias(const Node &o) const {
+        if (!known_addr || !o.known_addr || base != o.base)
+            return true;
+        return lo < o.hi && o.lo < hi;
+    }
+};
+
+struct Scheduler {
+    const PipelineModel &model;
+    int max_pressure;
+    std::vector<Node> nodes;
+    std::multimap<Reg, Reg> copies; // 虚拟寄存器间的复制, 源 -> 目的
+
+    Scheduler(const PipelineModel &model, int max_pressure)
+        : model(model), max_pressure(max_pressure) {}
+
+    void AddEdge(int from, int to, int latency) {
+        nodes[from].succs.push_back({to, latency});
+        nodes[to].npreds++;
+    }
+    void BuildDag();
+    int Estimate(const std::vector<int> &order);
+    std::vector<int> ListSchedule(const std::set<Reg> &live_in,
+                                  const std::set<Reg> &live_out);
+    void DumpDag();
+    // 调度 [begin, end) 内的指令, 返回调度前后的估计周期数
+    std::pair<int, int> Run(BB &bb, builder::instr_iter begin,
+                            builder::instr_iter end,
+                            const std::set<Reg> &live_in,
+                            const std::set<Reg> &live_out);
+};
+
+void Scheduler::BuildDag() {
+    std::map<Reg, int> last_def;
+    std::map<Reg, std::vector<int>> uses; // 上次定值之后的读
+    std::vector<int> mem;                 // 之前的访存结点
+    for (int i = 0; i < nodes.size(); i++) {
+        Node &n = nodes[i];
+        for (auto r : n.reads) {
+            auto def = last_def.find(r);
+            if (def != last_def.end()) {
+                AddEdge(def->second, i, nodes[def->second].latency);
+                nodes[def->second].used = true;
+            }
+            uses[r].push_back(i);
+        }
+        // 存在复制 rd <- rs 时, rs 的定值不早于 rd 原有的读,
+        // 以免两者冲突而无法合并
+        for (auto r : n.writes) {
+            auto [first, last] = copies.equal_range(r);
+            for (auto it = first; it != last; it++)
+                for (int u : uses[it->second])
+                    if (u != i)
+                        AddEdge(u, i, 0);
+        }
+        for (auto r : n.writes) {
+            for (int u : uses[r])
+                if (u != i)
+                    AddEdge(u, i, 0);
+            auto def = last_def.find(r);
+            if (def != last_def.end())
+                AddEdge(def->second, i, 1);
+            uses[r].clear();
+            last_def[r] = i;
+        }
+        if (!n.load && !n.store)
+            continue;
+        for (int m : mem) {
+            Node &o = nodes[m];
+            if ((n.store || o.store) && n.MayAlias(o))
+                AddEdge(m, i, o.store ? 1 : 0);
+        }
+        mem.push_back(i);
+    }
+    for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+        Node &n = nodes[i];
+        n.height = n.latency;
+        for (auto [s, lat] : n.succs)
+            n.height = std::max(n.height, lat + nodes[s].height);
+    }
+}
+
+// 单发射顺序流水线: 指令在操作数就绪且前一条已发射后发射
+int Scheduler::Estimate(const std::vector<int> &order) {
+    std::vector<int> avail(nodes.size(), 0);
+    int cycle = 0, finish = 0;
+    for (int i : order) {
+        Node &n = nodes[i];
+        int issue = std::max(cycle, avail[i]);
+        for (auto [s, lat] : n.succs)
+            avail[s] = std::max(avail[s], issue + lat);
+        cycle = issue + n.insts.size();
+        finish = std::max(finish, issue + n.latency);
+    }
+    return std::max(cycle, finish);
+}
+
+// 优先发射已就绪且关键路径最长的结点; 分配前活跃的虚拟寄存器过多时,
+// 优先发射能结束虚拟寄存器活跃区间的结点
+std::vector<int> Scheduler::ListSchedule(const std::set<Reg> &live_in,
+                                         const std::set<Reg> &live_out) {
+    // 尚未发射的读与写; 区域内最后一次写之后的值在出口处可能活跃
+    std::map<Reg, int> remaining, defs;
+    for (auto &n : nodes) {
+        for (auto r : n.reads)
+            remaining[r]++;
+        for (auto r : n.writes)
+            defs[r]++;
+    }
+    bool pre_ra = max_pressure != INT_MAX;
+    std::set<Reg> live = live_in;
+    // 发射 n 后 n 读写的虚拟寄存器的活跃状态
+    auto affected = [&](Node &n) {
+        std::map<Reg, bool> alive;
+        for (auto &regs : {n.reads, n.writes})
+            for (auto r : regs)
+                if (LiveAnalysis::IsVReg(r))
+                    alive[r] = false;
+        for (auto &[r, a] : alive) {
+            int reads = remaining[r] - std::count(n.reads.begin(),
+                                                  n.reads.end(), r);
+            int writes = defs[r] - std::count(n.writes.begin(),
+                                              n.writes.end(), r);
+            a = reads > 0 || (live_out.count(r) && writes == 0);
+        }
+        return alive;
+    };
+    auto delta = [&](Node &n) {
+        int d = 0;
+        for (auto [r, a] : affected(n))
+            d += (int)a - (int)live.count(r);
+        return d;
+    };
+
+    std::vector<int> ready, order;
+    for (int i = 0; i < nodes.size(); i++)
+        if (nodes[i].npreds == 0)
+            ready.push_back(i);
+    int cycle = 0;
+    std::vector<int> deltas(nodes.size());
+    while (!ready.empty()) {
+        bool tight = (int)live.size() >= max_pressure;
+        if (tight)
+            for (int i : ready)
+                deltas[i] = delta(nodes[i]);
+        auto better = [&](int a, int b) {
+            Node &x = nodes[a], &y = nodes[b];
+            if (tight && deltas[a] != deltas[b])
+                return deltas[a] < deltas[b];
+            // 分配前, 结果只在区域外使用的结点 (如 phi 的复制) 尽量靠后
+            bool sx = pre_ra && !x.used && !x.store,
+                 sy = pre_ra && !y.used && !y.store;
+            if (sx != sy)
+                return sy;
+            bool rx = x.ready <= cycle, ry = y.ready <= cycle;
+            if (rx != ry)
+                return rx;
+            if (!rx && x.ready != y.ready)
+                return x.ready < y.ready;
+            if (x.height != y.height)
+                return x.height > y.height;
+            return a < b;
+        };
+        auto pick = std::min_element(ready.begin(), ready.end(), better);
+        int i = *pick;
+        ready.erase(pick);
+        order.push_back(i);
+
+        Node &n = nodes[i];
+        for (auto [r, a] : affected(n)) {
+            if (a)
+                live.insert(r);
+            else
+                live.erase(r);
+        }
+        for (auto r : n.reads)
+            remaining[r]--;
+        for (auto r : n.writes)
+            defs[r]--;
+        int issue = std::max(cycle, n.ready);
+        for (auto [s, lat] : n.succs) {
+            nodes[s].ready = std::max(nodes[s].ready, issue + lat);
+            if (--nodes[s].npreds == 0)
+                ready.push_back(s);
+        }
+        cycle = issue + n.insts.size();
+    }
+    return order;
+}
+
+void Scheduler::DumpDag() {
+    for (int i = 0; i < nodes.size(); i++) {
+        Node &n = nodes[i];
+        std::cerr << "  n" << i << " h=" << n.height << ":";
+        for (auto &inst : n.insts)
+            std::cerr << " " << inst->str() << ";";
+        if (!n.succs.empty()) {
+            std::cerr << " ->";
+            for (auto [s, lat] : n.succs)
+                std::cerr << " n" << s << "(" << lat << ")";
+        }
+        std::cerr << "\n";
+    }
+}
+
+std::pair<int, int> Scheduler::Run(BB &bb, builder::instr_iter begin,
+                                   builder::instr_iter end,
+                                   const std::set<Reg> &live_in,
+                                   const std::set<Reg> &live_out) {
+    nodes.clear();
+    for (auto it = begin; it != end; it++) {
+        Instr *inst = it->get();
+        bool glue = false;
+        if (!nodes.empty()) {
+            Instr *last = nodes.back().insts.back().get();
+            if (inst->op == Instr::kMOVT && last->op == Instr::kMOVW)
+                glue = dynamic_cast<MoveWide *>(inst)->rd ==
+                       dynamic_cast<MoveWide *>(last)->rd;
+            if (inst->cond.type != Cond::AL && last->cond.type != Cond::AL)
+                glue = true;
+        }
+        if (!glue)
+            nodes.emplace_back();
+        nodes.back().Add(std::move(*it), model);
+    }
+    bb.insts.erase(begin, end);
+
+    BuildDag();
+    if (DbgEnabled(DbgScheduleDag))
+        DumpDag();
+    std::vector<int> origin(nodes.size());
+    for (int i = 0; i < nodes.size(); i++)
+        origin[i] = i;
+    auto order = ListSchedule(live_in, live_out);
+    assert(order.size() == nodes.size());
+    std::pair<int, int> cycles{Estimate(origin), Estimate(order)};
+    for (int i : order)
+        for (auto &inst : nodes[i].insts)
+            bb.insts.insert(end, std::move(inst));
+    return cycles;
+}
+
+} // namespace
+
+// 以调用、跳转与标签为界划分区域, 在区域内按依赖关系重新排列指令;
+// 分配前读写物理寄存器的指令同样作为边界
+void Func::Schedule(const PipelineModel &model, int max_pressure) {
+    bool pre_ra = max_pressure != INT_MAX;
+    std::unique_ptr<LiveAnalysis> live;
+    if (pre_ra) {
+        live = std::make_unique<LiveAnalysis>(*this);
+        live->Run();
+    }
+
+    Scheduler scheduler(model, max_pressure);
+    for (auto &bb : bbs)
+        for (auto &inst : bb->insts) {
+            auto mov = dynamic_cast<MOV *>(inst.get());
+            if (pre_ra && mov && mov->op == Instr::kMOV &&
+                !(mov->flags & Instr::kFlagBIsImm) &&
+                LiveAnalysis::IsVReg(mov->rd) &&
+                LiveAnalysis::IsVReg(mov->src.r))
+                scheduler.copies.insert({mov->src.r, mov->rd});
+        }
+    int before = 0, after = 0;
+    for (auto &bb : bbs) {
+        using instr_iter = builder::instr_iter;
+        std::vector<std::pair<instr_iter, instr_iter>> regions;
+        auto begin = bb->insts.begin();
+        int size = 0;
+        for (auto it = bb->insts.begin(); it != bb->insts.end(); it++) {
+            if (IsBarrier(it->get()) || (pre_ra && UsesPhyReg(it->get()))) {
+                if (it != begin)
+                    regions.push_back({begin, it});
+                begin = std::next(it);
+                size = 0;
+            } else if (++size == kMaxRegionSize) {
+                regions.push_back({begin, std::next(it)});
+                begin = std::next(it);
+                size = 0;
+            }
+        }
+        if (begin != bb->insts.end())
+            regions.push_back({begin, bb->insts.end()});
+
+        // 由块出口向前求各区域出入口活跃的虚拟寄存器
+        std::vector<std::pair<std::set<Reg>, std::set<Reg>>> lives(
+            regions.size());
+        if (pre_ra) {
+            std::set<Reg> cur;
+            live->liveout[bb->id].ForEach(
+                [&](int i) { cur.insert(LiveAnalysis::IdxVReg(i)); });
+            auto region = regions.rbegin();
+            int idx = (int)regions.size() - 1;
+            for (auto it = bb->insts.rbegin(); it != bb->insts.rend(); it++) {
+                if (region != regions.rend() && it.base() == region->second)
+                    lives[idx].second = cur;
+                for (auto r : (*it)->WRegs())
+                    cur.erase(*r);
+                for (auto r : (*it)->RRegs())
+                    if (LiveAnalysis::IsVReg(*r))
+                        cur.insert(*r);
+                if (region != regions.rend() &&
+                    std::prev(it.base()) == region->first) {
+                    lives[idx--].first = cur;
+                    region++;
+                }
+            }
+        }
+
+        for (int i = 0; i < regions.size(); i++) {
+            auto [b, a] = scheduler.Run(*bb, regions[i].first,
+                                        regions[i].second, lives[i].first,
+                                        lives[i].second);
+            before += b;
+            after += a;
+        }
+    }
+    if (DbgEnabled(DbgSchedule))
+        std::cerr << "schedule " << name << (pre_ra ? " (pre-ra)" : "")
+                  << ": " << before << " -> " << after << " cycles\n";
+}
+
+} // namespace backend
@@ -7,4 +7,15 @@ void EnableDbg(std::string name) { dbg_map[name] = true; }
 
 void DisableDbg(std::string name) { dbg_map[name] = false; }
 
-bool DbgEnabled(std::string name) { return dbg_map[name]; }
\ No newline at end of file
+// 只读查找, 代码生成线程可并发调用
+bool DbgEnabled(std::string name) {
+    auto it = dbg_map.find(name);
+    return it != dbg_map.end() && it->second;
+}
+
+bool DbgAnyEnabled() {
+    for (auto &kv : dbg_map)
+        if (kv.second)
+            return true;
+    return false;
+}
\ No newline at end of file
@@ -8,7 +8,11 @@
 #include <list>
 #include <queue>
 #include <set>
+#include <map>
 #include <algorithm>
+#include <cstdint>
+#include <climits>
+#include <cstdio>
 
 namespace backend {
 
@@ -51,7 +55,7 @@ struct Cond { // 条件执行
 struct Shift { // 桶形移位器
     int type;
     int imm;
-    enum { kLSL };
+    enum { kLSL, kLSR, kASR };
 
     std::string str() const;
 };
@@ -100,6 +104,18 @@ struct Address { // 地址偏移
         mode = kMBase;
         this->base = base;
     }
+    Address(Reg base, Word imm) : Address(base) { // [base, #imm]
+        if (imm != 0) {
+            mode = kMBaseImm;
+            offset.imm = imm;
+        }
+    }
+    Address(Reg base, Reg index, int shift) : Address(base) {
+        // [base, index, LSL #shift]
+        mode = shift ? kMBaseRegShift : kMBaseReg;
+        offset.reg = index;
+        offset.shift = Shift{Shift::kLSL, shift};
+    }
     Address(std::string label) {
         mode = KMLabel;
         this->label = label;
@@ -123,10 +139,36 @@ struct Define {
 
     Define() { is_const = false; }
     std::string str();
+    std::vector<Word> Words(); // 初始值按字展开
 };
 
 /*************************** basic ********************************/
 
+/*************************** target ********************************/
+struct TargetProfile { // 目标寄存器配置
+    std::string name;
+    std::vector<Reg> alloc_regs; // 参与分配的寄存器, 靠前的优先使用
+    Reg scratch_regs[2];         // 溢出变量的临时寄存器, 不参与分配
+};
+extern const std::vector<TargetProfile> target_profiles; // 第一项为默认配置
+const TargetProfile *GetTargetProfile(std::string name);
+
+struct Instr;
+struct PipelineModel { // 顺序发射流水线的指令延迟, 单位为周期
+    std::string name;
+    int alu;       // 数据处理指令
+    int alu_shift; // 第二操作数带移位
+    int mul;       // MUL
+    int mul_high;  // SMMUL
+    int div;       // SDIV / UDIV
+    int load;      // LDR / LDRD, 到结果可用为止
+
+    int Latency(Instr *inst) const;
+};
+extern const std::vector<PipelineModel> pipeline_models; // 第一项为默认配置
+const PipelineModel *GetPipelineModel(std::string name);
+/*************************** target ********************************/
+
 /*************************** Inst ********************************/
 struct Line {
     virtual std::string str() const = 0;
@@ -161,19 +203,25 @@ struct ImmArray : public Line { // 立即数块
 struct Instr : public Line {
     int op;
     int flags;
+    Cond cond; // 条件执行, 输出时由 IT 块包裹
     Comment cmt;
 
     enum { // 列举指令集
         kLDR,
         kSTR,
+        kLDRD,
+        kSTRD,
         kPUSH,
         kPOP,
         kADR,
         kB,
         kBL,
+        kBX,
         kADD,
         kSUB,
+        kRSB,
         kMUL,
+        kSMMUL, // 有符号乘积的高 32 位
         kSDIV,
         kUDIV,
         kAND,
@@ -181,11 +229,16 @@ struct Instr : public Line {
         kADC,
         kLSL,
         kLSR,
+        kASR,
         kMOV,
+        kMVN,
+        kMOVW,
+        kMOVT,
         kNEG,
         kCMP,
         kCall,
         kLabel,
+        kIT,
     };
 
     enum { // 指令标识
@@ -240,8 +293,42 @@ struct STR : public Instr {
         return "STR " + Reg2Str(rd) + ", " + addr.str();
     }
 
+    virtual std::vector<Reg *> RRegs() { // 存储的值同样是被读取的寄存器
+        auto res = addr.RRegs();
+        res.push_back(&rd);
+        return res;
+    }
+};
+
+// 双字访存: rd 对应 addr, rd2 对应 addr + 4
+struct LDRD : public Instr {
+    Reg rd, rd2;
+    Address addr;
+    LDRD() : Instr(kLDRD) {}
+
+    virtual std::string str() const {
+        return "LDRD " + Reg2Str(rd) + ", " + Reg2Str(rd2) + ", " + addr.str();
+    }
+
     virtual std::vector<Reg *> RRegs() { return addr.RRegs(); }
-    virtual std::vector<Reg *> WRegs() { return make_regs(rd); }
+    virtual std::vector<Reg *> WRegs() { return {&rd, &rd2}; };
+};
+
+struct STRD : public Instr {
+    Reg rd, rd2;
+    Address addr;
+    STRD() : Instr(kSTRD) {}
+
+    virtual std::string str() const {
+        return "STRD " + Reg2Str(rd) + ", " + Reg2Str(rd2) + ", " + addr.str();
+    }
+
+    virtual std::vector<Reg *> RRegs() {
+        auto res = addr.RRegs();
+        res.push_back(&rd);
+        res.push_back(&rd2);
+        return res;
+    }
 };
 
 struct Branch : public Instr {
@@ -260,11 +347,9 @@ struct PUSH : public Instr {
     PUSH() : Instr(kPUSH) {}
 
     virtual std::string str() const {
-        std::string s = "PUSH ";
-        bool need_brace = regs.size() > 1;
+        std::string s = "PUSH {";
         if (range.first != range.second) {
-            need_brace = true;
-            s += '{' + Reg2Str(range.first) + "-" + Reg2Str(range.second);
+            s += Reg2Str(range.first) + "-" + Reg2Str(range.second);
             if (regs.size() > 0)
                 s += ", ";
         }
@@ -275,9 +360,7 @@ struct PUSH : public Instr {
             s += Reg2Str(r);
             is_first = false;
         }
-        if (need_brace)
-            s += '}';
-        return s;
+        return s + '}';
     }
 
     virtual std::vector<Reg *> RRegs() {
@@ -294,11 +377,9 @@ struct POP : public Instr {
     POP() : Instr(kPOP) {}
 
     virtual std::string str() const {
-        std::string s = "POP ";
-        bool need_brace = regs.size() > 1;
+        std::string s = "POP {";
         if (range.first != range.second) {
-            need_brace = true;
-            s += '{' + Reg2Str(range.first) + "-" + Reg2Str(range.second);
+            s += Reg2Str(range.first) + "-" + Reg2Str(range.second);
             if (regs.size() > 0)
                 s += ", ";
         }
@@ -309,9 +390,7 @@ struct POP : public Instr {
             s += Reg2Str(r);
             is_first = false;
         }
-        if (need_brace)
-            s += '}';
-        return s;
+        return s + '}';
     }
 
     virtual std::vector<Reg *> WRegs() {
@@ -372,6 +451,14 @@ struct BranchLink : public Instr {
     virtual std::string str() const { return "BL " + label; }
 };
 
+struct BranchExchange : public Instr {
+    Reg r;
+    BranchExchange(Reg r) : Instr(kBX), r(r) {}
+
+    virtual std::string str() const { return "BX " + Reg2Str(r); }
+    virtual std::vector<Reg *> RRegs() { return make_regs(r); }
+};
+
 struct BinaryAlu : public Instr {
     Reg rd, a;
     RegImmU b;
@@ -380,18 +467,20 @@ struct BinaryAlu : public Instr {
     BinaryAlu(int op) : Instr(op) {}
 
     std::string OpStr() const {
-        static std::string m[]{"ADD", "SUB", "MUL", "SDIV", "UDIV",
-                               "AND", "OR",  "ADC", "LSL",  "LSR"};
+        static std::string m[]{"ADD", "SUB", "RSB", "MUL", "SMMUL",
+                               "SDIV", "UDIV", "AND", "OR", "ADC",
+                               "LSL", "LSR", "ASR"};
         return m[op - kADD];
     }
 
     bool IsCommutative() {
-        return op == kADD || op == kMUL || op == kAND || op == kOR;
+        return op == kADD || op == kMUL || op == kSMMUL || op == kAND ||
+               op == kOR;
     }
 
     virtual std::string str() const {
-        std::string s = OpStr() + " " + Reg2Str(rd) + ", " + Reg2Str(a) + ", " +
-                        RegImmU2Str(b, flags);
+        std::string s = OpStr() + cond.str() + " " + Reg2Str(rd) + ", " +
+                        Reg2Str(a) + ", " + RegImmU2Str(b, flags);
         if (flags & kFlagHasShift) {
             s += ", " + shift.str();
         }
@@ -404,6 +493,8 @@ struct BinaryAlu : public Instr {
         res.push_back(&a);
         if (!(flags & kFlagBIsImm))
             res.push_back(&b.r);
+        if (cond.type != Cond::AL) // 条件不满足时保留原值
+            res.push_back(&rd);
         return res;
     }
     virtual std::vector<Reg *> WRegs() { return make_regs(rd); };
@@ -413,19 +504,48 @@ struct MOV : public Instr {
     Reg rd;
     RegImmU src;
     MOV() : Instr(kMOV) {}
-    MOV(Reg rd, Reg r) : rd(rd) { src.r = r; }
-    MOV(Reg rd, Word imm) : rd(rd) {
+    MOV(Reg rd, Reg r) : Instr(kMOV), rd(rd) { src.r = r; }
+    MOV(Reg rd, Word imm) : Instr(kMOV), rd(rd) {
         flags |= kFlagBIsImm;
         src.imm = imm;
     }
 
     virtual std::string str() const {
-        return "MOV " + Reg2Str(rd) + ", " + RegImmU2Str(src, flags);
+        return (op == kMVN ? "MVN" : "MOV") + cond.str() + " " + Reg2Str(rd) +
+               ", " + RegImmU2Str(src, flags);
     }
 
     virtual std::vector<Reg *> RRegs() {
+        std::vector<Reg *> res;
         if (!(flags & kFlagBIsImm))
-            return make_regs(src.r);
+            res.push_back(&src.r);
+        if (cond.type != Cond::AL) // 条件不满足时保留原值
+            res.push_back(&rd);
+        return res;
+    }
+    virtual std::vector<Reg *> WRegs() { return make_regs(rd); };
+};
+
+// MOVW 写低 16 位并清零高位, MOVT 写高 16 位并保留低位
+struct MoveWide : public Instr {
+    Reg rd;
+    Word imm;
+    std::string label; // 非空时取符号地址的对应部分
+    MoveWide(int op, Reg rd, Word imm) : Instr(op), rd(rd), imm(imm) {}
+    MoveWide(int op, Reg rd, std::string label)
+        : Instr(op), rd(rd), imm(0), label(label) {}
+
+    virtual std::string str() const {
+        std::string s = (op == kMOVW ? "MOVW" : "MOVT") + cond.str() + " " +
+                        Reg2Str(rd) + ", #";
+        if (label.empty())
+            return s + std::to_string(imm);
+        return s + (op == kMOVW ? ":lower16:" : ":upper16:") + label;
+    }
+
+    virtual std::vector<Reg *> RRegs() {
+        if (op == kMOVT || cond.type != Cond::AL)
+            return make_regs(rd);
         return {};
     }
     virtual std::vector<Reg *> WRegs() { return make_regs(rd); };
@@ -470,6 +590,15 @@ struct LabelInstr : public Instr {
     virtual std::string str() const { return label + ":"; }
 };
 
+// 其后至多 4 条条件执行指令, mask 为第 2-4 条的 T (同 first) 或 E (相反)
+struct IT : public Instr {
+    Cond first;
+    std::string mask;
+    IT(Cond first, std::string mask) : Instr(kIT), first(first), mask(mask) {}
+
+    virtual std::string str() const { return "IT" + mask + " " + first.str(); }
+};
+
 /*************************** Inst ********************************/
 
 /*************************** Func ********************************/
@@ -480,7 +609,8 @@ struct BB {
     std::vector<BB *> succs;                 // 后继
     std::vector<BB *> preds;                 // 前驱
     int id;                                  // 基本块编号
-    ir::BB *ir_bb;                           // 对应的IR基本块
+    int loop_depth = 0;                      // 循环嵌套深度
+    ir::BB *ir_bb = nullptr;                 // 对应的IR基本块
 
     void dump(std::ostream &os);
     void SetBranch(Cond cond, std::string label); // 根据条件标识更新跳转分支
@@ -489,42 +619,51 @@ struct BB {
 struct StackFrame { // to do
     // stack layout
     // sp ----
-    //    call arguments reserve area
+    //    call arguments reserve area (a4, a5, ...)
     //    ----
-    //    backup r0-r4
+    //    backup r0-r3, r12 (仅在调用处需要备份时保留)
     // r7 ----
     //    local variable area
     //    ---
-    //    rx - r7
-    //    lr
+    //    saved regs (函数实际改写的寄存器, 可能为空)
     // --- prev_sp ---
     //    function arguments spilled
     // ---
 
-    int max_call_arg_count; // 传递参数个数
-    int local_var_size;     // 局部变量个数
-    int saved_reg_count;    // 存储
-    int spilled_arg_count;  // 溢出
+    int max_call_arg_count;      // 传递参数个数
+    int local_var_size;          // 局部变量个数
+    int spilled_arg_count;       // 溢出
+    bool has_call;               // 是否调用其他函数
+    bool need_backup;            // 调用处需要备份寄存器
+    std::vector<Reg> saved_regs; // 入口处保存的寄存器, 升序
 
     const static int max_reg_arg_count = 4;    // 比赛最大传参 4
+    const static int backup_reg_count = 5;     // 调用前备份 r0-r3, r12
     const static Reg local_var_base = Reg::R7; //
 
     StackFrame() {
         max_call_arg_count = 0;
         local_var_size = 0;
-        saved_reg_count = 0;
         spilled_arg_count = 0;
+        has_call = false;
+        need_backup = false;
     }
 
     void Dump(std::ostream &os);
 
     // sp +
-    inline int LocalVarBaseOffset() {
-        return (max_call_arg_count + max_reg_arg_count) * 4;
+    inline int CallArgSize() {
+        return std::max(max_call_arg_count - max_reg_arg_count, 0) * 4;
     }
+    inline int BackupSize() { return need_backup ? backup_reg_count * 4 : 0; }
+    inline int LocalVarBaseOffset() { return CallArgSize() + BackupSize(); }
     inline int AllocaSize() { return LocalVarBaseOffset() + local_var_size; }
     inline int Size() { return AllocaSize() + SaveRegSize(); }
-    inline int SaveRegSize() { return 9 * 4; }
+    inline int SaveRegSize() { return saved_regs.size() * 4; }
+    // 局部变量或栈上参数需要通过 r7 访问
+    inline bool NeedLocalVarBase() {
+        return local_var_size > 0 || spilled_arg_count > 0;
+    }
 
     // align to high address
     inline int AlignHigh(int offset, int alignment);
@@ -536,7 +675,7 @@ struct StackFrame { // to do
     // r7 +
     inline int SpilledArgOffset();
 
-    // r7 +
+    // r7 +, 仅用于栈上传递的参数
     int ArgOffset(int idx);
     Address ArgAddr(int idx);
 };
@@ -545,7 +684,6 @@ struct Func {
     std::string name;                          // 函数名
     BB entry, end;                             // 函数入口，出口
     std::vector<std::unique_ptr<BB>> bbs;      // 函数基本块
-    std::map<Word, std::unique_ptr<Imm>> imms; // 函数常量
     Comment cmt;                               // 注释
     std::vector<Reg> args;                     // 参数
     bool has_ret;                              // 返回值标识
@@ -560,12 +698,156 @@ struct Func {
     }
 
     void dump(std::ostream &os);
-    std::string CreateIntImm(Word v); // 创建常量
     Reg AllocaVReg();                 // 分配一个新的寄存器
     void ResetBBID();                 // 为标准块重新编号
+    void ComputeLoopDepth();          // 计算基本块的循环嵌套深度
+    void IfConvert();                 // 将小的菱形分支转为条件执行
+    void LayoutBlocks();              // 基本块布局, 尽量顺序执行并修正跳转
+    void InsertITBlocks();            // 为条件执行指令插入 IT, 分配后调用
+    void Peephole();                  // 分配后的窥孔优化
+    // 基本块内的表调度; 分配前调用时活跃的虚拟寄存器数不超过 max_pressure
+    void Schedule(const PipelineModel &model, int max_pressure = INT_MAX);
 };
 /*************************** Func ********************************/
 
+/*************************** liveness ********************************/
+struct BitSet { // 位向量
+    std::vector<uint64_t> bits;
+
+    BitSet(int n = 0) : bits((n + 63) / 64, 0) {}
+
+    inline void Set(int i) { bits[i >> 6] |= (uint64_t)1 << (i & 63); }
+    inline void Reset(int i) { bits[i >> 6] &= ~((uint64_t)1 << (i & 63)); }
+    inline bool Test(int i) const {
+        return (bits[i >> 6] >> (i & 63)) & 1;
+    }
+
+    // this |= o, 返回是否发生变化
+    bool Union(const BitSet &o) {
+        bool changed = false;
+        for (int i = 0; i < bits.size(); i++) {
+            uint64_t v = bits[i] | o.bits[i];
+            changed |= v != bits[i];
+            bits[i] = v;
+        }
+        return changed;
+    }
+
+    // this &= ~o
+    void Subtract(const BitSet &o) {
+        for (int i = 0; i < bits.size(); i++)
+            bits[i] &= ~o.bits[i];
+    }
+
+    template <typename F> void ForEach(F f) const {
+        for (int i = 0; i < bits.size(); i++)
+            for (uint64_t v = bits[i]; v; v &= v - 1)
+                f(i * 64 + __builtin_ctzll(v));
+    }
+
+    friend bool operator==(const BitSet &a, const BitSet &b) {
+        return a.bits == b.bits;
+    }
+    friend bool operator!=(const BitSet &a, const BitSet &b) {
+        return !(a == b);
+    }
+};
+
+struct LiveAnalysis { // 基本块级活跃变量分析（虚拟寄存器）
+    Func &func;
+    int vreg_count;
+    std::vector<BB *> order; // 逆后序, 不可达块追加在末尾
+    // 以 BB::id 为下标
+    std::vector<BitSet> uses, defs, livein, liveout;
+
+    LiveAnalysis(Func &f);
+
+    void Run();
+    void Dump(std::ostream &os);
+
+    static inline bool IsVReg(Reg r) { return r >= Reg::VREG; }
+    static inline int VRegIdx(Reg r) { return (int)r - (int)Reg::VREG; }
+    static inline Reg IdxVReg(int i) { return (Reg)(i + (int)Reg::VREG); }
+
+  private:
+    void ComputeOrder();
+    void ComputeLocal();
+};
+/*************************** liveness ********************************/
+
+/*************************** graph coloring ********************************/
+// 迭代寄存器合并 (Iterated Register Coalescing, George & Appel)
+// 结点为虚拟寄存器, 未着色的结点溢出到栈上, 由重写阶段通过临时寄存器访问
+struct GraphColoring {
+    Func &func;
+    LiveAnalysis &live;
+    int k;                   // 可用的颜色数
+    std::vector<Reg> params; // 在函数入口同时定值的参数, 两两冲突
+    std::set<Reg> excluded;  // 不参与着色的结点 (栈上传递的参数)
+    std::vector<bool> caller_saved; // 颜色对应调用方保存的寄存器
+    std::set<Reg> remat;            // 可重新计算的结点, 溢出代价较低
+
+    GraphColoring(Func &f, LiveAnalysis &live, int k);
+
+    void Run();
+    Reg GetAlias(Reg r);   // 合并后的代表结点
+    int GetColor(Reg r);   // 颜色为可分配寄存器的下标, -1 表示溢出
+    bool InGraph(Reg r);   // 出现在函数中且参与着色
+    bool Interfere(Reg a, Reg b);
+    void Dump(std::ostream &os);
+
+  private:
+    enum {
+        kInitial,
+        kSimplify,
+        kFreeze,
+        kSpill,
+        kSpilled,
+        kCoalesced,
+        kColored,
+        kSelect,
+    };
+    enum { kMWorklist, kMActive, kMCoalesced, kMConstrained, kMFrozen };
+    struct MoveInfo {
+        int dst, src, state;
+    };
+
+    int n;
+    std::vector<bool> in_graph;
+    std::vector<BitSet> adj_set;
+    std::vector<BitSet> class_adj; // 合并结点之间的冲突, 着色后按需构造
+    std::vector<std::vector<int>> adj_list;
+    std::vector<int> degree, alias, color, state;
+    std::vector<double> cost; // 溢出代价, 按循环深度加权
+    std::vector<bool> cross_call; // 在某个调用之后仍然活跃
+    std::vector<MoveInfo> moves;
+    std::vector<std::vector<int>> move_list;
+    std::set<int> simplify_wl, freeze_wl, spill_wl, worklist_moves,
+        active_moves;
+    std::vector<int> select_stack;
+
+    void AddEdge(int u, int v);
+    void Build();
+    void MakeWorklist();
+    std::vector<int> Adjacent(int x);
+    std::vector<int> NodeMoves(int x);
+    bool MoveRelated(int x);
+    void SetState(int x, int s);
+    void Simplify();
+    void DecrementDegree(int x);
+    void EnableMoves(int x);
+    void Coalesce();
+    void AddWorkList(int x);
+    bool Conservative(int u, int v);
+    int Alias(int x);
+    void Combine(int u, int v);
+    void Freeze();
+    void FreezeMoves(int u);
+    void SelectSpill();
+    void AssignColors();
+};
+/*************************** graph coloring ********************************/
+
 /*************************** builder ********************************/
 namespace builder {
 using instr_list = std::list<std::unique_ptr<Instr>>;
@@ -574,19 +856,35 @@ void Load(instr_list &insts, instr_iter it, Reg rd, Address addr,
           bool eq_addr = false);
 void LAddr(instr_list &insts, instr_iter it, Reg rd, std::string label);
 void Store(instr_list &insts, instr_iter it, Reg rd, Address addr);
+void LoadPair(instr_list &insts, instr_iter it, Reg rd, Reg rd2, Address addr);
+void StorePair(instr_list &insts, instr_iter it, Reg rd, Reg rd2,
+               Address addr);
 void Push(instr_list &insts, instr_iter it, Reg r);
 void Push(instr_list &insts, instr_iter it, Reg from, Reg to, Reg r);
+void Push(instr_list &insts, instr_iter it, Reg from, Reg to,
+          std::vector<Reg> regs);
+void Push(instr_list &insts, instr_iter it, std::vector<Reg> regs);
 void Pop(instr_list &insts, instr_iter it, Reg r);
 void Pop(instr_list &insts, instr_iter it, Reg from, Reg to, Reg r);
+void Pop(instr_list &insts, instr_iter it, Reg from, Reg to,
+         std::vector<Reg> regs);
+void Pop(instr_list &insts, instr_iter it, std::vector<Reg> regs);
 void Branch(instr_list &insts, instr_iter it, std::string label);
 void Branch(instr_list &insts, instr_iter it, Cond cond, std::string label);
 void Call(instr_list &insts, instr_iter it, std::string func,
           std::vector<Reg> args, Reg ret = Reg::INVALID);
 void BranchLink(instr_list &insts, instr_iter it, std::string func);
+void BranchExchange(instr_list &insts, instr_iter it, Reg r);
 void BinaryAlu(instr_list &insts, instr_iter it, int op, Reg rd, Reg a, Reg b);
 void BinaryAlu(instr_list &insts, instr_iter it, int op, Reg rd, Reg a, Word b);
 void Move(instr_list &insts, instr_iter it, Reg rd, Reg rs);
 void Move(instr_list &insts, instr_iter it, Reg rd, Word imm);
+void MoveWide(instr_list &insts, instr_iter it, int op, Reg rd, Word imm);
+void MoveWide(instr_list &insts, instr_iter it, int op, Reg rd,
+              std::string label);
+bool IsModImm(Word imm); // Thumb-2 修正立即数
+void LoadImm(instr_list &insts, instr_iter it, Reg rd, Word imm);
+void LoadAddr(instr_list &insts, instr_iter it, Reg rd, std::string label);
 void Cmp(instr_list &insts, instr_iter it, Reg a, Reg b);
 void Cmp(instr_list &insts, instr_iter it, Reg a, Word b);
 void Label(instr_list &insts, instr_iter it, std::string label);
@@ -629,11 +927,102 @@ struct Asm { // 由若干函数组成
 
 /*************************** Asm ********************************/
 
+enum RegAllocaAlgo { // 寄存器分配算法
+    kLinearScan,
+    kGraphColoring,
+};
+
 // emit_asm  = 1  不输出  “0 size : ty ....” 部分
+// pipeline 为空时不做指令调度
+// jobs 为并行处理函数的线程数, 输出顺序与 jobs 无关
 void IrToAsm(ir::Module &m, Asm &_asm, bool disable_ra = false,
-             bool emit_asm = true);
+             bool emit_asm = true, int ra_algo = kLinearScan,
+             const TargetProfile &profile = target_profiles[0],
+             const PipelineModel *pipeline = &pipeline_models[0],
+             int jobs = 1);
+void InstrSelectDefs(ir::Module &m, Asm &_asm);
+void InstrSelect(ir::Func &f, Func &func);
 void InstrSelect(ir::Module &m, Asm &_asm);
-void RegAlloca(Asm &_asm);
+void RegAlloca(Func &f, int algo = kLinearScan,
+               const TargetProfile &profile = target_profiles[0]);
+void RegAlloca(Asm &_asm, int algo = kLinearScan,
+               const TargetProfile &profile = target_profiles[0]);
+
+/*************************** object ********************************/
+// Thumb-2 指令编码, 除 IT / BX / 寄存器间 MOV 外一律使用 32 位编码
+struct ThumbEncoder {
+    enum { // 待回填的字段
+        kFixJump,     // B.W label
+        kFixCondJump, // B<c>.W label
+        kFixCall,     // BL label
+        kFixMovw,     // MOVW rd, #:lower16:label
+        kFixMovt,     // MOVT rd, #:upper16:label
+        kFixAdr,      // ADR.W rd, label
+    };
+    struct Fixup {
+        int offset; // 指令在 text 中的偏移
+        int type;
+        std::string label;
+    };
+
+    std::vector<uint8_t> text;
+    std::map<std::string, int> labels; // 标签在 text 中的偏移
+    std::vector<Fixup> fixups;
+
+    void Emit(Instr *inst);
+    void EmitFunc(Func &f);
+    void Label(std::string label);
+    // 回填已定义标签的跳转, 返回需要由链接器重定位的部分
+    std::vector<Fixup> Resolve();
+
+  private:
+    void Emit16(int hw);
+    void Emit32(int hw1, int hw2);
+    void Fix(int type, std::string label);
+    void DpImm(int op, bool s, int rd, int rn, Word imm);
+    void DpReg(int op, bool s, int rd, int rn, int rm, Shift shift);
+    void MoveWide(bool top, int rd, Word imm);
+    void LoadStore(bool load, int rt, const Address &addr);
+    void LoadStorePair(bool load, int rt, int rt2, const Address &addr);
+};
+
+// 直接输出 ELF32 可重定位目标文件, 不经过汇编器
+void EmitObject(Asm &_asm, std::ostream &os);
+/*************************** object ********************************/
+
+/*************************** writer ********************************/
+// 汇编文本输出: 直接写入缓冲区, 满时整块 fwrite, 不构造中间字符串;
+// 格式与 dump 相同, str() / dump 仅用于调试
+struct AsmWriter {
+    explicit AsmWriter(FILE *fp) : fp(fp) {}
+    ~AsmWriter() { Flush(); }
+
+    void Write(Asm &_asm);
+    void Write(Func &f);
+    void Write(BB &bb);
+    void Write(Instr *inst);
+    void Flush();
+
+  private:
+    static const int kBufSize = 1 << 16;
+    FILE *fp;
+    char buf[kBufSize];
+    int len = 0;
+
+    void Put(char c);
+    void Put(const char *s, int n);
+    void Put(const char *s);
+    void Put(const std::string &s) { Put(s.data(), s.size()); }
+    void PutNum(long long x);
+    void PutReg(Reg r);
+    void PutRegImm(RegImmU x, int flags);
+    void PutShift(const Shift &shift);
+    void PutAddr(const Address &addr);
+    void PutRegList(const std::pair<Reg, Reg> &range,
+                    const std::vector<Reg> &regs);
+    void PutDefs(Asm &_asm, bool is_const);
+};
+/*************************** writer ********************************/
 
 } // namespace backend
 
@@ -6,5 +6,6 @@
 void EnableDbg(std::string name);
 void DisableDbg(std::string name);
 bool DbgEnabled(std::string name);
+bool DbgAnyEnabled();
 
 #endif
@@ -19,10 +19,56 @@ Node &GetNode(ir::BB *bb);
 ir::BB *IDom(ir::BB *bb);
 } // namespace dtree
 
+namespace loop {
+struct Loop {
+    ir::BB *header;
+    Loop *parent = nullptr;
+    std::vector<Loop *> children;
+    std::vector<ir::BB *> blocks;  // header first, nested loops included
+    std::vector<ir::BB *> latches; // sources of the back edges
+    std::vector<ir::BB *> exits;   // blocks outside with a pred inside
+    ir::BB *preheader = nullptr;   // single outside pred jumping only here
+    int depth;
+
+    bool Contains(ir::BB *bb) const;
+};
+
+bool HasLoopInfo(ir::BB *bb);
+Loop *GetLoop(ir::BB *bb); // innermost loop, nullptr outside loops
+int Depth(ir::BB *bb);
+std::vector<Loop *> TopLevel(ir::Func &f);
+} // namespace loop
+
+// CFG edits keeping BB::predecessors / successors and phis in sync
+void RemoveEdge(ir::BB *from, ir::BB *to);
+void FoldConstBranches(ir::Func &func); // br i1 <imm> -> br label
+void RemoveUnreachableBBs(ir::Func &func);
+
+// pointers derived from distinct allocas / globals do not alias
+struct AliasInfo {
+    std::map<ir::Value *, ir::Value *> derived; // gep / bitcast -> operand
+    std::set<ir::Value *> allocas;
+
+    explicit AliasInfo(ir::Func &func);
+    ir::Value *Base(ir::Value *ptr);
+    bool IsObject(ir::Value *base); // an alloca or a global
+    bool MayAlias(ir::Value *a, ir::Value *b);
+};
+
+// constant folding, return false if the result is undefined
+bool EvalBinaryAlu(int op, int l, int r, int &res);
+bool EvalIcmp(int cond, int l, int r);
+
 void ConstantOpt(ir::Module &m);
 void InitBBPtr(ir::Module &m);
 void BuildDTree(ir::Module &m);
+void BuildLoopInfo(ir::Module &m);
 void Mem2Reg(ir::Module &m);
+void DeadCodeElim(ir::Module &m);
+void SCCP(ir::Module &m);
+void GVN(ir::Module &m);
+void LICM(ir::Module &m);
+void StrengthReduce(ir::Module &m);
 
 namespace mgr {
 typedef void (*OptModuleEntry)(ir::Module &);
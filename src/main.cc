@@ -6,6 +6,7 @@
 #include <fstream>
 #include <getopt.h>
 #include <iostream>
+#include <thread>
 #include <unistd.h>
 
 enum Option {
@@ -14,10 +15,15 @@ enum Option {
     DBG,
     OPT,
     ENABLE_ALL_OPT,
+    RA,
+    TARGET,
+    SCHED,
 };
 
 int emit_ir = 0, use_clang = 0, list_opt = 0, enable_all_opt = 0, g_verbose = 0,
-    emit_asm = 0, disable_ra = 0, disable_backend = 0, opt_level = 0;
+    emit_asm = 0, emit_obj = 0, integrated_as = 0, disable_ra = 0,
+    disable_backend = 0, opt_level = 0, ra_algo = backend::kLinearScan,
+    jobs = 1;
 static struct option long_options[] = {
     {"help", no_argument, nullptr, 'h'},
     {"func", required_argument, nullptr, 'f'},
@@ -32,9 +38,15 @@ static struct option long_options[] = {
     {"verbose", no_argument, nullptr, 'v'},
     {"emit-asm", no_argument, &emit_asm, 1},
     {"asm", required_argument, nullptr, 'o'},
+    {"emit-obj", no_argument, &emit_obj, 1},
+    {"integrated-as", no_argument, &integrated_as, 1},
     {"as", required_argument, nullptr, AS},
     {"ld", required_argument, nullptr, LD},
     {"disable-ra", no_argument, &disable_ra, 1},
+    {"ra", required_argument, nullptr, RA},
+    {"target", required_argument, nullptr, TARGET},
+    {"sched", required_argument, nullptr, SCHED},
+    {"jobs", required_argument, nullptr, 'j'},
     {"disable-backend", no_argument, &disable_backend, 1},
     {"dbg", required_argument, nullptr, DBG},
     {"opt-level", required_argument, nullptr, 'O'},
@@ -54,6 +66,14 @@ void help() {
                 fprintf(stderr, " function] ");
             } else if (IS("ir")) {
                 fprintf(stderr, " ir_output_file] ");
+            } else if (IS("ra")) {
+                fprintf(stderr, " linear|color] ");
+            } else if (IS("target")) {
+                fprintf(stderr, " thumb2|thumb] ");
+            } else if (IS("sched")) {
+                fprintf(stderr, " cortex-a7|cortex-a53|none] ");
+            } else if (IS("jobs")) {
+                fprintf(stderr, " N] ");
             } else {
                 fprintf(stderr, " ...] ");
             }
@@ -72,21 +92,21 @@ int main(int argc, char *argv[]) {
     FILE *fout = nullptr, *fin = stdin;
     std::ofstream f_ir_out;
     std::ostream *ir_out = &std::cout;
-    std::ofstream f_asm_out;
-    std::ostream *asm_out = &std::cout;
     std::vector<std::string> opts;
     const char *func = nullptr;
+    const backend::TargetProfile *target = &backend::target_profiles[0];
+    const backend::PipelineModel *pipeline = &backend::pipeline_models[0];
     const char *as = "arm-linux-gnueabi-as -mthumb";
     const char *ld = "arm-linux-gnueabi-gcc -static";
     char buf[0x500];
     char tmp_asm_file_name[0x100];
-    std::ofstream tmp_asm_out;
-    int err;
+    char tmp_obj_file_name[0x100];
+    int err = 0;
     ast::CompUnit *comp_unit;
     ir::Module *m;
     backend::Asm code;
     int opt_idx;
-    while ((opt = getopt_long(argc, argv, "o:f:L:O:Sa:hv", long_options,
+    while ((opt = getopt_long(argc, argv, "o:f:L:O:Sa:hvj:", long_options,
                               &opt_idx)) != -1) {
         switch (opt) {
         case 0:
@@ -127,6 +147,36 @@ int main(int argc, char *argv[]) {
         case LD: {
             ld = strdup(optarg);
         } break;
+        case RA: {
+            if (!strcmp(optarg, "linear")) {
+                ra_algo = backend::kLinearScan;
+            } else if (!strcmp(optarg, "color")) {
+                ra_algo = backend::kGraphColoring;
+            } else {
+                fprintf(stderr, "unknown register allocator %s\n", optarg);
+                exit(1);
+            }
+        } break;
+        case TARGET: {
+            target = backend::GetTargetProfile(optarg);
+            if (!target) {
+                fprintf(stderr, "unknown target profile %s\n", optarg);
+                exit(1);
+            }
+        } break;
+        case SCHED: {
+            pipeline = backend::GetPipelineModel(optarg);
+            if (!pipeline && strcmp(optarg, "none")) {
+                fprintf(stderr, "unknown pipeline model %s\n", optarg);
+                exit(1);
+            }
+        } break;
+        case 'j': {
+            // 0 表示使用全部硬件线程
+            jobs = atoi(optarg);
+            if (jobs <= 0)
+                jobs = std::max((int)std::thread::hardware_concurrency(), 1);
+        } break;
         case DBG: {
             EnableDbg(std::string(strdup(optarg)));
         } break;
@@ -181,6 +231,11 @@ int main(int argc, char *argv[]) {
     for (auto opt : opts) {
         opt::mgr::RunOpt(opt, *m);
     }
+    if (!opts.empty()) {
+        // loop depth for spill weights and block layout in the backend
+        opt::mgr::RunOpt("init-bb-ptr", *m);
+        opt::BuildLoopInfo(*m);
+    }
     if (emit_ir) {
         m->dump(*ir_out);
     }
@@ -202,33 +257,53 @@ int main(int argc, char *argv[]) {
         goto _exit;
     }
 
-    backend::IrToAsm(*m, code, disable_ra, emit_asm);
+    backend::IrToAsm(*m, code, disable_ra, emit_asm || emit_obj, ra_algo,
+                     *target, pipeline, jobs);
     if (emit_asm) {
-        if (has_custom_output) {
-            f_asm_out.open(out_file_name);
-            asm_out = &f_asm_out;
+        FILE *asm_out = stdout;
+        if (has_custom_output && !(asm_out = fopen(out_file_name, "w"))) {
+            fprintf(stderr, "can not open %s for write\n", out_file_name);
+            return -1;
         }
-        code.dump(*asm_out);
+        backend::AsmWriter(asm_out).Write(code);
+        if (asm_out != stdout)
+            fclose(asm_out);
         goto _exit;
     }
 
     if (disable_ra)
         goto _exit;
 
-    snprintf(tmp_asm_file_name, 0x100 - 1, "/tmp/%d.s", rand());
-    tmp_asm_out.open(std::string(tmp_asm_file_name));
-    code.dump(tmp_asm_out);
-    tmp_asm_out.close();
-    snprintf(buf, 0x500 - 1, "%s -o '/tmp/tmp.out' '%s'", as,
-             tmp_asm_file_name);
-    err = WEXITSTATUS(system(buf));
-    unlink(tmp_asm_file_name);
-    if (err != 0)
+    if (emit_obj) {
+        std::ofstream obj_out(out_file_name, std::ios::binary);
+        if (!obj_out.is_open()) {
+            fprintf(stderr, "can not open %s for write\n", out_file_name);
+            return -1;
+        }
+        backend::EmitObject(code, obj_out);
         goto _exit;
-    snprintf(buf, 0x500 - 1, "%s -o '%s' '/tmp/tmp.out' '%s/libsysy.a'", ld,
-             out_file_name, lib_dir);
+    }
+
+    snprintf(tmp_obj_file_name, 0x100 - 1, "/tmp/%d.o", rand());
+    if (integrated_as) {
+        std::ofstream obj_out(tmp_obj_file_name, std::ios::binary);
+        backend::EmitObject(code, obj_out);
+    } else {
+        snprintf(tmp_asm_file_name, 0x100 - 1, "/tmp/%d.s", rand());
+        FILE *tmp_asm_out = fopen(tmp_asm_file_name, "w");
+        backend::AsmWriter(tmp_asm_out).Write(code);
+        fclose(tmp_asm_out);
+        snprintf(buf, 0x500 - 1, "%s -o '%s' '%s'", as, tmp_obj_file_name,
+                 tmp_asm_file_name);
+        err = WEXITSTATUS(system(buf));
+        unlink(tmp_asm_file_name);
+        if (err != 0)
+            goto _exit;
+    }
+    snprintf(buf, 0x500 - 1, "%s -o '%s' '%s' '%s/libsysy.a'", ld,
+             out_file_name, tmp_obj_file_name, lib_dir);
     err = WEXITSTATUS(system(buf));
-    unlink("/tmp/tmp.out");
+    unlink(tmp_obj_file_name);
 
 _exit:
     if (fout && fout != stdout)
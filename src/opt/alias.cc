@@ -0,0 +1,57 @@
+/**
+ * Alias Info
+ *  A pointer is derived from its base object through getelementptr and
+ *  bitcast. Distinct allocas and globals never overlap, and arguments or
+ *  loaded pointers may point into globals or the caller's frame but never
+ *  into an alloca of this function, since SysY can not take addresses.
+ * EG:
+ *      %1 = alloca [4 x i32]
+ *      %2 = getelementptr [4 x i32], [4 x i32]* %1, i32 0, i32 %i
+ *      %3 = bitcast [400 x i32]* @A to [20 x [20 x i32]]*
+ *      %4 = getelementptr i32, i32* %a, i32 %j
+ *  base(%2) = %1, base(%3) = @A, base(%4) = %a
+ *  %2 does not alias %3 or %4, %3 may alias %4
+ */
+
+#include "ir/ir.hpp"
+#include "opt/opt.h"
+
+namespace opt {
+
+AliasInfo::AliasInfo(ir::Func &func) {
+    for (auto &bb : func.bblocks) {
+        for (auto &inst : bb->insts) {
+            if (inst->op == ir::Instr::kOpAlloca) {
+                allocas.insert(inst->Result().get());
+            } else if (inst->op == ir::Instr::kOpGetelementptr) {
+                auto gep = dynamic_cast<ir::Getelementptr *>(inst.get());
+                derived[gep->result.get()] = gep->ptr.get();
+            } else if (inst->op == ir::Instr::kOpBitcast) {
+                auto cast = dynamic_cast<ir::Bitcast *>(inst.get());
+                derived[cast->result.get()] = cast->val.get();
+            }
+        }
+    }
+}
+
+ir::Value *AliasInfo::Base(ir::Value *ptr) {
+    for (auto it = derived.find(ptr); it != derived.end();
+         it = derived.find(ptr))
+        ptr = it->second;
+    return ptr;
+}
+
+bool AliasInfo::IsObject(ir::Value *base) {
+    return allocas.count(base) || base->kind == ir::Value::kGlobalVar;
+}
+
+bool AliasInfo::MayAlias(ir::Value *a, ir::Value *b) {
+    a = Base(a), b = Base(b);
+    if (a == b)
+        return true;
+    if (IsObject(a) && IsObject(b))
+        return false;
+    return !(allocas.count(a) || allocas.count(b));
+}
+
+} // namespace opt
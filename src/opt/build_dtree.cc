@@ -82,10 +82,14 @@ struct DTreeBuilder {
         n = 0;
         int i = 0;
         for (auto &bb : bblocks) {
-            if (i == 0)
+            if (bbinfo_id < 0)
                 bbinfo_id = bb->extra.size();
             bb->id = i++;
-            bb->extra.push_back(std::make_unique<BBInfo>());
+            // rebuilding after the CFG changed reuses the slot
+            if (bb->extra.size() > bbinfo_id)
+                bb->extra[bbinfo_id] = std::make_unique<BBInfo>();
+            else
+                bb->extra.push_back(std::make_unique<BBInfo>());
         }
         int size = bblocks.size();
         id_to_bb.reserve(size);
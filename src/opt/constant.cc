@@ -13,6 +13,7 @@
 
 #include "ir/ir.hpp"
 #include "opt/opt.h"
+#include <climits>
 
 namespace opt {
 
@@ -31,39 +32,38 @@ static inline int ImmVal(GVT &v) {
     return std::dynamic_pointer_cast<ir::ImmValue>(v)->imm;
 }
 
-int EvalBinaryAlu(ir::BinaryAlu *alu) {
-    int l = ImmVal(alu->l), r = ImmVal(alu->r);
-    switch (alu->op) {
+bool EvalBinaryAlu(int op, int l, int r, int &res) {
+    // compute in unsigned to avoid signed overflow
+    switch (op) {
     case ir::Instr::kOpAdd:
-        return l + r;
+        res = (unsigned)l + (unsigned)r;
         break;
     case ir::Instr::kOpSub:
-        return l - r;
+        res = (unsigned)l - (unsigned)r;
         break;
     case ir::Instr::kOpMul:
-        return l * r;
+        res = (unsigned)l * (unsigned)r;
         break;
     case ir::Instr::kOpSdiv:
-        return l / r;
-        break;
     case ir::Instr::kOpSrem:
-        return l % r;
+        if (r == 0 || (l == INT_MIN && r == -1))
+            return false;
+        res = op == ir::Instr::kOpSdiv ? l / r : l % r;
         break;
     case ir::Instr::kOpAnd:
-        return l & r;
+        res = l & r;
         break;
     case ir::Instr::kOpOr:
-        return l | r;
+        res = l | r;
         break;
     default:
         assert(false && "BUG");
     }
-    return 0;
+    return true;
 }
 
-bool EvalIcmp(ir::Icmp *icmp) {
-    int l = ImmVal(icmp->l), r = ImmVal(icmp->r);
-    switch (icmp->cond) {
+bool EvalIcmp(int cond, int l, int r) {
+    switch (cond) {
     case ir::Icmp::kEq:
         return l == r;
     case ir::Icmp::kNe:
@@ -122,14 +122,19 @@ void ConstantOpt(ir::Module &m) {
                 bool can_folding = false;
                 if (inst->IsBinaryAlu()) {
                     auto alu = dynamic_cast<ir::BinaryAlu *>(inst.get());
-                    can_folding = IsImm(alu->l) && IsImm(alu->r);
+                    int val;
+                    can_folding = IsImm(alu->l) && IsImm(alu->r) &&
+                                  EvalBinaryAlu(alu->op, ImmVal(alu->l),
+                                                ImmVal(alu->r), val);
                     if (can_folding)
-                        res = m.CreateImm(EvalBinaryAlu(alu), alu->ty);
+                        res = m.CreateImm(val, alu->ty);
                 } else if (inst->op == ir::Instr::kOpIcmp) {
                     auto icmp = dynamic_cast<ir::Icmp *>(inst.get());
                     can_folding = IsImm(icmp->l) && IsImm(icmp->r);
                     if (can_folding)
-                        res = m.CreateImm(EvalIcmp(icmp), ir::t_i1);
+                        res = m.CreateImm(EvalIcmp(icmp->cond, ImmVal(icmp->l),
+                                                   ImmVal(icmp->r)),
+                                          ir::t_i1);
                 } else if (inst->op == ir::Instr::kOpLoad) {
                     auto load = dynamic_cast<ir::Load *>(inst.get());
                     auto it = g_constants.find(load->ptr);
@@ -0,0 +1,164 @@
+/**
+ * Dead Code Elimination
+ *  1. fold `br i1 <imm>` into an unconditional branch
+ *  2. remove blocks unreachable from the entry, and drop their incoming
+ *     values from the phis of reachable successors
+ *  3. mark instructions live starting from the ones with side effects
+ *     (store, call, ret, br) and following operands, delete the rest
+ * EG:
+ *  before:
+ *      %2 = mul i32 %a, 2          ; never used
+ *      br i1 1, label %3, label %4
+ *  after:
+ *      br label %3
+ */
+
+#include "ir/ir.hpp"
+#include "opt/opt.h"
+#include <algorithm>
+
+namespace opt {
+
+void RemoveEdge(ir::BB *from, ir::BB *to) {
+    from->successors.erase(to);
+    auto &preds = to->predecessors;
+    auto it = std::find(preds.begin(), preds.end(), from);
+    if (it != preds.end())
+        preds.erase(it);
+    for (auto &inst : to->insts) {
+        if (inst->op != ir::Instr::kOpPhi)
+            break;
+        auto &vals = dynamic_cast<ir::Phi *>(inst.get())->vals;
+        vals.erase(std::remove_if(vals.begin(), vals.end(),
+                                  [&](ir::Phi::PhiVal &pv) {
+                                      return pv.label == from->label;
+                                  }),
+                   vals.end());
+    }
+}
+
+static std::vector<ir::BB *> Successors(ir::Func &func, ir::BB *bb) {
+    auto br = dynamic_cast<ir::Br *>(bb->insts.back().get());
+    if (!br)
+        return {};
+    std::vector<ir::BB *> succs{func.label_map[br->l1.get()]};
+    if (br->cond && br->l2 != br->l1)
+        succs.push_back(func.label_map[br->l2.get()]);
+    return succs;
+}
+
+void FoldConstBranches(ir::Func &func) {
+    for (auto &bb : func.bblocks) {
+        auto br = dynamic_cast<ir::Br *>(bb->insts.back().get());
+        if (!br || !br->cond || br->cond->kind != ir::Value::kImm)
+            continue;
+        bool taken = std::dynamic_pointer_cast<ir::ImmValue>(br->cond)->imm;
+        auto target = taken ? br->l1 : br->l2, other = taken ? br->l2 : br->l1;
+        if (other != target)
+            RemoveEdge(bb.get(), func.label_map[other.get()]);
+        br->cond = nullptr;
+        br->l1 = target;
+        br->l2 = nullptr;
+    }
+}
+
+void RemoveUnreachableBBs(ir::Func &func) {
+    std::set<ir::BB *> reachable{func.bblocks[0].get()};
+    std::vector<ir::BB *> stack{func.bblocks[0].get()};
+    while (!stack.empty()) {
+        auto bb = stack.back();
+        stack.pop_back();
+        for (auto succ : Successors(func, bb))
+            if (reachable.insert(succ).second)
+                stack.push_back(succ);
+    }
+    if (reachable.size() == func.bblocks.size())
+        return;
+
+    // Successors() resolves labels, so keep them until every edge is gone
+    for (auto &bb : func.bblocks)
+        if (!reachable.count(bb.get()))
+            for (auto succ : Successors(func, bb.get()))
+                RemoveEdge(bb.get(), succ);
+    for (auto &bb : func.bblocks)
+        if (!reachable.count(bb.get()) && bb->label)
+            func.label_map.erase(bb->label.get());
+    auto &bblocks = func.bblocks;
+    bblocks.erase(std::remove_if(bblocks.begin(), bblocks.end(),
+                                 [&](std::unique_ptr<ir::BB> &bb) {
+                                     return !reachable.count(bb.get());
+                                 }),
+                  bblocks.end());
+    func.ResetBBID();
+}
+
+namespace dce {
+
+static bool HasSideEffect(ir::Instr *inst) {
+    switch (inst->op) {
+    case ir::Instr::kOpStore:
+    case ir::Instr::kOpCall:
+    case ir::Instr::kOpRet:
+    case ir::Instr::kOpBr:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void RemoveDeadInstrs(std::unique_ptr<ir::Func> &func) {
+    std::map<ir::Value *, ir::Instr *> def;
+    std::set<ir::Instr *> live;
+    std::vector<ir::Instr *> worklist;
+    for (auto &bb : func->bblocks) {
+        for (auto &inst : bb->insts) {
+            if (inst->HasResult())
+                def[inst->Result().get()] = inst.get();
+            if (HasSideEffect(inst.get())) {
+                live.insert(inst.get());
+                worklist.push_back(inst.get());
+            }
+        }
+    }
+    while (!worklist.empty()) {
+        auto inst = worklist.back();
+        worklist.pop_back();
+        for (auto p : inst->RValues()) {
+            if (!*p)
+                continue;
+            auto it = def.find(p->get());
+            if (it != def.end() && live.insert(it->second).second)
+                worklist.push_back(it->second);
+        }
+    }
+
+    for (auto &bb : func->bblocks) {
+        for (auto &inst : bb->insts) {
+            if (live.count(inst.get()))
+                continue;
+            auto res = inst->Result();
+            if (res && res->kind == ir::Value::kLocalVar)
+                func->vars.erase(
+                    std::dynamic_pointer_cast<ir::LocalVar>(res)->var());
+        }
+        auto &insts = bb->insts;
+        insts.erase(std::remove_if(insts.begin(), insts.end(),
+                                   [&](std::unique_ptr<ir::Instr> &inst) {
+                                       return !live.count(inst.get());
+                                   }),
+                    insts.end());
+    }
+}
+
+} // namespace dce
+
+void DeadCodeElim(ir::Module &m) {
+    for (auto &func : m.funcs) {
+        FoldConstBranches(*func);
+        RemoveUnreachableBBs(*func);
+        dce::RemoveDeadInstrs(func);
+        func->ResetTmpVar();
+    }
+}
+
+} // namespace opt
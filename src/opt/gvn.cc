@@ -0,0 +1,203 @@
+/**
+ * Global Value Numbering (dominator tree scoped)
+ *  Walk the dominator tree, an expression computed in a dominator is
+ *  available in every block it dominates. Expressions are hashed on opcode
+ *  and operands, operands of commutative operations are sorted.
+ *  Loads are reused within an extended basic block (a child in the dominator
+ *  tree whose only predecessor is its parent) until a store or call that may
+ *  alias, stores are forwarded to later loads of the same pointer.
+ * EG:
+ *  before:
+ *      %1 = getelementptr [4 x i32], [4 x i32]* %a, i32 0, i32 %i
+ *      %2 = load i32, i32* %1
+ *      %3 = getelementptr [4 x i32], [4 x i32]* %a, i32 0, i32 %i
+ *      %4 = load i32, i32* %3
+ *      %5 = add i32 %2, %4
+ *  after:
+ *      %1 = getelementptr [4 x i32], [4 x i32]* %a, i32 0, i32 %i
+ *      %2 = load i32, i32* %1
+ *      %5 = add i32 %2, %2
+ */
+
+#include "ir/ir.hpp"
+#include "opt/opt.h"
+#include <algorithm>
+
+namespace opt {
+
+namespace gvn {
+
+using GVT = std::shared_ptr<ir::Value>;
+
+struct Key {
+    int op, sub;
+    // immediates are compared by value, other operands by identity
+    std::vector<std::pair<bool, intptr_t>> operands;
+
+    bool operator<(const Key &o) const {
+        return std::tie(op, sub, operands) <
+               std::tie(o.op, o.sub, o.operands);
+    }
+};
+
+static std::pair<bool, intptr_t> Operand(GVT &v) {
+    if (v->kind == ir::Value::kImm)
+        return {true, std::dynamic_pointer_cast<ir::ImmValue>(v)->imm};
+    return {false, (intptr_t)v.get()};
+}
+
+// icmp cond with operands swapped
+static int SwapCond(int cond) {
+    switch (cond) {
+    case ir::Icmp::kUgt:
+        return ir::Icmp::kUlt;
+    case ir::Icmp::kUge:
+        return ir::Icmp::kUle;
+    case ir::Icmp::kUlt:
+        return ir::Icmp::kUgt;
+    case ir::Icmp::kUle:
+        return ir::Icmp::kUge;
+    case ir::Icmp::kSgt:
+        return ir::Icmp::kSlt;
+    case ir::Icmp::kSge:
+        return ir::Icmp::kSle;
+    case ir::Icmp::kSlt:
+        return ir::Icmp::kSgt;
+    case ir::Icmp::kSle:
+        return ir::Icmp::kSge;
+    default:
+        return cond; // eq, ne
+    }
+}
+
+// pure instructions that can be numbered
+static bool MakeKey(ir::Instr *inst, Key &key) {
+    key.op = inst->op;
+    key.sub = 0;
+    if (inst->IsBinaryAlu()) {
+        auto alu = dynamic_cast<ir::BinaryAlu *>(inst);
+        key.operands = {Operand(alu->l), Operand(alu->r)};
+        if (alu->op == ir::Instr::kOpAdd || alu->op == ir::Instr::kOpMul ||
+            alu->op == ir::Instr::kOpAnd || alu->op == ir::Instr::kOpOr)
+            std::sort(key.operands.begin(), key.operands.end());
+        return true;
+    }
+    switch (inst->op) {
+    case ir::Instr::kOpIcmp: {
+        auto icmp = dynamic_cast<ir::Icmp *>(inst);
+        key.sub = icmp->cond;
+        key.operands = {Operand(icmp->l), Operand(icmp->r)};
+        if (key.operands[1] < key.operands[0]) {
+            std::swap(key.operands[0], key.operands[1]);
+            key.sub = SwapCond(key.sub);
+        }
+        return true;
+    }
+    case ir::Instr::kOpGetelementptr: {
+        auto gep = dynamic_cast<ir::Getelementptr *>(inst);
+        key.operands = {Operand(gep->ptr)};
+        for (auto &idx : gep->indices)
+            key.operands.push_back(Operand(idx));
+        return true;
+    }
+    case ir::Instr::kOpZext: {
+        auto zext = dynamic_cast<ir::Zext *>(inst);
+        key.operands = {Operand(zext->val)};
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+struct GVNHelper {
+    ir::Func &func;
+    std::map<Key, GVT> exprs;                // available expressions
+    std::map<GVT, GVT> replace;              // redundant value -> leader
+    AliasInfo alias;
+
+    // available memory values: pointer -> value loaded or stored
+    using MemTable = std::map<GVT, GVT>;
+
+    GVNHelper(ir::Func &func) : func(func), alias(func) {}
+
+    void Visit(ir::BB *bb, MemTable mem) {
+        std::vector<Key> scope;
+        auto &insts = bb->insts;
+        for (auto it = insts.begin(); it != insts.end();) {
+            auto inst = it->get();
+            inst->ReplaceValues(replace);
+            GVT leader;
+            Key key;
+            if (MakeKey(inst, key)) {
+                auto found = exprs.find(key);
+                if (found != exprs.end()) {
+                    leader = found->second;
+                } else {
+                    exprs[key] = inst->Result();
+                    scope.push_back(key);
+                }
+            } else if (inst->op == ir::Instr::kOpLoad) {
+                auto load = dynamic_cast<ir::Load *>(inst);
+                auto found = mem.find(load->ptr);
+                if (found != mem.end())
+                    leader = found->second;
+                else
+                    mem[load->ptr] = load->result;
+            } else if (inst->op == ir::Instr::kOpStore) {
+                auto store = dynamic_cast<ir::Store *>(inst);
+                for (auto m = mem.begin(); m != mem.end();) {
+                    if (alias.MayAlias(m->first.get(), store->ptr.get()))
+                        m = mem.erase(m);
+                    else
+                        m++;
+                }
+                mem[store->ptr] = store->val;
+            } else if (inst->op == ir::Instr::kOpCall) {
+                mem.clear();
+            }
+
+            if (leader) {
+                auto res = inst->Result();
+                replace[res] = leader;
+                if (res->kind == ir::Value::kLocalVar)
+                    func.vars.erase(
+                        std::dynamic_pointer_cast<ir::LocalVar>(res)->var());
+                it = insts.erase(it);
+            } else {
+                it++;
+            }
+        }
+
+        for (auto child : dtree::GetNode(bb).children) {
+            bool ebb = child->predecessors.size() == 1 &&
+                       child->predecessors[0] == bb;
+            Visit(child, ebb ? mem : MemTable());
+        }
+
+        for (auto &key : scope)
+            exprs.erase(key);
+    }
+
+    void Run() {
+        Visit(func.bblocks[0].get(), MemTable());
+        // phis may use values from blocks visited later
+        for (auto &bb : func.bblocks)
+            for (auto &inst : bb->insts)
+                inst->ReplaceValues(replace);
+        func.ResetTmpVar();
+    }
+};
+
+} // namespace gvn
+
+void GVN(ir::Module &m) {
+    // passes before may have changed the CFG
+    BuildDTree(m);
+    for (auto &func : m.funcs) {
+        gvn::GVNHelper helper(*func);
+        helper.Run();
+    }
+}
+
+} // namespace opt
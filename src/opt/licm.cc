@@ -0,0 +1,255 @@
+/**
+ * Loop Invariant Code Motion
+ *  1. give every loop a preheader: a new block between the header and its
+ *     predecessors outside the loop, phis of the header merge the outside
+ *     values in the preheader when there is more than one
+ *  2. from the innermost loops out, move instructions whose operands are
+ *     all defined outside the loop into the preheader, visiting blocks in
+ *     dominator tree order so operands are hoisted before their users
+ *
+ *  Pure instructions (alu, icmp, getelementptr, zext, bitcast) are always
+ *  hoisted, divisions only by a non-zero immediate. A load is hoisted when
+ *  the loop has no call and no store that may alias it, and it either runs
+ *  before every exit of the loop or reads an alloca or a global, which can
+ *  be read speculatively.
+ * EG:
+ *  before:
+ *  1:
+ *      br label %2
+ *  2:
+ *      %3 = phi i32 [0, %1], [%7, %4]
+ *      %c = icmp slt i32 %3, %n
+ *      br i1 %c, label %4, label %8
+ *  4:
+ *      %5 = getelementptr [20 x i32], [20 x i32]* @A, i32 0, i32 %i
+ *      %6 = load i32, i32* %5
+ *      %7 = add i32 %3, %6
+ *      br label %2
+ *  after:
+ *  1:
+ *      br label %p
+ *  p:
+ *      %5 = getelementptr [20 x i32], [20 x i32]* @A, i32 0, i32 %i
+ *      %6 = load i32, i32* %5
+ *      br label %2
+ *  2:
+ *      %3 = phi i32 [0, %p], [%7, %4]
+ *      ...
+ */
+
+#include "ir/ir.hpp"
+#include "opt/opt.h"
+#include <algorithm>
+
+namespace opt {
+
+namespace licm {
+
+using GVT = std::shared_ptr<ir::Value>;
+using loop::Loop;
+
+static bool Dominates(ir::BB *a, ir::BB *b) {
+    for (; b; b = dtree::IDom(b))
+        if (a == b)
+            return true;
+    return false;
+}
+
+static void Relabel(ir::BB *bb, ir::BB *from, ir::BB *to) {
+    auto br = dynamic_cast<ir::Br *>(bb->insts.back().get());
+    if (br->l1 == from->label)
+        br->l1 = to->label;
+    if (br->l2 == from->label)
+        br->l2 = to->label;
+    bb->successors.erase(from);
+    bb->successors.insert(to);
+}
+
+static void InsertPreheader(ir::Func &func, Loop *l) {
+    auto header = l->header;
+    std::vector<ir::BB *> outside;
+    for (auto pred : header->predecessors)
+        if (!l->Contains(pred) &&
+            std::find(outside.begin(), outside.end(), pred) == outside.end())
+            outside.push_back(pred);
+
+    auto pre = std::make_unique<ir::BB>();
+    pre->tag = ir::BB::kDefault;
+    pre->func = &func;
+    pre->label = func.CreateTmpVar(ir::t_label);
+    func.label_map[pre->label.get()] = pre.get();
+
+    for (auto pred : outside) {
+        Relabel(pred, header, pre.get());
+        pre->predecessors.push_back(pred);
+    }
+    auto &preds = header->predecessors;
+    preds.erase(std::remove_if(preds.begin(), preds.end(),
+                               [&](ir::BB *bb) { return !l->Contains(bb); }),
+                preds.end());
+    preds.push_back(pre.get());
+
+    for (auto &inst : header->insts) {
+        if (inst->op != ir::Instr::kOpPhi)
+            break;
+        auto phi = dynamic_cast<ir::Phi *>(inst.get());
+        std::vector<ir::Phi::PhiVal> in, out;
+        for (auto &pv : phi->vals) {
+            auto pred = func.label_map[pv.label.get()];
+            (l->Contains(pred) ? in : out).push_back(pv);
+        }
+        if (out.empty())
+            continue;
+        GVT val = out[0].val;
+        if (outside.size() > 1) {
+            auto merge = pre->CreateInstr<ir::Phi>();
+            merge->ty = phi->ty;
+            merge->result = func.CreateTmpVar(phi->ty);
+            merge->vals = out;
+            val = merge->result;
+        }
+        in.push_back({val, pre->label});
+        phi->vals = in;
+    }
+
+    pre->CreateInstr<ir::Br>(header->label);
+    pre->successors.insert(header);
+    auto &bblocks = func.bblocks;
+    auto pos = std::find_if(
+        bblocks.begin(), bblocks.end(),
+        [&](std::unique_ptr<ir::BB> &bb) { return bb.get() == header; });
+    bblocks.insert(pos, std::move(pre));
+}
+
+struct LICMHelper {
+    ir::Func &func;
+    AliasInfo alias;
+    std::map<ir::Value *, ir::BB *> def_bb;
+
+    LICMHelper(ir::Func &func) : func(func), alias(func) {
+        for (auto &bb : func.bblocks)
+            for (auto &inst : bb->insts)
+                if (inst->HasResult())
+                    def_bb[inst->Result().get()] = bb.get();
+    }
+
+    bool Invariant(Loop *l, ir::Value *v) {
+        auto it = def_bb.find(v);
+        // immediates, globals and arguments have no definition
+        return it == def_bb.end() || !l->Contains(it->second);
+    }
+
+    bool CanHoist(Loop *l, ir::BB *bb, ir::Instr *inst,
+                  std::vector<ir::Value *> &stores, bool has_call) {
+        switch (inst->op) {
+        case ir::Instr::kOpSdiv:
+        case ir::Instr::kOpSrem: {
+            auto r = dynamic_cast<ir::BinaryAlu *>(inst)->r;
+            if (r->kind != ir::Value::kImm ||
+                std::dynamic_pointer_cast<ir::ImmValue>(r)->imm == 0)
+                return false;
+        } break;
+        case ir::Instr::kOpLoad: {
+            auto ptr = dynamic_cast<ir::Load *>(inst)->ptr.get();
+            if (has_call)
+                return false;
+            for (auto p : stores)
+                if (alias.MayAlias(p, ptr))
+                    return false;
+            if (alias.IsObject(alias.Base(ptr)))
+                break;
+            for (auto exit : l->exits)
+                if (!Dominates(bb, exit))
+                    return false;
+        } break;
+        case ir::Instr::kOpIcmp:
+        case ir::Instr::kOpGetelementptr:
+        case ir::Instr::kOpZext:
+        case ir::Instr::kOpBitcast:
+            break;
+        default:
+            if (!inst->IsBinaryAlu())
+                return false;
+        }
+        for (auto p : inst->RValues())
+            if (!Invariant(l, p->get()))
+                return false;
+        return true;
+    }
+
+    void Hoist(Loop *l) {
+        if (!l->preheader)
+            return;
+        std::vector<ir::Value *> stores;
+        bool has_call = false;
+        for (auto bb : l->blocks) {
+            for (auto &inst : bb->insts) {
+                if (inst->op == ir::Instr::kOpStore)
+                    stores.push_back(
+                        dynamic_cast<ir::Store *>(inst.get())->ptr.get());
+                has_call |= inst->op == ir::Instr::kOpCall;
+            }
+        }
+
+        auto &pre_insts = l->preheader->insts;
+        std::vector<ir::BB *> stack{l->header};
+        while (!stack.empty()) {
+            auto bb = stack.back();
+            stack.pop_back();
+            auto &insts = bb->insts;
+            for (auto it = insts.begin(); it != insts.end();) {
+                if (!CanHoist(l, bb, it->get(), stores, has_call)) {
+                    it++;
+                    continue;
+                }
+                def_bb[(*it)->Result().get()] = l->preheader;
+                pre_insts.insert(pre_insts.end() - 1, std::move(*it));
+                it = insts.erase(it);
+            }
+            // children pushed in reverse to visit them in order
+            auto &children = dtree::GetNode(bb).children;
+            for (auto c = children.rbegin(); c != children.rend(); c++)
+                if (l->Contains(*c))
+                    stack.push_back(*c);
+        }
+    }
+
+    void Run(std::vector<Loop *> loops) {
+        for (auto l : loops) {
+            Run(l->children);
+            Hoist(l);
+        }
+    }
+};
+
+} // namespace licm
+
+void LICM(ir::Module &m) {
+    BuildLoopInfo(m);
+    bool changed = false;
+    for (auto &func : m.funcs) {
+        std::vector<loop::Loop *> work = loop::TopLevel(*func);
+        while (!work.empty()) {
+            auto l = work.back();
+            work.pop_back();
+            work.insert(work.end(), l->children.begin(), l->children.end());
+            // the entry block can not get a block in front of it
+            if (!l->preheader && l->header->label) {
+                licm::InsertPreheader(*func, l);
+                changed = true;
+            }
+        }
+    }
+    // new blocks change the dominator tree and the loops around them
+    if (changed)
+        BuildLoopInfo(m);
+
+    for (auto &func : m.funcs) {
+        licm::LICMHelper helper(*func);
+        helper.Run(loop::TopLevel(*func));
+        func->ResetBBID();
+        func->ResetTmpVar();
+    }
+}
+
+} // namespace opt
@@ -0,0 +1,210 @@
+/**
+ * Loop Info
+ *  Natural loops found from the CFG: an edge t -> h is a back edge when h
+ *  dominates t, the loop of h is h plus every block reaching t without
+ *  passing h. Loops sharing a header are merged, loops are nested by
+ *  containment and every block points to the innermost loop containing it.
+ *  Headers are visited in post order of the dominator tree, so inner loops
+ *  are built before the loops around them.
+ * EG:
+ *  1:
+ *      br label %2
+ *  2:                      ; header of L1, depth 1, preheader %1
+ *      br i1 %c, label %3, label %6
+ *  3:                      ; header of L2, depth 2, parent L1
+ *      br i1 %d, label %3, label %4
+ *  4:                      ; latch of L1
+ *      br label %2
+ *  6:                      ; exit of L1
+ *
+ *  NOTE: the result is stored in BB::extra next to the dominator tree and is
+ *  only valid until the CFG changes, passes editing the CFG rerun
+ *  BuildLoopInfo
+ */
+
+#include "ir/ir.hpp"
+#include "opt/opt.h"
+#include <algorithm>
+
+namespace opt {
+
+using loop::Loop;
+
+struct LoopBBInfo : ir::BB::BBExtraInfo {
+    // every block of a function shares its loops, so they outlive a header
+    // deleted after the analysis
+    std::shared_ptr<std::vector<std::unique_ptr<Loop>>> loops;
+    Loop *loop = nullptr; // innermost
+};
+
+static int loopinfo_id = -1;
+
+static LoopBBInfo *loopinfo(ir::BB *bb) {
+    if (loopinfo_id < 0 || bb->extra.size() <= loopinfo_id)
+        return nullptr;
+    auto &info = bb->extra[loopinfo_id];
+    return info ? info->cast<LoopBBInfo>() : nullptr;
+}
+
+bool loop::HasLoopInfo(ir::BB *bb) { return loopinfo(bb) != nullptr; }
+
+Loop *loop::GetLoop(ir::BB *bb) {
+    auto info = loopinfo(bb);
+    return info ? info->loop : nullptr;
+}
+
+int loop::Depth(ir::BB *bb) {
+    auto l = GetLoop(bb);
+    return l ? l->depth : 0;
+}
+
+std::vector<Loop *> loop::TopLevel(ir::Func &f) {
+    std::vector<Loop *> res;
+    auto info = loopinfo(f.bblocks[0].get());
+    if (!info)
+        return res;
+    for (auto &l : *info->loops)
+        if (!l->parent)
+            res.push_back(l.get());
+    return res;
+}
+
+bool Loop::Contains(ir::BB *bb) const {
+    for (auto l = GetLoop(bb); l; l = l->parent)
+        if (l == this)
+            return true;
+    return false;
+}
+
+namespace loop {
+
+struct LoopBuilder {
+    ir::Func &func;
+    std::shared_ptr<std::vector<std::unique_ptr<Loop>>> loops;
+    std::set<ir::BB *> reachable;
+    std::vector<ir::BB *> post_order; // of the dominator tree
+
+    LoopBuilder(ir::Func &func)
+        : func(func),
+          loops(std::make_shared<std::vector<std::unique_ptr<Loop>>>()) {}
+
+    void DTreeDFS(ir::BB *bb) {
+        reachable.insert(bb);
+        for (auto child : dtree::GetNode(bb).children)
+            DTreeDFS(child);
+        post_order.push_back(bb);
+    }
+
+    bool Dominates(ir::BB *a, ir::BB *b) {
+        for (; b; b = dtree::IDom(b))
+            if (a == b)
+                return true;
+        return false;
+    }
+
+    static Loop *Outermost(Loop *l) {
+        while (l->parent)
+            l = l->parent;
+        return l;
+    }
+
+    void Discover(ir::BB *header) {
+        std::vector<ir::BB *> work;
+        for (auto pred : header->predecessors)
+            if (reachable.count(pred) && Dominates(header, pred))
+                work.push_back(pred);
+        if (work.empty())
+            return;
+
+        loops->push_back(std::make_unique<Loop>());
+        auto l = loops->back().get();
+        l->header = header;
+        loopinfo(header)->loop = l;
+        while (!work.empty()) {
+            auto bb = work.back();
+            work.pop_back();
+            auto inner = loopinfo(bb)->loop;
+            if (!inner) {
+                loopinfo(bb)->loop = l;
+                for (auto pred : bb->predecessors)
+                    if (reachable.count(pred))
+                        work.push_back(pred);
+                continue;
+            }
+            // a loop built before is nested in this one, continue from the
+            // predecessors of its header
+            inner = Outermost(inner);
+            if (inner == l)
+                continue;
+            inner->parent = l;
+            l->children.push_back(inner);
+            for (auto pred : inner->header->predecessors)
+                if (reachable.count(pred) && !inner->Contains(pred))
+                    work.push_back(pred);
+        }
+    }
+
+    void Build() {
+        for (auto &bb : func.bblocks) {
+            if (loopinfo_id < 0)
+                loopinfo_id = bb->extra.size();
+            if (bb->extra.size() <= loopinfo_id)
+                bb->extra.resize(loopinfo_id + 1);
+            bb->extra[loopinfo_id] = std::make_unique<LoopBBInfo>();
+            loopinfo(bb.get())->loops = loops;
+        }
+        DTreeDFS(func.bblocks[0].get());
+        for (auto bb : post_order)
+            Discover(bb);
+
+        // blocks in function order, each loop also holds its nested blocks
+        for (auto &bb : func.bblocks)
+            for (auto l = GetLoop(bb.get()); l; l = l->parent)
+                l->blocks.push_back(bb.get());
+        for (auto &l : *loops) {
+            l->depth = 1;
+            for (auto p = l->parent; p; p = p->parent)
+                l->depth++;
+            auto &blocks = l->blocks;
+            std::stable_partition(blocks.begin(), blocks.end(),
+                                  [&](ir::BB *bb) { return bb == l->header; });
+
+            std::vector<ir::BB *> outside;
+            for (auto pred : l->header->predecessors) {
+                if (l->Contains(pred))
+                    l->latches.push_back(pred);
+                else if (reachable.count(pred) &&
+                         std::find(outside.begin(), outside.end(), pred) ==
+                         outside.end())
+                    outside.push_back(pred);
+            }
+            // the preheader must only jump to the header
+            if (outside.size() == 1 && outside[0]->successors.size() == 1)
+                l->preheader = outside[0];
+
+            for (auto &bb : func.bblocks) {
+                if (l->Contains(bb.get()))
+                    continue;
+                for (auto pred : bb->predecessors) {
+                    if (l->Contains(pred)) {
+                        l->exits.push_back(bb.get());
+                        break;
+                    }
+                }
+            }
+        }
+    }
+};
+
+} // namespace loop
+
+void BuildLoopInfo(ir::Module &m) {
+    // the CFG may have changed since the dominator tree was built
+    BuildDTree(m);
+    for (auto &func : m.funcs) {
+        loop::LoopBuilder builder(*func);
+        builder.Build();
+    }
+}
+
+} // namespace opt
@@ -0,0 +1,370 @@
+#include "frontend.h"
+#include "opt/opt.h"
+#include <gtest/gtest.h>
+#include <sstream>
+
+// compile SysY source to IR in SSA form
+static ir::Module *Compile(const char *src) {
+    auto comp_unit = Parse(src, strlen(src));
+    comp_unit = SemanticCheck(comp_unit);
+    auto m = AstToIr(comp_unit);
+    opt::InitBBPtr(*m);
+    opt::BuildDTree(*m);
+    opt::Mem2Reg(*m);
+    return m;
+}
+
+static ir::Func *GetFunc(ir::Module &m, std::string name) {
+    for (auto &func : m.funcs)
+        if (func->name == name)
+            return func.get();
+    return nullptr;
+}
+
+static int CountOp(ir::Func &func, int op) {
+    int n = 0;
+    for (auto &bb : func.bblocks)
+        for (auto &inst : bb->insts)
+            n += inst->op == op;
+    return n;
+}
+
+// instructions of the given kind inside loops, needs loop info
+static int CountOpInLoops(ir::Func &func, int op) {
+    int n = 0;
+    for (auto &bb : func.bblocks)
+        if (opt::loop::Depth(bb.get()) > 0)
+            for (auto &inst : bb->insts)
+                n += inst->op == op;
+    return n;
+}
+
+static ir::Ret *GetRet(ir::Func &func) {
+    for (auto &bb : func.bblocks)
+        if (bb->insts.back()->op == ir::Instr::kOpRet)
+            return dynamic_cast<ir::Ret *>(bb->insts.back().get());
+    return nullptr;
+}
+
+static bool IsImm(std::shared_ptr<ir::Value> v, int imm) {
+    return v->kind == ir::Value::kImm &&
+           std::dynamic_pointer_cast<ir::ImmValue>(v)->imm == imm;
+}
+
+TEST(Opt, RemoveUnreachableBBs) {
+    // the loop is dead, its blocks feed the phi at the join
+    auto m = Compile("int main() {\n"
+                     "    int i = getint();\n"
+                     "    if (0) { while (i < 10) i = i + 1; }\n"
+                     "    return i;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpPhi), 2);
+    opt::ConstantOpt(*m); // the guard folds to `br i1 0`
+    opt::DeadCodeElim(*m);
+
+    // entry, the block calling getint and the join
+    ASSERT_EQ(func.bblocks.size(), 3);
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpPhi), 1);
+    for (auto &bb : func.bblocks) {
+        for (auto pred : bb->predecessors)
+            ASSERT_EQ(pred->successors.count(bb.get()), 1);
+        for (auto &inst : bb->insts) {
+            if (inst->op != ir::Instr::kOpPhi)
+                continue;
+            auto phi = dynamic_cast<ir::Phi *>(inst.get());
+            ASSERT_EQ(phi->vals.size(), bb->predecessors.size());
+            for (auto &pv : phi->vals)
+                ASSERT_NE(func.label_map.count(pv.label.get()), 0);
+        }
+    }
+}
+
+TEST(Opt, DeadCodeElim) {
+    auto m = Compile("int g;\n"
+                     "int main() {\n"
+                     "    int a = getint();\n"
+                     "    int b = a * 2;\n"
+                     "    g = a + 1;\n"
+                     "    return a;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    opt::DeadCodeElim(*m);
+    // the unused multiply goes away, the store keeps its operand
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpMul), 0);
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpAdd), 1);
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpStore), 1);
+}
+
+TEST(Opt, SCCPLoopPhi) {
+    // the back edge is never taken, so the header phi is the constant 1
+    auto m = Compile("int main() {\n"
+                     "    int i = 1;\n"
+                     "    while (i != 1) i = i + 1;\n"
+                     "    return i;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    opt::SCCP(*m);
+    ASSERT_TRUE(IsImm(GetRet(func)->retval, 1));
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpPhi), 0);
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpAdd), 0);
+}
+
+TEST(Opt, SCCPBottom) {
+    // both sides are executable, the phi of two constants stays
+    auto m = Compile("int main() {\n"
+                     "    int a;\n"
+                     "    if (getint()) a = 1; else a = 2;\n"
+                     "    return a + 1;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    opt::SCCP(*m);
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpPhi), 1);
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpAdd), 1);
+    ASSERT_FALSE(IsImm(GetRet(func)->retval, 2));
+}
+
+TEST(Opt, SCCPConstBranch) {
+    // the global constant decides the branch, the other arm is removed
+    auto m = Compile("const int N = 3;\n"
+                     "int main() {\n"
+                     "    int x = N * 2;\n"
+                     "    if (x > 5) putint(1); else putint(2);\n"
+                     "    return x;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    opt::SCCP(*m);
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpCall), 1);
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpIcmp), 0);
+    for (auto &bb : func.bblocks) {
+        auto br = dynamic_cast<ir::Br *>(bb->insts.back().get());
+        ASSERT_TRUE(!br || !br->cond);
+    }
+    ASSERT_TRUE(IsImm(GetRet(func)->retval, 6));
+    ASSERT_TRUE(m->defs.empty());
+}
+
+TEST(Opt, SCCPDeadLoop) {
+    // the guard folds to false around a loop
+    auto m = Compile("int main() {\n"
+                     "    int i = getint(), s = 0;\n"
+                     "    if (1 > 2) {\n"
+                     "        while (i < 10) { s = s + i; i = i + 1; }\n"
+                     "    }\n"
+                     "    return s;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    opt::SCCP(*m);
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpIcmp), 0);
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpAdd), 0);
+    ASSERT_TRUE(IsImm(GetRet(func)->retval, 0));
+    std::set<ir::BB *> bbs;
+    for (auto &bb : func.bblocks)
+        bbs.insert(bb.get());
+    for (auto &bb : func.bblocks)
+        for (auto pred : bb->predecessors)
+            ASSERT_EQ(bbs.count(pred), 1);
+}
+
+TEST(Opt, GVNDominatorScope) {
+    auto m = Compile("int main() {\n"
+                     "    int a = getint(), b = getint();\n"
+                     "    int x = a * b;\n"
+                     "    if (a > 0) {\n"
+                     "        putint(b * a);\n"
+                     "        putint(a + b);\n"
+                     "        putint(b + a);\n"
+                     "    } else {\n"
+                     "        putint(a + b);\n"
+                     "    }\n"
+                     "    putint(a + b);\n"
+                     "    return x;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    opt::GVN(*m);
+    // the entry dominates both arms, the arms do not dominate each other or
+    // the join
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpMul), 1);
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpAdd), 3);
+}
+
+TEST(Opt, GVNLoad) {
+    auto m = Compile("int g;\n"
+                     "int main() {\n"
+                     "    int x = g, y = g;\n"
+                     "    putint(x + y);\n"
+                     "    int z = g;\n"
+                     "    g = 5;\n"
+                     "    return z + g;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    opt::GVN(*m);
+    // the call may write g, the store is forwarded to the last load
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpLoad), 2);
+    auto ret = GetRet(func);
+    bool forwarded = false;
+    for (auto &bb : func.bblocks)
+        for (auto &inst : bb->insts)
+            if (inst->Result() == ret->retval) {
+                auto add = dynamic_cast<ir::BinaryAlu *>(inst.get());
+                forwarded = IsImm(add->r, 5);
+            }
+    ASSERT_TRUE(forwarded);
+}
+
+TEST(Opt, LoopInfo) {
+    auto m = Compile("int main() {\n"
+                     "    int i = 0, s = 0;\n"
+                     "    while (i < 10) {\n"
+                     "        int j = 0;\n"
+                     "        while (j < i) { s = s + j; j = j + 1; }\n"
+                     "        i = i + 1;\n"
+                     "    }\n"
+                     "    return s;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    opt::BuildLoopInfo(*m);
+
+    auto top = opt::loop::TopLevel(func);
+    ASSERT_EQ(top.size(), 1);
+    auto outer = top[0];
+    ASSERT_EQ(outer->depth, 1);
+    ASSERT_EQ(outer->parent, nullptr);
+    ASSERT_EQ(outer->children.size(), 1);
+    auto inner = outer->children[0];
+    ASSERT_EQ(inner->depth, 2);
+    ASSERT_EQ(inner->parent, outer);
+
+    auto entry = func.bblocks[0].get();
+    ASSERT_EQ(opt::loop::GetLoop(entry), nullptr);
+    ASSERT_EQ(opt::loop::Depth(entry), 0);
+    ASSERT_EQ(opt::loop::GetLoop(inner->header), inner);
+    ASSERT_EQ(opt::loop::Depth(inner->header), 2);
+    ASSERT_TRUE(outer->Contains(inner->header));
+    ASSERT_FALSE(inner->Contains(outer->header));
+    ASSERT_EQ(outer->blocks[0], outer->header);
+    for (auto bb : inner->blocks)
+        ASSERT_TRUE(outer->Contains(bb));
+
+    // one back edge each, the inner loop exits into the outer one
+    for (auto l : {outer, inner}) {
+        ASSERT_EQ(l->latches.size(), 1);
+        ASSERT_EQ(l->latches[0]->successors.count(l->header), 1);
+        ASSERT_EQ(l->exits.size(), 1);
+        ASSERT_FALSE(l->Contains(l->exits[0]));
+        ASSERT_NE(l->preheader, nullptr);
+        ASSERT_FALSE(l->Contains(l->preheader));
+        ASSERT_EQ(l->preheader->successors.size(), 1);
+    }
+    ASSERT_TRUE(outer->Contains(inner->exits[0]));
+    ASSERT_TRUE(outer->Contains(inner->preheader));
+    ASSERT_EQ(opt::loop::GetLoop(outer->exits[0]), nullptr);
+}
+
+TEST(Opt, LoopInfoLatches) {
+    // `continue` adds a second back edge to the same header
+    auto m = Compile("int main() {\n"
+                     "    int i = 0, s = 0;\n"
+                     "    while (i < 10) {\n"
+                     "        i = i + 1;\n"
+                     "        if (i == 5) continue;\n"
+                     "        s = s + i;\n"
+                     "    }\n"
+                     "    return s;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    opt::BuildLoopInfo(*m);
+    auto top = opt::loop::TopLevel(func);
+    ASSERT_EQ(top.size(), 1);
+    ASSERT_TRUE(top[0]->children.empty());
+    ASSERT_EQ(top[0]->latches.size(), 2);
+}
+
+TEST(Opt, LICM) {
+    // A is never written in the loop, the division is by a constant
+    auto m = Compile("int A[10], B[10];\n"
+                     "int main() {\n"
+                     "    int i = 0, s = 0, n = getint();\n"
+                     "    while (i < 10) {\n"
+                     "        s = s + A[n] + n / 3;\n"
+                     "        B[i] = s;\n"
+                     "        i = i + 1;\n"
+                     "    }\n"
+                     "    return s;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    opt::LICM(*m);
+    opt::BuildLoopInfo(*m);
+    ASSERT_EQ(CountOpInLoops(func, ir::Instr::kOpLoad), 0);
+    ASSERT_EQ(CountOpInLoops(func, ir::Instr::kOpSdiv), 0);
+    ASSERT_EQ(CountOp(func, ir::Instr::kOpSdiv), 1);
+    ASSERT_EQ(CountOpInLoops(func, ir::Instr::kOpStore), 1);
+}
+
+TEST(Opt, LICMRefuse) {
+    // a store to the same array, a call and a division by a variable
+    auto m = Compile("int A[10], g;\n"
+                     "int main() {\n"
+                     "    int i = 0, s = 0, n = getint(), d = getint();\n"
+                     "    while (i < 10) {\n"
+                     "        s = s + A[n] + n / d;\n"
+                     "        A[i] = s;\n"
+                     "        i = i + 1;\n"
+                     "    }\n"
+                     "    while (i < 20) {\n"
+                     "        putint(g);\n"
+                     "        i = i + 1;\n"
+                     "    }\n"
+                     "    return s;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    opt::LICM(*m);
+    opt::BuildLoopInfo(*m);
+    ASSERT_EQ(CountOpInLoops(func, ir::Instr::kOpLoad), 2);
+    ASSERT_EQ(CountOpInLoops(func, ir::Instr::kOpSdiv), 1);
+}
+
+TEST(Opt, StrengthReduce) {
+    // i * 3 indexes a, the row stride of b is 12 bytes
+    auto m = Compile("int a[300], b[100][3];\n"
+                     "int main() {\n"
+                     "    int i = 0, s = 0, n = getint();\n"
+                     "    while (i < n) {\n"
+                     "        s = s + a[i * 3] + b[i][1];\n"
+                     "        i = i + 1;\n"
+                     "    }\n"
+                     "    return s;\n"
+                     "}\n");
+    auto &func = *GetFunc(*m, "main");
+    opt::LICM(*m);
+    opt::StrengthReduce(*m);
+    opt::BuildLoopInfo(*m);
+    ASSERT_EQ(CountOpInLoops(func, ir::Instr::kOpMul), 0);
+
+    auto l = opt::loop::TopLevel(func)[0];
+    int i32_phis = 0, ptr_phis = 0;
+    for (auto &inst : l->header->insts) {
+        if (inst->op != ir::Instr::kOpPhi)
+            continue;
+        auto phi = dynamic_cast<ir::Phi *>(inst.get());
+        if (phi->ty->kind == ir::Type::kPtr)
+            ptr_phis++;
+        else
+            i32_phis++;
+    }
+    // i, s and i * 3; a pointer walking the rows of b
+    ASSERT_EQ(i32_phis, 3);
+    ASSERT_EQ(ptr_phis, 1);
+    // b is addressed through the pointer phi, not from its base
+    std::shared_ptr<ir::Value> base;
+    for (auto &bb : func.bblocks)
+        for (auto &inst : bb->insts)
+            if (inst->op == ir::Instr::kOpBitcast)
+                base = inst->Result();
+    ASSERT_TRUE(base);
+    for (auto bb : l->blocks)
+        for (auto &inst : bb->insts)
+            if (inst->op == ir::Instr::kOpGetelementptr)
+                ASSERT_NE(dynamic_cast<ir::Getelementptr *>(inst.get())->ptr,
+                          base);
+}
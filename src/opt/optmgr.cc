@@ -12,14 +12,20 @@ std::map<std::string, OptModule *> module_name_map;
 OptModule modules[] = {
     OptModule{"init-bb-ptr", InitBBPtr, {}},
     OptModule{"build-dtree", BuildDTree, {InitBBPtr}},
+    OptModule{"loop-info", BuildLoopInfo, {InitBBPtr}},
     OptModule{"mem2reg", Mem2Reg, {BuildDTree}},
     OptModule{"constant-opt", ConstantOpt, {}},
+    OptModule{"dce", DeadCodeElim, {}},
+    OptModule{"sccp", SCCP, {Mem2Reg}},
+    OptModule{"gvn", GVN, {InitBBPtr}},
+    OptModule{"licm", LICM, {Mem2Reg}},
+    OptModule{"strength-reduce", StrengthReduce, {LICM}},
 };
 const int module_count = sizeof(modules) / sizeof(OptModule);
 
 std::vector<std::string> levels[] = {
     {},
-    {"mem2reg", "constant-opt"},
+    {"mem2reg", "sccp", "gvn", "licm", "strength-reduce", "dce"},
 };
 const int level_count =
     sizeof(levels) / sizeof(std::vector<std::string>);
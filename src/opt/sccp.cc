@@ -0,0 +1,276 @@
+/**
+ * Sparse Conditional Constant Propagation (Wegman & Zadeck)
+ *  Values start at top (undefined) and only move down the lattice
+ *  top -> constant -> bottom. A block is visited only after one of its
+ *  incoming edges becomes executable, and a branch on a constant only makes
+ *  the taken edge executable, so constants flow through phis whose other
+ *  incoming values are on dead paths.
+ * EG:
+ *  before:
+ *      br label %2
+ *  2:
+ *      %3 = phi i32 [1, %1], [%5, %4]
+ *      %c = icmp eq i32 %3, 1
+ *      br i1 %c, label %6, label %4
+ *  4:
+ *      %5 = add i32 %3, 1
+ *      br label %2
+ *  after:
+ *      br label %2
+ *  2:
+ *      br label %6
+ *
+ *  NOTE: loads of scalar global constants are treated as constants, the
+ *  constants themselves are deleted as in constant-opt
+ */
+
+#include "ir/ir.hpp"
+#include "opt/opt.h"
+
+namespace opt {
+
+namespace sccp {
+
+using GVT = std::shared_ptr<ir::Value>;
+
+struct Lattice {
+    enum { kTop, kConst, kBottom };
+    int state = kTop;
+    int val = 0;
+
+    bool operator!=(const Lattice &o) const {
+        return state != o.state || (state == kConst && val != o.val);
+    }
+};
+
+struct SCCPHelper {
+    ir::Module &m;
+    ir::Func &func;
+    std::map<ir::Value *, ir::Value *> &g_constants;
+
+    std::map<ir::Value *, Lattice> values;
+    std::map<ir::Value *, std::vector<ir::Instr *>> users;
+    std::map<ir::Instr *, ir::BB *> inst_bb;
+    std::set<ir::BB *> exec_bbs;
+    std::set<std::pair<ir::BB *, ir::BB *>> exec_edges;
+    std::vector<std::pair<ir::BB *, ir::BB *>> cfg_worklist;
+    std::vector<ir::Instr *> ssa_worklist;
+
+    SCCPHelper(ir::Module &m, ir::Func &func,
+               std::map<ir::Value *, ir::Value *> &g_constants)
+        : m(m), func(func), g_constants(g_constants) {}
+
+    Lattice Get(ir::Value *v) {
+        if (v->kind == ir::Value::kImm)
+            return {Lattice::kConst, dynamic_cast<ir::ImmValue *>(v)->imm};
+        auto it = values.find(v);
+        // arguments, globals and labels are unknown
+        if (it == values.end())
+            return {Lattice::kBottom};
+        return it->second;
+    }
+
+    void Set(GVT &v, Lattice x) {
+        auto &cur = values[v.get()];
+        if (!(cur != x))
+            return;
+        cur = x;
+        for (auto user : users[v.get()])
+            ssa_worklist.push_back(user);
+    }
+
+    void AddEdge(ir::BB *from, ir::BB *to) {
+        if (exec_edges.insert({from, to}).second)
+            cfg_worklist.push_back({from, to});
+    }
+
+    void VisitPhi(ir::Phi *phi, ir::BB *bb) {
+        Lattice x;
+        for (auto &pv : phi->vals) {
+            auto pred = func.label_map[pv.label.get()];
+            if (!exec_edges.count({pred, bb}))
+                continue;
+            auto v = Get(pv.val.get());
+            if (v.state == Lattice::kTop)
+                continue;
+            if (x.state == Lattice::kTop)
+                x = v;
+            else if (x != v)
+                x.state = Lattice::kBottom;
+        }
+        Set(phi->result, x);
+    }
+
+    void Visit(ir::Instr *inst, ir::BB *bb) {
+        if (inst->op == ir::Instr::kOpPhi)
+            return VisitPhi(dynamic_cast<ir::Phi *>(inst), bb);
+        if (inst->op == ir::Instr::kOpBr) {
+            auto br = dynamic_cast<ir::Br *>(inst);
+            auto l1 = func.label_map[br->l1.get()];
+            if (!br->cond)
+                return AddEdge(bb, l1);
+            auto l2 = func.label_map[br->l2.get()];
+            auto c = Get(br->cond.get());
+            if (c.state != Lattice::kConst || c.val)
+                AddEdge(bb, l1);
+            if (c.state != Lattice::kConst || !c.val)
+                AddEdge(bb, l2);
+            return;
+        }
+        if (!inst->HasResult())
+            return;
+
+        // operands must be constants, any top operand keeps result top
+        Lattice res{Lattice::kBottom};
+        auto eval = [&](std::vector<GVT *> ops, auto fn) {
+            std::vector<int> vals;
+            for (auto op : ops) {
+                auto x = Get(op->get());
+                if (x.state == Lattice::kBottom)
+                    return;
+                if (x.state == Lattice::kTop)
+                    res.state = Lattice::kTop;
+                vals.push_back(x.val);
+            }
+            if (res.state != Lattice::kTop && fn(vals, res.val))
+                res.state = Lattice::kConst;
+        };
+        if (inst->IsBinaryAlu()) {
+            auto alu = dynamic_cast<ir::BinaryAlu *>(inst);
+            eval({&alu->l, &alu->r}, [&](std::vector<int> &v, int &r) {
+                return EvalBinaryAlu(alu->op, v[0], v[1], r);
+            });
+        } else if (inst->op == ir::Instr::kOpIcmp) {
+            auto icmp = dynamic_cast<ir::Icmp *>(inst);
+            eval({&icmp->l, &icmp->r}, [&](std::vector<int> &v, int &r) {
+                r = EvalIcmp(icmp->cond, v[0], v[1]);
+                return true;
+            });
+        } else if (inst->op == ir::Instr::kOpZext) {
+            auto zext = dynamic_cast<ir::Zext *>(inst);
+            eval({&zext->val}, [&](std::vector<int> &v, int &r) {
+                r = v[0];
+                return true;
+            });
+        } else if (inst->op == ir::Instr::kOpLoad) {
+            auto load = dynamic_cast<ir::Load *>(inst);
+            auto it = g_constants.find(load->ptr.get());
+            if (it != g_constants.end())
+                res = Get(it->second);
+        }
+        auto result = inst->Result();
+        Set(result, res);
+    }
+
+    void Solve() {
+        for (auto &bb : func.bblocks) {
+            for (auto &inst : bb->insts) {
+                inst_bb[inst.get()] = bb.get();
+                if (inst->HasResult())
+                    values[inst->Result().get()] = Lattice();
+                for (auto p : inst->RValues())
+                    if (*p)
+                        users[p->get()].push_back(inst.get());
+            }
+        }
+
+        cfg_worklist.push_back({nullptr, func.bblocks[0].get()});
+        while (!cfg_worklist.empty() || !ssa_worklist.empty()) {
+            while (!cfg_worklist.empty()) {
+                auto bb = cfg_worklist.back().second;
+                cfg_worklist.pop_back();
+                bool first = exec_bbs.insert(bb).second;
+                // a new edge only changes phis, other instructions are
+                // visited the first time the block becomes executable
+                for (auto &inst : bb->insts)
+                    if (first || inst->op == ir::Instr::kOpPhi)
+                        Visit(inst.get(), bb);
+            }
+            while (!ssa_worklist.empty()) {
+                auto inst = ssa_worklist.back();
+                ssa_worklist.pop_back();
+                auto bb = inst_bb[inst];
+                if (exec_bbs.count(bb))
+                    Visit(inst, bb);
+            }
+        }
+    }
+
+    void Rewrite() {
+        std::map<GVT, GVT> c_var_map;
+        for (auto &bb : func.bblocks) {
+            for (auto &inst : bb->insts) {
+                if (!inst->HasResult())
+                    continue;
+                auto res = inst->Result();
+                auto x = Get(res.get());
+                if (x.state == Lattice::kConst)
+                    c_var_map[res] = m.CreateImm(x.val, res->ty);
+            }
+        }
+
+        for (auto &bb : func.bblocks) {
+            auto &insts = bb->insts;
+            for (auto it = insts.begin(); it != insts.end();) {
+                auto res = (*it)->Result();
+                if (res && c_var_map.count(res) &&
+                    (*it)->op != ir::Instr::kOpCall) {
+                    if (res->kind == ir::Value::kLocalVar)
+                        func.vars.erase(
+                            std::dynamic_pointer_cast<ir::LocalVar>(res)
+                                ->var());
+                    it = insts.erase(it);
+                    continue;
+                }
+                (*it)->ReplaceValues(c_var_map);
+                it++;
+            }
+            // branches whose edges are dead on one side become constant
+            auto br = dynamic_cast<ir::Br *>(insts.back().get());
+            if (br && br->cond && exec_bbs.count(bb.get())) {
+                bool t = exec_edges.count(
+                    {bb.get(), func.label_map[br->l1.get()]});
+                bool f = exec_edges.count(
+                    {bb.get(), func.label_map[br->l2.get()]});
+                if (t != f)
+                    br->cond = m.CreateImm(t, ir::t_i1);
+            }
+        }
+
+        // unvisited blocks are unreachable once constant branches are folded
+        FoldConstBranches(func);
+        RemoveUnreachableBBs(func);
+        func.ResetTmpVar();
+    }
+};
+
+} // namespace sccp
+
+void SCCP(ir::Module &m) {
+    // scalar global constants, deleted at the end as in constant-opt
+    std::map<ir::Value *, ir::Value *> g_constants;
+    for (auto &def : m.defs) {
+        if (!def->is_const || def->init->kind != ir::InitVal::kBasic)
+            continue;
+        auto init = dynamic_cast<ir::BasicInit *>(def->init.get());
+        if (init->val->kind == ir::Value::kImm)
+            g_constants[def->var.get()] = init->val.get();
+    }
+
+    for (auto &func : m.funcs) {
+        sccp::SCCPHelper helper(m, *func, g_constants);
+        helper.Solve();
+        helper.Rewrite();
+    }
+
+    for (auto it = m.defs.begin(); it != m.defs.end();) {
+        if (g_constants.count((*it)->var.get())) {
+            m.vars.erase((*it)->var->name);
+            it = m.defs.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+} // namespace opt
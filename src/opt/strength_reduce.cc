@@ -0,0 +1,406 @@
+/**
+ * Induction Variable Strength Reduction
+ *  A basic induction variable is a phi in the loop header updated once per
+ *  iteration by an invariant step: `i = phi [init, pre], [i + c, latch]`.
+ *  Values computed from it with add / sub, and mul by an invariant, are
+ *  derived induction variables: each one is a recurrence {start, +, step}
+ *  whose start and step can be computed in the preheader.
+ *
+ *  1. basic induction variables of the same loop with the same start and
+ *     step are merged
+ *  2. a derived mul becomes a new header phi increased by its step in the
+ *     latch
+ *  3. a getelementptr whose index is an induction variable scaled by a
+ *     stride that is not a power of two (a multiply in the backend) becomes
+ *     a pointer phi, moved by a constant number of elements in the latch
+ *
+ *  Loops are handled from the inside out and need the preheader made by
+ *  licm. Only values whose users are all inside the loop are rewritten, the
+ *  old increments of merged variables are left for dce.
+ * EG:
+ *  before:
+ *  p:
+ *      br label %1
+ *  1:
+ *      %i = phi i32 [0, %p], [%6, %2]
+ *      ...
+ *  2:
+ *      %3 = mul i32 %i, %n
+ *      %4 = getelementptr [20 x [20 x i32]], [20 x [20 x i32]]* @A, i32 0, i32 %i
+ *      %6 = add i32 %i, 1
+ *      br label %1
+ *  after:
+ *  p:
+ *      %a = getelementptr [20 x [20 x i32]], [20 x [20 x i32]]* @A, i32 0, i32 0
+ *      br label %1
+ *  1:
+ *      %t = phi i32 [0, %p], [%t1, %2]
+ *      %q = phi [20 x i32]* [%a, %p], [%q1, %2]
+ *      %i = phi i32 [0, %p], [%6, %2]
+ *      ...
+ *  2:
+ *      %6 = add i32 %i, 1
+ *      %t1 = add i32 %t, %n
+ *      %q1 = getelementptr [20 x i32], [20 x i32]* %q, i32 1
+ *      br label %1
+ */
+
+#include "ir/ir.hpp"
+#include "opt/opt.h"
+#include <algorithm>
+
+namespace opt {
+
+namespace sr {
+
+using GVT = std::shared_ptr<ir::Value>;
+using loop::Loop;
+
+static bool IsImm(GVT &v, int imm) {
+    return v->kind == ir::Value::kImm &&
+           std::dynamic_pointer_cast<ir::ImmValue>(v)->imm == imm;
+}
+
+struct SRHelper {
+    ir::Module &m;
+    ir::Func &func;
+    std::map<ir::Value *, ir::BB *> def_bb;
+    std::map<ir::Value *, std::vector<ir::BB *>> users;
+
+    // per loop
+    Loop *l;
+    std::map<ir::Value *, ir::Instr *> recs; // induction variables -> def
+    std::map<ir::Value *, GVT> basic_start, basic_step;
+    std::map<ir::Value *, GVT> start_cache, step_cache;
+
+    SRHelper(ir::Module &m, ir::Func &func) : m(m), func(func) {
+        for (auto &bb : func.bblocks) {
+            for (auto &inst : bb->insts) {
+                if (inst->HasResult())
+                    def_bb[inst->Result().get()] = bb.get();
+                for (auto p : inst->RValues())
+                    if (*p)
+                        users[p->get()].push_back(bb.get());
+            }
+        }
+    }
+
+    bool Invariant(ir::Value *v) {
+        auto it = def_bb.find(v);
+        return it == def_bb.end() || !l->Contains(it->second);
+    }
+
+    bool UsedOnlyInLoop(ir::Value *v) {
+        for (auto bb : users[v])
+            if (!l->Contains(bb))
+                return false;
+        return true;
+    }
+
+    // computed in the preheader, immediates are folded
+    GVT Emit(int op, GVT a, GVT b) {
+        if (a->kind == ir::Value::kImm && b->kind == ir::Value::kImm) {
+            int res;
+            EvalBinaryAlu(op, std::dynamic_pointer_cast<ir::ImmValue>(a)->imm,
+                          std::dynamic_pointer_cast<ir::ImmValue>(b)->imm,
+                          res);
+            return m.CreateImm(res);
+        }
+        if ((op == ir::Instr::kOpAdd || op == ir::Instr::kOpSub) &&
+            IsImm(b, 0))
+            return a;
+        if (op == ir::Instr::kOpAdd && IsImm(a, 0))
+            return b;
+        if (op == ir::Instr::kOpMul && (IsImm(a, 0) || IsImm(b, 0)))
+            return m.CreateImm(0);
+        if (op == ir::Instr::kOpMul && (IsImm(a, 1) || IsImm(b, 1)))
+            return IsImm(a, 1) ? b : a;
+        auto pre = l->preheader;
+        auto res = func.CreateTmpVar(ir::t_i32);
+        pre->insts.insert(
+            pre->insts.end() - 1,
+            std::make_unique<ir::BinaryAlu>(op, ir::t_i32, a, b, res));
+        def_bb[res.get()] = pre;
+        return res;
+    }
+
+    GVT Start(GVT v) {
+        if (Invariant(v.get()))
+            return v;
+        auto &cache = start_cache[v.get()];
+        if (cache)
+            return cache;
+        auto inst = recs.at(v.get());
+        if (inst->op == ir::Instr::kOpPhi)
+            return cache = basic_start[v.get()];
+        auto alu = dynamic_cast<ir::BinaryAlu *>(inst);
+        return cache = Emit(alu->op, Start(alu->l), Start(alu->r));
+    }
+
+    GVT Step(GVT v) {
+        if (Invariant(v.get()))
+            return m.CreateImm(0);
+        auto &cache = step_cache[v.get()];
+        if (cache)
+            return cache;
+        auto inst = recs.at(v.get());
+        if (inst->op == ir::Instr::kOpPhi)
+            return cache = basic_step[v.get()];
+        auto alu = dynamic_cast<ir::BinaryAlu *>(inst);
+        if (alu->op != ir::Instr::kOpMul)
+            return cache = Emit(alu->op, Step(alu->l), Step(alu->r));
+        // one side is invariant
+        auto &iv = Invariant(alu->l.get()) ? alu->r : alu->l;
+        auto &k = Invariant(alu->l.get()) ? alu->l : alu->r;
+        return cache = Emit(ir::Instr::kOpMul, Step(iv), k);
+    }
+
+    // i = phi [init, pre], [i + c, latch]
+    void FindBasicIVs() {
+        auto pre = l->preheader->label, latch = l->latches[0]->label;
+        std::vector<ir::Phi *> ivs;
+        for (auto &inst : l->header->insts) {
+            if (inst->op != ir::Instr::kOpPhi)
+                break;
+            auto phi = dynamic_cast<ir::Phi *>(inst.get());
+            if (phi->ty->kind != ir::Type::kI32 || phi->vals.size() != 2)
+                continue;
+            GVT init, next;
+            for (auto &pv : phi->vals)
+                (pv.label == pre ? init : next) = pv.val;
+            if (!init || !next || next->kind == ir::Value::kImm)
+                continue;
+            auto it = def_bb.find(next.get());
+            if (it == def_bb.end() || !l->Contains(it->second))
+                continue;
+            auto alu = FindAlu(next.get());
+            if (!alu)
+                continue;
+            GVT step;
+            if (alu->op == ir::Instr::kOpAdd && alu->l == phi->result &&
+                Invariant(alu->r.get()))
+                step = alu->r;
+            else if (alu->op == ir::Instr::kOpAdd && alu->r == phi->result &&
+                     Invariant(alu->l.get()))
+                step = alu->l;
+            else if (alu->op == ir::Instr::kOpSub &&
+                     alu->l == phi->result && Invariant(alu->r.get()))
+                step = Emit(ir::Instr::kOpSub, m.CreateImm(0), alu->r);
+            if (!step)
+                continue;
+            recs[phi->result.get()] = phi;
+            basic_start[phi->result.get()] = init;
+            basic_step[phi->result.get()] = step;
+            ivs.push_back(phi);
+        }
+
+        // the same start and step give the same value in every iteration
+        std::map<GVT, GVT> replace;
+        for (int i = 0; i < ivs.size(); i++) {
+            auto a = ivs[i]->result.get();
+            for (int j = 0; j < i; j++) {
+                auto b = ivs[j]->result.get();
+                if (replace.count(ivs[j]->result) ||
+                    basic_start[a] != basic_start[b] ||
+                    basic_step[a] != basic_step[b])
+                    continue;
+                replace[ivs[i]->result] = ivs[j]->result;
+                recs.erase(a);
+                break;
+            }
+        }
+        if (replace.empty())
+            return;
+        Erase(replace);
+        // uses after the loop see the same value as well
+        for (auto &bb : func.bblocks)
+            for (auto &inst : bb->insts)
+                inst->ReplaceValues(replace);
+    }
+
+    ir::BinaryAlu *FindAlu(ir::Value *v) {
+        for (auto &inst : def_bb[v]->insts)
+            if (inst->Result().get() == v)
+                return dynamic_cast<ir::BinaryAlu *>(inst.get());
+        return nullptr;
+    }
+
+    // derived induction variables, in dominator tree order
+    void FindDerivedIVs(std::vector<ir::BB *> &order) {
+        auto rec = [&](GVT &v) { return recs.count(v.get()) > 0; };
+        for (auto bb : order) {
+            for (auto &inst : bb->insts) {
+                auto alu = dynamic_cast<ir::BinaryAlu *>(inst.get());
+                if (!alu || recs.count(alu->result.get()))
+                    continue;
+                bool l_inv = Invariant(alu->l.get()),
+                     r_inv = Invariant(alu->r.get());
+                if (l_inv && r_inv)
+                    continue;
+                bool ok = false;
+                if (alu->op == ir::Instr::kOpAdd ||
+                    alu->op == ir::Instr::kOpSub)
+                    ok = (l_inv || rec(alu->l)) && (r_inv || rec(alu->r));
+                else if (alu->op == ir::Instr::kOpMul)
+                    ok = (l_inv && rec(alu->r)) || (r_inv && rec(alu->l));
+                if (ok)
+                    recs[alu->result.get()] = alu;
+            }
+        }
+    }
+
+    // new header phi for a recurrence, returns the phi
+    GVT AddRecurrence(std::shared_ptr<ir::Type> ty, GVT start,
+                      std::function<GVT(GVT, ir::BB *)> next) {
+        auto latch = l->latches[0];
+        auto phi = std::make_unique<ir::Phi>();
+        phi->ty = ty;
+        phi->result = func.CreateTmpVar(ty);
+        auto res = phi->result;
+        phi->vals.push_back({start, l->preheader->label});
+        phi->vals.push_back({next(res, latch), latch->label});
+        l->header->insts.insert(l->header->insts.begin(), std::move(phi));
+        def_bb[res.get()] = l->header;
+        return res;
+    }
+
+    GVT Append(ir::BB *bb, std::unique_ptr<ir::Instr> inst) {
+        auto res = inst->Result();
+        bb->insts.insert(bb->insts.end() - 1, std::move(inst));
+        def_bb[res.get()] = bb;
+        return res;
+    }
+
+    bool ReduceMul(ir::BinaryAlu *alu, std::map<GVT, GVT> &replace) {
+        if (!recs.count(alu->result.get()) ||
+            !UsedOnlyInLoop(alu->result.get()))
+            return false;
+        auto start = Start(alu->result), step = Step(alu->result);
+        replace[alu->result] = AddRecurrence(
+            ir::t_i32, start, [&](GVT cur, ir::BB *latch) {
+                return Append(latch, std::make_unique<ir::BinaryAlu>(
+                                         ir::Instr::kOpAdd, ir::t_i32, cur,
+                                         step, func.CreateTmpVar(ir::t_i32)));
+            });
+        return true;
+    }
+
+    bool ReduceGEP(ir::Getelementptr *gep, std::map<GVT, GVT> &replace) {
+        if (!Invariant(gep->ptr.get()) || gep->indices.size() > 2 ||
+            !UsedOnlyInLoop(gep->result.get()))
+            return false;
+        std::vector<int> strides{gep->ty->size()};
+        if (gep->indices.size() == 2)
+            strides.push_back(gep->ty->cast<ir::ArrayT>()->element->size());
+        auto elem = gep->result->ty->cast<ir::PtrT>()->p;
+
+        bool need = false;
+        for (int i = 0; i < gep->indices.size(); i++) {
+            auto &idx = gep->indices[i];
+            if (Invariant(idx.get()))
+                continue;
+            if (!recs.count(idx.get()))
+                return false;
+            need |= (strides[i] & (strides[i] - 1)) != 0;
+        }
+        if (!need)
+            return false;
+
+        std::vector<GVT> start_indices;
+        GVT step = m.CreateImm(0);
+        for (int i = 0; i < gep->indices.size(); i++) {
+            auto &idx = gep->indices[i];
+            start_indices.push_back(Start(idx));
+            auto scaled = Emit(ir::Instr::kOpMul, Step(idx),
+                               m.CreateImm(strides[i] / elem->size()));
+            step = Emit(ir::Instr::kOpAdd, step, scaled);
+        }
+        auto start = Append(l->preheader, std::make_unique<ir::Getelementptr>(
+                                              gep->ty, gep->ptr, start_indices,
+                                              func.CreateTmpVar(gep->result->ty)));
+        replace[gep->result] = AddRecurrence(
+            gep->result->ty, start, [&](GVT cur, ir::BB *latch) {
+                return Append(latch,
+                              std::make_unique<ir::Getelementptr>(
+                                  elem, cur, std::vector<GVT>{step},
+                                  func.CreateTmpVar(gep->result->ty)));
+            });
+        return true;
+    }
+
+    void Run(Loop *loop) {
+        for (auto child : loop->children)
+            Run(child);
+        l = loop;
+        if (!l->preheader || l->latches.size() != 1)
+            return;
+        recs.clear(), basic_start.clear(), basic_step.clear();
+        start_cache.clear(), step_cache.clear();
+
+        std::vector<ir::BB *> order, stack{l->header};
+        while (!stack.empty()) {
+            auto bb = stack.back();
+            stack.pop_back();
+            order.push_back(bb);
+            auto &children = dtree::GetNode(bb).children;
+            for (auto c = children.rbegin(); c != children.rend(); c++)
+                if (l->Contains(*c))
+                    stack.push_back(*c);
+        }
+
+        FindBasicIVs();
+        FindDerivedIVs(order);
+
+        // rewriting inserts into the header and the latch, collect first
+        std::vector<ir::Instr *> candidates;
+        for (auto bb : order)
+            for (auto &inst : bb->insts)
+                if (inst->op == ir::Instr::kOpMul ||
+                    inst->op == ir::Instr::kOpGetelementptr)
+                    candidates.push_back(inst.get());
+
+        std::map<GVT, GVT> replace;
+        for (auto inst : candidates) {
+            if (inst->op == ir::Instr::kOpMul)
+                ReduceMul(dynamic_cast<ir::BinaryAlu *>(inst), replace);
+            else
+                ReduceGEP(dynamic_cast<ir::Getelementptr *>(inst), replace);
+        }
+        ReplaceInLoop(replace);
+    }
+
+    // ReplaceValues also renames results, drop the old definitions first
+    void Erase(std::map<GVT, GVT> &replace) {
+        for (auto &[old, _] : replace) {
+            auto &insts = def_bb[old.get()]->insts;
+            insts.erase(std::find_if(insts.begin(), insts.end(),
+                                     [&](std::unique_ptr<ir::Instr> &inst) {
+                                         return inst->Result() == old;
+                                     }));
+            def_bb.erase(old.get());
+        }
+    }
+
+    void ReplaceInLoop(std::map<GVT, GVT> &replace) {
+        if (replace.empty())
+            return;
+        Erase(replace);
+        for (auto bb : l->blocks)
+            for (auto &inst : bb->insts)
+                inst->ReplaceValues(replace);
+    }
+};
+
+} // namespace sr
+
+void StrengthReduce(ir::Module &m) {
+    BuildLoopInfo(m);
+    for (auto &func : m.funcs) {
+        sr::SRHelper helper(m, *func);
+        for (auto l : loop::TopLevel(*func))
+            helper.Run(l);
+        func->ResetTmpVar();
+    }
+}
+
+} // namespace opt